@@ -20,6 +20,10 @@ namespace CMU462 {
 
 Application::Application(AppConfig config) {
 
+  headless = false;
+
+  threadPool = new ThreadPool(config.pathtracer_num_threads);
+
   pathtracer = new PathTracer (
     config.pathtracer_ns_aa,
     config.pathtracer_max_ray_depth,
@@ -29,7 +33,20 @@ Application::Application(AppConfig config) {
     config.pathtracer_ns_refr,
     config.pathtracer_num_threads,
     config.pathtracer_envmap,
-    config.pathtracer_BDPT
+    config.pathtracer_BDPT,
+    config.pathtracer_bvh_report,
+    config.pathtracer_sah_ct,
+    config.pathtracer_sah_ci,
+    threadPool,
+    config.pathtracer_ns_pass,
+    config.pathtracer_adaptive_error,
+    config.pathtracer_seed,
+    config.pathtracer_sequence,
+    config.pathtracer_ns_light_cache,
+    config.pathtracer_time_budget,
+    config.pathtracer_tile_size,
+    config.pathtracer_checkpoint,
+    config.pathtracer_checkpoint_interval
   );
 
 }
@@ -37,12 +54,15 @@ Application::Application(AppConfig config) {
 Application::~Application() {
 
   delete pathtracer;
+  delete threadPool;
 
 }
 
 void Application::init() {
 
+#ifndef DISABLE_GL
   textManager.init(use_hdpi);
+#endif
   text_color = Color(1.0, 1.0, 1.0);
 
   // Setup all the basic internal state to default values,
@@ -57,6 +77,7 @@ void Application::init() {
   show_coordinates = true;
   show_hud = true;
 
+#ifndef DISABLE_GL
   // Lighting needs to be explicitly enabled.
   glEnable(GL_LIGHTING);
 
@@ -67,6 +88,7 @@ void Application::init() {
   glHint( GL_LINE_SMOOTH_HINT, GL_NICEST );
   glHint( GL_POLYGON_SMOOTH_HINT, GL_NICEST );
   glHint(GL_POINT_SMOOTH_HINT,GL_NICEST);
+#endif
 
   // Initialize styles (colors, line widths, etc.) that will be used
   // to draw different types of mesh elements in various situations.
@@ -146,6 +168,7 @@ void Application::render() {
 }
 
 void Application::update_gl_camera() {
+#ifndef DISABLE_GL
 
   // Call resize() every time we draw, since it doesn't seem
   // to get called by the Viewer upon initial window creation
@@ -167,13 +190,16 @@ void Application::update_gl_camera() {
   gluLookAt(c.x, c.y, c.z,
             r.x, r.y, r.z,
             u.x, u.y, u.z);
+#endif
 }
 
 void Application::resize(size_t w, size_t h) {
   screenW = w;
   screenH = h;
   camera.set_screen_size(w, h);
+#ifndef DISABLE_GL
   textManager.resize(w, h);
+#endif
   set_projection_matrix();
   if (mode != EDIT_MODE) {
     pathtracer->set_frame_size(w, h);
@@ -181,12 +207,15 @@ void Application::resize(size_t w, size_t h) {
 }
 
 void Application::set_projection_matrix() {
+  if (headless) return;
+#ifndef DISABLE_GL
   glMatrixMode(GL_PROJECTION);
   glLoadIdentity();
   gluPerspective(camera.v_fov(),
                  camera.aspect_ratio(),
                  camera.near_clip(),
                  camera.far_clip());
+#endif
 }
 
 string Application::name() {
@@ -417,6 +446,9 @@ void Application::keyboard_event(int key, int event, unsigned char mods) {
         case 's': case 'S':
             pathtracer->save_image();
             break;
+        case 'h': case 'H':
+            pathtracer->save_traversal_heatmap();
+            break;
         case '+': case '=':
             pathtracer->stop();
             pathtracer->increase_area_light_sample_count();
@@ -590,22 +622,115 @@ void Application::set_up_pathtracer() {
 
 }
 
+void Application::set_up_headless(SceneInfo* sceneInfo, size_t w, size_t h) {
+
+  // same defaults as init(), minus everything that needs a GL context
+  headless = true;
+  initialize_style();
+  mode = EDIT_MODE;
+  scene = nullptr;
+
+  screenW = w;
+  screenH = h;
+  CameraInfo cameraInfo;
+  cameraInfo.hFov = 50;
+  cameraInfo.vFov = 35;
+  cameraInfo.nClip = 0.01;
+  cameraInfo.fClip = 100;
+  camera.configure(cameraInfo, screenW, screenH);
+
+  Timer timer;
+
+  // build the dynamic scene and place the camera //
+  timer.start();
+  load(sceneInfo);
+  timer.stop();
+  fprintf(stdout, "[PathTracer] Scene loaded (%.4f sec)\n", timer.duration());
+
+  // convert to the static scene and build the BVH //
+  timer.start();
+  set_up_pathtracer();
+  timer.stop();
+  fprintf(stdout, "[PathTracer] Pathtracer set up (%.4f sec)\n",
+          timer.duration());
+}
+
+bool Application::render_headless(SceneInfo* sceneInfo, const string& path,
+                                  size_t w, size_t h,
+                                  const RenderCheckpoint* resume) {
+
+  set_up_headless(sceneInfo, w, h);
+
+  // render //
+  Timer timer;
+  timer.start();
+  if (resume) {
+    if (!pathtracer->resume_raytracing(*resume)) return false;
+  } else {
+    pathtracer->start_raytracing();
+  }
+  threadPool->wait();
+  pathtracer->wait_for_checkpoints();
+  timer.stop();
+  fprintf(stdout, "[PathTracer] Rendered %zux%zu (%.4f sec)\n",
+          screenW, screenH, timer.duration());
+
+  // write //
+  timer.start();
+  bool saved = pathtracer->save_image(path);
+  timer.stop();
+  if (saved) {
+    fprintf(stdout, "[PathTracer] Image written (%.4f sec)\n",
+            timer.duration());
+  }
+
+  return saved;
+}
+
+bool Application::report_headless(SceneInfo* sceneInfo, size_t w, size_t h) {
+  set_up_headless(sceneInfo, w, h);
+  return pathtracer->bvh_report_written();
+}
+
+bool Application::render_worker(SceneInfo* sceneInfo, RenderWorker* worker) {
+
+  const RenderJob& job = worker->get_job();
+  set_up_headless(sceneInfo, job.width, job.height);
+
+  return worker->serve(pathtracer->render_settings(),
+                       [this](size_t first, size_t count,
+                              const HDRImageBuffer** sums,
+                              const vector<unsigned int>** counts) {
+    pathtracer->start_raytracing(first, count);
+    threadPool->wait();
+    *sums = &pathtracer->get_sample_buffer();
+    *counts = &pathtracer->get_sample_counts();
+    // back to READY for the next range, the buffers stay until it starts
+    pathtracer->stop();
+  });
+}
+
 Matrix4x4 Application::get_world_to_3DH() {
   Matrix4x4 P, M;
+#ifndef DISABLE_GL
   glGetDoublev(GL_PROJECTION_MATRIX, &P(0, 0));
   glGetDoublev(GL_MODELVIEW_MATRIX, &M(0, 0));
+#endif
   return P * M;
 }
 
 inline void Application::draw_string(float x, float y,
   string str, size_t size, const Color& c) {
+#ifndef DISABLE_GL
   int line_index = textManager.add_line(( x * 2 / screenW) - 1.0,
                                         (-y * 2 / screenH) + 1.0,
                                         str, size, c);
   messages.push_back(line_index);
+#endif
 }
 
 void Application::draw_coordinates() {
+#ifndef DISABLE_GL
 
   glDisable(GL_DEPTH_TEST);
   glDisable(GL_LIGHTING);
@@ -637,9 +762,11 @@ void Application::draw_coordinates() {
   glEnable(GL_LIGHTING);
   glEnable(GL_DEPTH_TEST);
 
+#endif
 }
 
 void Application::draw_hud() {
+#ifndef DISABLE_GL
   textManager.clear();
   messages.clear();
 
@@ -719,6 +846,7 @@ void Application::draw_hud() {
   glEnable(GL_DEPTH_TEST);
 
   textManager.render();
+#endif
 }
 
 } // namespace CMU462
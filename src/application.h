@@ -12,7 +12,9 @@
 // libCMU462
 #include "CMU462/CMU462.h"
 #include "CMU462/renderer.h"
+#ifndef DISABLE_GL
 #include "CMU462/osdtext.h"
+#endif
 
 // COLLADA
 #include "collada/collada.h"
@@ -30,6 +32,7 @@
 #include "static_scene/scene.h"
 #include "pathtracer.h"
 #include "image.h"
+#include "distributed.h"
 
 // Shared modules
 #include "camera.h"
@@ -54,6 +57,18 @@ struct AppConfig {
     pathtracer_envmap = NULL;
     pathtracer_BDPT = 0;
 
+    pathtracer_sah_ct = 1;
+    pathtracer_sah_ci = 1;
+
+    pathtracer_ns_pass = 0;
+    pathtracer_adaptive_error = 0;
+    pathtracer_seed = 0;
+    pathtracer_sequence = SEQUENCE_RANDOM;
+    pathtracer_ns_light_cache = 0;
+    pathtracer_time_budget = 0;
+    pathtracer_tile_size = 32;
+    pathtracer_checkpoint_interval = 60;
+
   }
 
   size_t pathtracer_ns_aa;
@@ -66,6 +81,20 @@ struct AppConfig {
   size_t pathtracer_BDPT;
   HDRImageBuffer* pathtracer_envmap;
 
+  std::string pathtracer_bvh_report;
+  double pathtracer_sah_ct;
+  double pathtracer_sah_ci;
+
+  size_t pathtracer_ns_pass;
+  double pathtracer_adaptive_error;
+  size_t pathtracer_seed;
+  SampleSequence pathtracer_sequence;
+  size_t pathtracer_ns_light_cache;
+  double pathtracer_time_budget;
+  size_t pathtracer_tile_size;
+  std::string pathtracer_checkpoint;
+  double pathtracer_checkpoint_interval;
+
 };
 
 class Application : public Renderer {
@@ -89,6 +118,42 @@ class Application : public Renderer {
 
   void load(Collada::SceneInfo* sceneInfo);
 
+  /**
+   * Render a scene without a window or GL context: loads the scene with the
+   * camera from the scene file, renders it with the configured pathtracer
+   * settings, waits for the render to finish and saves it to a file. Prints
+   * the time spent in every phase.
+   * \param sceneInfo the parsed scene
+   * \param path output file, written as exr if it ends in .exr, png otherwise
+   * \param w image width
+   * \param h image height
+   * \param resume checkpoint of the render to continue, if any
+   * \return true if the image was rendered and written
+   */
+  bool render_headless(Collada::SceneInfo* sceneInfo, const std::string& path,
+                       size_t w, size_t h,
+                       const RenderCheckpoint* resume = NULL);
+
+  /**
+   * Load the scene and write the BVH quality report, without rendering and
+   * without a window or GL context.
+   * \param sceneInfo the parsed scene
+   * \param w image width
+   * \param h image height
+   * \return true if the report was written
+   */
+  bool report_headless(Collada::SceneInfo* sceneInfo, size_t w, size_t h);
+
+  /**
+   * Work for a distributed render without a window or GL context: loads the
+   * scene at the job's resolution and renders the sample ranges handed out
+   * by the coordinator until it has no more work.
+   * \param sceneInfo the parsed scene
+   * \param worker worker connected to the coordinator
+   * \return false if the connection to the coordinator broke
+   */
+  bool render_worker(Collada::SceneInfo* sceneInfo, RenderWorker* worker);
+
  private:
 
   enum Mode {
@@ -101,8 +166,15 @@ class Application : public Renderer {
   void to_edit_mode();
   void set_up_pathtracer();
 
+  /**
+   * Load the scene and set up the pathtracer for rendering without a window,
+   * printing the time every step takes.
+   */
+  void set_up_headless(Collada::SceneInfo* sceneInfo, size_t w, size_t h);
+
   DynamicScene::Scene *scene;
   PathTracer* pathtracer;
+  ThreadPool* threadPool;  ///< worker threads shared by renders and builds
 
   // View Frustrum Variables.
   // On resize, the aspect ratio is changed. On reset_camera, the position and
@@ -120,6 +192,9 @@ class Application : public Renderer {
   // Rate of translation on scrolling.
   double scroll_rate;
 
+  // Rendering without a window, all GL calls are skipped.
+  bool headless;
+
   /*
     Called whenever the camera fov or screenW/screenH changes.
   */
@@ -182,7 +257,9 @@ class Application : public Renderer {
   void mouse_moved(float x, float y);     // Mouse Moved.
 
   // OSD text manager //
+#ifndef DISABLE_GL
   OSDText textManager;
+#endif
   Color text_color;
   vector<int> messages;
 
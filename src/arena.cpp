@@ -0,0 +1,56 @@
+#include "arena.h"
+
+#include <cstdlib>
+
+namespace CMU462 {
+
+// alignment of every allocation, enough for any type we store
+static const size_t kArenaAlign = 16;
+
+MemoryArena::MemoryArena(size_t block_size)
+  : block_size(block_size), current(0), offset(0) { }
+
+MemoryArena::~MemoryArena() {
+  for (size_t i = 0; i < blocks.size(); ++i) free(blocks[i].data);
+}
+
+void* MemoryArena::alloc(size_t bytes) {
+
+  bytes = (bytes + kArenaAlign - 1) & ~(kArenaAlign - 1);
+
+  // move on to the next block that is large enough, allocating one if the
+  // blocks held so far are all used up
+  while (current < blocks.size() && offset + bytes > blocks[current].size) {
+    current++;
+    offset = 0;
+  }
+  if (current == blocks.size()) {
+    Block block;
+    block.size = bytes > block_size ? bytes : block_size;
+    block.data = static_cast<char*>(malloc(block.size));
+    if (!block.data) throw std::bad_alloc();
+    blocks.push_back(block);
+  }
+
+  void* p = blocks[current].data + offset;
+  offset += bytes;
+  return p;
+}
+
+void MemoryArena::reset() {
+  current = 0;
+  offset = 0;
+}
+
+size_t MemoryArena::capacity() const {
+  size_t total = 0;
+  for (size_t i = 0; i < blocks.size(); ++i) total += blocks[i].size;
+  return total;
+}
+
+MemoryArena& MemoryArena::thread_arena() {
+  static thread_local MemoryArena arena;
+  return arena;
+}
+
+}  // namespace CMU462
@@ -0,0 +1,80 @@
+#ifndef CMU462_ARENA_H
+#define CMU462_ARENA_H
+
+#include <new>
+#include <vector>
+#include <cstddef>
+
+namespace CMU462 {
+
+/**
+ * A bump allocator for short lived allocations, such as the subpaths of one
+ * pixel sample. Allocations are never freed one by one; reset() releases all
+ * of them at once and keeps the memory blocks for reuse, so a thread that
+ * resets its arena after every pixel stops calling malloc after the first
+ * few pixels. Only trivially destructible types may live in an arena.
+ */
+class MemoryArena {
+ public:
+
+  /**
+   * Constructor.
+   * \param block_size size of the blocks memory is taken from, larger
+   *        allocations get a block of their own
+   */
+  MemoryArena(size_t block_size = 256 * 1024);
+
+  /**
+   * Destructor.
+   * Frees all blocks.
+   */
+  ~MemoryArena();
+
+  /**
+   * Allocate uninitialized memory, aligned for any type.
+   * \param bytes size of the allocation
+   */
+  void* alloc(size_t bytes);
+
+  /**
+   * Allocate an array of n default constructed objects.
+   */
+  template <typename T>
+  T* alloc(size_t n) {
+    T* p = static_cast<T*>(alloc(n * sizeof(T)));
+    for (size_t i = 0; i < n; ++i) new (&p[i]) T();
+    return p;
+  }
+
+  /**
+   * Release all allocations, keeping the blocks.
+   */
+  void reset();
+
+  /**
+   * Total size of the blocks held by the arena.
+   */
+  size_t capacity() const;
+
+  /**
+   * The calling thread's arena.
+   */
+  static MemoryArena& thread_arena();
+
+ private:
+
+  struct Block {
+    char* data;
+    size_t size;
+  };
+
+  size_t block_size;          ///< size of regular blocks
+  std::vector<Block> blocks;  ///< blocks in use order
+  size_t current;             ///< block allocations are taken from
+  size_t offset;              ///< first free byte of the current block
+
+};
+
+}  // namespace CMU462
+
+#endif  // CMU462_ARENA_H
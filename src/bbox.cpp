@@ -1,6 +1,8 @@
 #include "bbox.h"
 
+#ifndef DISABLE_GL
 #include "GL/glew.h"
+#endif
 
 #include <algorithm>
 #include <iostream>
@@ -37,6 +39,7 @@ bool BBox::intersect(const Ray& r, double& t0, double& t1) const {
 }
 
 void BBox::draw(Color c) const {
+#ifndef DISABLE_GL
 
   glColor4f(c.r, c.g, c.b, c.a);
 
@@ -70,6 +73,7 @@ void BBox::draw(Color c) const {
   glVertex3d(min.x, min.y, max.z);
   glEnd();
 
+#endif
 }
 
 std::ostream& operator<<(std::ostream& os, const BBox& b) {
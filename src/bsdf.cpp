@@ -42,6 +42,10 @@ Spectrum DiffuseBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) {
   return albedo * (1.0 / PI);
 }
 
+float DiffuseBSDF::pdf(const Vector3D& wo, const Vector3D& wi) {
+  return std::max(0.0, cos_theta(wi)) / PI;
+}
+
 // Mirror BSDF //
 
 Spectrum MirrorBSDF::f(const Vector3D& wo, const Vector3D& wi) {
@@ -56,6 +60,10 @@ Spectrum MirrorBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) {
   return (1.f / cos_theta(wo)) * reflectance;
 }
 
+float MirrorBSDF::pdf(const Vector3D& wo, const Vector3D& wi) {
+  return 0;
+}
+
 // Glossy BSDF //
 
 /*
@@ -96,6 +104,10 @@ Spectrum RefractionBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf)
       return Spectrum();  // total internal reflection case
 }
 
+float RefractionBSDF::pdf(const Vector3D& wo, const Vector3D& wi) {
+  return 0;
+}
+
 // Glass BSDF //
 
 Spectrum GlassBSDF::f(const Vector3D& wo, const Vector3D& wi) {
@@ -131,7 +143,7 @@ Spectrum GlassBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) {
     return (1 / cosTheta) * reflectance;
   }
 
-  if (coin_flip(fresnel_coe)) {
+  if (sample_1d() < fresnel_coe) {
     *pdf = fresnel_coe;
     reflect(wo, wi);
     return (fresnel_coe / cosTheta) * reflectance;
@@ -143,6 +155,10 @@ Spectrum GlassBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) {
   }
 }
 
+float GlassBSDF::pdf(const Vector3D& wo, const Vector3D& wi) {
+  return 0;
+}
+
 void BSDF::reflect(const Vector3D& wo, Vector3D* wi) {
   *wi = Vector3D(-wo.x, -wo.y, wo.z);
 }
@@ -182,4 +198,8 @@ Spectrum EmissionBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) {
   return Spectrum();
 }
 
+float EmissionBSDF::pdf(const Vector3D& wo, const Vector3D& wi) {
+  return std::max(0.0, cos_theta(wi)) / PI;
+}
+
 } // namespace CMU462
@@ -48,6 +48,15 @@ inline double sin_phi(const Vector3D& w) {
 
 void make_coord_space(Matrix3x3& o2w, const Vector3D& n);
 
+/**
+ * How a BSDF scatters, for settings that apply per kind of surface.
+ */
+enum BSDFType {
+  BSDF_DIFFUSE,    ///< scatters over the whole hemisphere
+  BSDF_GLOSSY,     ///< reflects about the mirror direction
+  BSDF_REFRACTIVE  ///< transmits through the surface
+};
+
 /**
  * Interface for BSDFs.
  */
@@ -78,6 +87,16 @@ class BSDF {
    */
   virtual Spectrum sample_f (const Vector3D& wo, Vector3D* wi, float* pdf) = 0;
 
+  /**
+   * Evaluate the solid angle density with which sample_f samples the
+   * incident direction wi given the outgoing direction wo. For delta
+   * distributions this is zero.
+   * \param wo outgoing light direction in local space of point of intersection
+   * \param wi incident light direction in local space of point of intersection
+   * \return pdf of sampling wi
+   */
+  virtual float pdf (const Vector3D& wo, const Vector3D& wi) = 0;
+
   /**
    * Get the emission value of the surface material. For non-emitting surfaces
    * this would be a zero energy spectrum.
@@ -94,6 +113,17 @@ class BSDF {
    */
   virtual bool is_delta() const = 0;
 
+  /**
+   * The kind of scattering of the BSDF.
+   */
+  virtual BSDFType type() const = 0;
+
+  /**
+   * If sample_f always picks the same incident direction for a given
+   * outgoing one, like mirrors and pure refraction do.
+   */
+  virtual bool is_deterministic() const { return false; }
+
   /**
    * Reflection helper
    */
@@ -116,8 +146,10 @@ class DiffuseBSDF : public BSDF {
 
   Spectrum f(const Vector3D& wo, const Vector3D& wi);
   Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  float pdf(const Vector3D& wo, const Vector3D& wi);
   Spectrum get_emission() const { return Spectrum(); }
   bool is_delta() const { return false; }
+  BSDFType type() const { return BSDF_DIFFUSE; }
 
 private:
 
@@ -136,8 +168,11 @@ class MirrorBSDF : public BSDF {
 
   Spectrum f(const Vector3D& wo, const Vector3D& wi);
   Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  float pdf(const Vector3D& wo, const Vector3D& wi);
   Spectrum get_emission() const { return Spectrum(); }
   bool is_delta() const { return true; }
+  BSDFType type() const { return BSDF_GLOSSY; }
+  bool is_deterministic() const { return true; }
 
 private:
 
@@ -158,8 +193,10 @@ class GlossyBSDF : public BSDF {
 
   Spectrum f(const Vector3D& wo, const Vector3D& wi);
   Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  float pdf(const Vector3D& wo, const Vector3D& wi);
   Spectrum get_emission() const { return Spectrum(); }
   bool is_delta() const { return false; }
+  BSDFType type() const { return BSDF_GLOSSY; }
 
 private:
 
@@ -179,8 +216,11 @@ class RefractionBSDF : public BSDF {
 
   Spectrum f(const Vector3D& wo, const Vector3D& wi);
   Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  float pdf(const Vector3D& wo, const Vector3D& wi);
   Spectrum get_emission() const { return Spectrum(); }
   bool is_delta() const { return true; }
+  BSDFType type() const { return BSDF_REFRACTIVE; }
+  bool is_deterministic() const { return true; }
 
  private:
 
@@ -203,8 +243,10 @@ class GlassBSDF : public BSDF {
 
   Spectrum f(const Vector3D& wo, const Vector3D& wi);
   Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  float pdf(const Vector3D& wo, const Vector3D& wi);
   Spectrum get_emission() const { return Spectrum(); }
   bool is_delta() const { return true; }
+  BSDFType type() const { return BSDF_REFRACTIVE; }
 
  private:
 
@@ -225,8 +267,10 @@ class EmissionBSDF : public BSDF {
 
   Spectrum f(const Vector3D& wo, const Vector3D& wi);
   Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  float pdf(const Vector3D& wo, const Vector3D& wi);
   Spectrum get_emission() const { return radiance * (1.0 / PI); }
   bool is_delta() const { return false; }
+  BSDFType type() const { return BSDF_DIFFUSE; }
 
  private:
 
@@ -6,14 +6,22 @@
 #include "bvh.h"
 
 #include "CMU462/CMU462.h"
+#include "CMU462/timer.h"
 #include "static_scene/triangle.h"
 
 #include <iostream>
+#include <sstream>
 #include <stack>
 #include <algorithm>
 
 using namespace std;
 
+#ifdef ENABLE_TRAVERSAL_STATS
+#define TRAVERSAL_STAT(expr) expr
+#else
+#define TRAVERSAL_STAT(expr)
+#endif
+
 namespace CMU462 { namespace StaticScene {
 
 #ifdef BVH_DEFAULT
@@ -36,7 +44,7 @@ struct SAHBucketData {
 };
 
 BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
-                   size_t max_leaf_size) {
+                   size_t max_leaf_size, ThreadPool* pool) {
   this->primitives = _primitives;
 
   // create build stack
@@ -47,6 +55,10 @@ BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
     return;
   }
 
+  // bboxes are computed while splitting, so the whole build is topology
+  Timer timer;
+  timer.start();
+
   // create initial build data
   BBox bb;
   for (size_t i = 0; i < primitives.size(); ++i) {
@@ -171,6 +183,9 @@ BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
     bstack.push(BVHBuildData(split_Ba, startl, rangel, &(*bdata.node)->l));
     bstack.push(BVHBuildData(split_Bb, startr, ranger, &(*bdata.node)->r));
   }
+
+  timer.stop();
+  build_times.topology = timer.duration();
 }
 
 #elif (defined BVH_MORTON_CODE_CPU) || (defined BVH_MORTON_CODE_GPU)
@@ -218,6 +233,34 @@ bool BVHAccel::mortonCompare(Primitive* p1, Primitive* p2)
   return p1->morton_code < p2->morton_code;
 }
 
+/**
+ * calculate the morton code of every primitive,
+ * split into one task per pool thread.
+ */
+void BVHAccel::computeMortonCodes(BBox bb, ThreadPool* pool)
+{
+  size_t num_tasks = pool ? pool->size() : 1;
+  size_t n = primitives.size();
+  auto encode = [this, &bb](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      Vector3D pos = bb.getUnitcubePosOf(primitives[i]->get_bbox().centroid());
+      primitives[i]->morton_code = morton3D(pos);
+    }
+  };
+
+  if (num_tasks == 1) {
+    encode(0, n);
+    return;
+  }
+
+  for (size_t k = 0; k < num_tasks; ++k) {
+    size_t begin = n * k / num_tasks;
+    size_t end = n * (k + 1) / num_tasks;
+    pool->submit([&encode, begin, end] { encode(begin, end); });
+  }
+  pool->wait();
+}
+
 #if (defined BVH_MORTON_CODE_CPU)
 
 /**
@@ -308,31 +351,60 @@ int BVHAccel::findSplitPosition(int start, int end)
   }
 }
 
-void BVHAccel::constructBVH(BVHNode* root)
+/**
+ * create the two children of a node, returns
+ * false if the node has to remain a leaf.
+ */
+bool BVHAccel::splitNode(BVHNode* root)
 {
-  if(root->range == 1) return;
+  if(root->range == 1) return false;
 
   int gamma = findSplitPosition(root->start, root->start + root->range -1);
 
-  if(gamma == -1) return;
+  if(gamma == -1) return false;
 
+  // bboxes are filled in afterwards by refitBVH
   int lchildSpan = gamma - root->start + 1;
-  BBox lchildBBox = generate_bounding_box(root->start, lchildSpan);
-  BVHNode* lchild = new BVHNode(lchildBBox, root->start, lchildSpan);
+  BVHNode* lchild = new BVHNode(BBox(), root->start, lchildSpan);
 
   int rchildSpan = root->range - lchildSpan;
-  BBox rchildBBox = generate_bounding_box(gamma + 1, rchildSpan);
-  BVHNode* rchild = new BVHNode(rchildBBox, gamma + 1, rchildSpan);
+  BVHNode* rchild = new BVHNode(BBox(), gamma + 1, rchildSpan);
 
   root->l = lchild;
   root->r = rchild;
 
+  return true;
+}
+
+void BVHAccel::constructBVH(BVHNode* root)
+{
+  if(!splitNode(root)) return;
+
   constructBVH(root->l);
   constructBVH(root->r);
 }
 
+/**
+ * compute the bounding boxes of the tree bottom up,
+ * so every primitive bbox is only read once.
+ */
+void BVHAccel::refitBVH(BVHNode* root)
+{
+  if(root->isLeaf())
+  {
+    root->bb = generate_bounding_box(root->start, root->range);
+    return;
+  }
+
+  refitBVH(root->l);
+  refitBVH(root->r);
+
+  root->bb = root->l->bb;
+  root->bb.expand(root->r->bb);
+}
+
 BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
-                   size_t max_leaf_size) 
+                   size_t max_leaf_size, ThreadPool* pool)
 {
 
   this->primitives = _primitives;
@@ -342,6 +414,9 @@ BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
     return;
   }
 
+  Timer timer;
+  timer.start();
+
   // calculate root AABB size
   BBox bb;
   for (size_t i = 0; i < primitives.size(); ++i) {
@@ -350,17 +425,72 @@ BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
   root = new BVHNode(bb, 0, primitives.size());
 
   // calculate morton code for each primitives
-  for (size_t i = 0; i < primitives.size(); ++i) {
-    unsigned int morton_code = morton3D(bb.getUnitcubePosOf(primitives[i]->get_bbox().centroid()));
-    primitives[i]->morton_code = morton_code;
-  }
+  computeMortonCodes(bb, pool);
+
+  timer.stop();
+  build_times.morton_encode = timer.duration();
+  timer.start();
 
   // sort primitives using morton code
   std::sort(primitives.begin(), primitives.end(), mortonCompare);
 
+  timer.stop();
+  build_times.sort = timer.duration();
+  timer.start();
+
+  // split the top of the tree until there are enough independent subtrees
+  // to keep the pool busy. top_nodes lists split nodes parents first.
+  vector<BVHNode*> top_nodes;
+  vector<BVHNode*> subtrees(1, root);
+  size_t num_subtrees = pool ? 4 * pool->size() : 1;
+  while (subtrees.size() < num_subtrees) {
+    vector<BVHNode*> next;
+    for (size_t i = 0; i < subtrees.size(); ++i) {
+      if (splitNode(subtrees[i])) {
+        top_nodes.push_back(subtrees[i]);
+        next.push_back(subtrees[i]->l);
+        next.push_back(subtrees[i]->r);
+      } else {
+        next.push_back(subtrees[i]);
+      }
+    }
+    if (next.size() == subtrees.size()) break;
+    subtrees.swap(next);
+  }
+
   //construct BVH based on the mortan code
-  constructBVH(root);
+  if (subtrees.size() == 1) {
+    constructBVH(subtrees[0]);
+  } else {
+    for (size_t i = 0; i < subtrees.size(); ++i) {
+      BVHNode* node = subtrees[i];
+      pool->submit([this, node] { constructBVH(node); });
+    }
+    pool->wait();
+  }
 
+  timer.stop();
+  build_times.topology = timer.duration();
+  timer.start();
+
+  // compute node bboxes, subtrees first and then the nodes above them
+  if (subtrees.size() == 1) {
+    refitBVH(subtrees[0]);
+  } else {
+    for (size_t i = 0; i < subtrees.size(); ++i) {
+      BVHNode* node = subtrees[i];
+      pool->submit([this, node] { refitBVH(node); });
+    }
+    pool->wait();
+  }
+  for (size_t i = top_nodes.size(); i > 0; --i) {
+    BVHNode* node = top_nodes[i - 1];
+    node->bb = node->l->bb;
+    node->bb.expand(node->r->bb);
+  }
+
+  timer.stop();
+  build_times.bbox = timer.duration();
 }
 
 #elif defined BVH_MORTON_CODE_GPU
@@ -419,7 +549,7 @@ void BVHAccel::constructBVHNodeFromBRTree(int idx, BVHNode* root, int start, int
 }
 
 BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
-                   size_t max_leaf_size) 
+                   size_t max_leaf_size, ThreadPool* pool)
 {
   this->primitives = _primitives;
 
@@ -428,6 +558,9 @@ BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
     return;
   }
 
+  Timer timer;
+  timer.start();
+
   // calculate root AABB size
   BBox bb;
   for (size_t i = 0; i < primitives.size(); ++i) {
@@ -436,13 +569,18 @@ BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
   root = new BVHNode(bb, 0, primitives.size());
 
   // calculate morton code for each primitives
-  for (size_t i = 0; i < primitives.size(); ++i) {
-    unsigned int morton_code = morton3D(bb.getUnitcubePosOf(primitives[i]->get_bbox().centroid()));
-    primitives[i]->morton_code = morton_code;
-  }
+  computeMortonCodes(bb, pool);
+
+  timer.stop();
+  build_times.morton_encode = timer.duration();
+  timer.start();
 
   // sort primitives using morton code
   std::sort(primitives.begin(), primitives.end(), mortonCompare);
+
+  timer.stop();
+  build_times.sort = timer.duration();
+  timer.start();
   
   // extract bboxes array
   std::vector<BBox> bboxes(primitives.size());
@@ -471,6 +609,10 @@ BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
   
   // free the host memory because I am a good programmer
   builder.freeHostMemory();
+
+  // node bboxes are computed by the GPU builder along with the topology
+  timer.stop();
+  build_times.topology = timer.duration();
 }
 
 #endif
@@ -486,16 +628,285 @@ BVHAccel::~BVHAccel() { rec_free(root); }
 
 BBox BVHAccel::get_bbox() const { return root->bb; }
 
+/**
+ * clip a convex polygon against an axis aligned box
+ * (Sutherland-Hodgman) and return the area of the remaining part.
+ */
+static double clipped_area(vector<Vector3D> poly, const BBox& bb) {
+
+  vector<Vector3D> clipped;
+  for (int plane = 0; plane < 6 && !poly.empty(); ++plane) {
+    int dim = plane % 3;
+    double bound = plane < 3 ? bb.min[dim] : bb.max[dim];
+    double sign = plane < 3 ? 1.0 : -1.0;
+
+    clipped.clear();
+    for (size_t i = 0; i < poly.size(); ++i) {
+      const Vector3D& a = poly[i];
+      const Vector3D& b = poly[(i + 1) % poly.size()];
+      double da = sign * (a[dim] - bound);
+      double db = sign * (b[dim] - bound);
+      if (da >= 0) clipped.push_back(a);
+      if ((da >= 0) != (db >= 0)) {
+        clipped.push_back(a + (b - a) * (da / (da - db)));
+      }
+    }
+    poly.swap(clipped);
+  }
+
+  if (poly.size() < 3) return 0;
+
+  Vector3D n;
+  for (size_t i = 1; i + 1 < poly.size(); ++i) {
+    n += cross(poly[i] - poly[0], poly[i + 1] - poly[0]);
+  }
+  return 0.5 * n.norm();
+}
+
+/**
+ * the surface of a primitive as a list of convex polygons.
+ * triangles are exact, everything else uses the faces of its bbox.
+ */
+static vector<vector<Vector3D> > primitive_faces(const Primitive* p) {
+
+  vector<vector<Vector3D> > faces;
+
+  const Triangle* tri = dynamic_cast<const Triangle*>(p);
+  if (tri) {
+    vector<Vector3D> face(3);
+    tri->get_vertices(&face[0], &face[1], &face[2]);
+    faces.push_back(face);
+    return faces;
+  }
+
+  BBox bb = p->get_bbox();
+  for (int dim = 0; dim < 3; ++dim) {
+    int u = (dim + 1) % 3;
+    int v = (dim + 2) % 3;
+    for (int side = 0; side < 2; ++side) {
+      Vector3D c = side ? bb.max : bb.min;
+      vector<Vector3D> face(4, c);
+      face[1][u] = bb.max[u];
+      face[2][u] = bb.max[u]; face[2][v] = bb.max[v];
+      face[3][v] = bb.max[v];
+      face[0][u] = face[3][u] = bb.min[u];
+      face[0][v] = face[1][v] = bb.min[v];
+      faces.push_back(face);
+    }
+  }
+  return faces;
+}
+
+BVHStats BVHAccel::stats(double ct, double ci) const {
+
+  BVHStats s;
+  s.ct = ct;
+  s.ci = ci;
+  s.sah_cost = 0;
+  s.epo = 0;
+  s.node_count = 0;
+  s.leaf_count = 0;
+  s.max_depth = 0;
+  s.build_times = build_times;
+
+  if (primitives.empty()) {
+    s.memory_bytes = 0;
+    return s;
+  }
+
+  // topology, SAH cost and histograms
+  double root_area = root->bb.surface_area();
+  stack<pair<BVHNode*, size_t> > nstack;
+  nstack.push(make_pair(root, (size_t) 0));
+  while (!nstack.empty()) {
+    BVHNode* node = nstack.top().first;
+    size_t depth = nstack.top().second;
+    nstack.pop();
+
+    s.node_count++;
+    double area = root_area > 0 ? node->bb.surface_area() / root_area : 1;
+
+    if (node->isLeaf()) {
+      s.leaf_count++;
+      s.sah_cost += ci * node->range * area;
+      s.max_depth = max(s.max_depth, depth);
+      if (s.leaf_size_histogram.size() <= node->range)
+        s.leaf_size_histogram.resize(node->range + 1, 0);
+      s.leaf_size_histogram[node->range]++;
+      if (s.depth_histogram.size() <= depth)
+        s.depth_histogram.resize(depth + 1, 0);
+      s.depth_histogram[depth]++;
+      continue;
+    }
+
+    s.sah_cost += ct * area;
+    if (node->l) nstack.push(make_pair(node->l, depth + 1));
+    if (node->r) nstack.push(make_pair(node->r, depth + 1));
+  }
+
+  s.memory_bytes = s.node_count * sizeof(BVHNode) +
+                   primitives.size() * sizeof(Primitive*);
+
+  // end-point overlap: for every primitive, the area it contributes
+  // to nodes that overlap it but do not contain it in their subtree
+  double total_area = 0;
+  double overlap = 0;
+  stack<BVHNode*> tstack;
+  for (size_t i = 0; i < primitives.size(); ++i) {
+    vector<vector<Vector3D> > faces = primitive_faces(primitives[i]);
+    for (size_t f = 0; f < faces.size(); ++f) {
+      total_area += clipped_area(faces[f], root->bb);
+    }
+
+    BBox pbb = primitives[i]->get_bbox();
+    tstack.push(root);
+    while (!tstack.empty()) {
+      BVHNode* node = tstack.top();
+      tstack.pop();
+
+      const BBox& bb = node->bb;
+      if (pbb.max.x < bb.min.x || pbb.min.x > bb.max.x ||
+          pbb.max.y < bb.min.y || pbb.min.y > bb.max.y ||
+          pbb.max.z < bb.min.z || pbb.min.z > bb.max.z) {
+        continue;
+      }
+
+      bool contains = i >= node->start && i < node->start + node->range;
+      if (!contains) {
+        double cost = node->isLeaf() ? ci * node->range : ct;
+        for (size_t f = 0; f < faces.size(); ++f) {
+          overlap += cost * clipped_area(faces[f], bb);
+        }
+      }
+
+      if (node->l) tstack.push(node->l);
+      if (node->r) tstack.push(node->r);
+    }
+  }
+  s.epo = total_area > 0 ? overlap / total_area : 0;
+
+  return s;
+}
+
+void BVHStats::print() const {
+
+  fprintf(stdout, "[BVH] SAH cost (Ct = %.2f, Ci = %.2f): %.4f\n",
+          ct, ci, sah_cost);
+  fprintf(stdout, "[BVH] EPO: %.4f\n", epo);
+  fprintf(stdout, "[BVH] Nodes: %lu (%lu leaves), max depth: %lu\n",
+          node_count, leaf_count, max_depth);
+  fprintf(stdout, "[BVH] Memory: %lu bytes\n", memory_bytes);
+  fprintf(stdout, "[BVH] Build time: morton encode %.4fs, sort %.4fs, "
+                  "topology %.4fs, bbox %.4fs\n",
+          build_times.morton_encode, build_times.sort,
+          build_times.topology, build_times.bbox);
+
+  fprintf(stdout, "[BVH] Leaf size histogram:\n");
+  for (size_t i = 0; i < leaf_size_histogram.size(); ++i) {
+    if (leaf_size_histogram[i] == 0) continue;
+    fprintf(stdout, "  %4lu primitives: %lu\n", i, leaf_size_histogram[i]);
+  }
+
+  fprintf(stdout, "[BVH] Leaf depth histogram:\n");
+  for (size_t i = 0; i < depth_histogram.size(); ++i) {
+    if (depth_histogram[i] == 0) continue;
+    fprintf(stdout, "  depth %4lu: %lu\n", i, depth_histogram[i]);
+  }
+  fflush(stdout);
+}
+
+static string json_array(const vector<size_t>& values) {
+  ostringstream out;
+  out << "[";
+  for (size_t i = 0; i < values.size(); ++i) {
+    out << (i ? ", " : "") << values[i];
+  }
+  out << "]";
+  return out.str();
+}
+
+string BVHStats::to_json() const {
+  ostringstream out;
+  out << "{\n"
+      << "  \"ct\": " << ct << ",\n"
+      << "  \"ci\": " << ci << ",\n"
+      << "  \"sah_cost\": " << sah_cost << ",\n"
+      << "  \"epo\": " << epo << ",\n"
+      << "  \"node_count\": " << node_count << ",\n"
+      << "  \"leaf_count\": " << leaf_count << ",\n"
+      << "  \"max_depth\": " << max_depth << ",\n"
+      << "  \"memory_bytes\": " << memory_bytes << ",\n"
+      << "  \"build_time\": {\n"
+      << "    \"morton_encode\": " << build_times.morton_encode << ",\n"
+      << "    \"sort\": " << build_times.sort << ",\n"
+      << "    \"topology\": " << build_times.topology << ",\n"
+      << "    \"bbox\": " << build_times.bbox << "\n"
+      << "  },\n"
+      << "  \"leaf_size_histogram\": " << json_array(leaf_size_histogram)
+      << ",\n"
+      << "  \"depth_histogram\": " << json_array(depth_histogram) << "\n"
+      << "}\n";
+  return out.str();
+}
+
+size_t& BVHAccel::ray_count() {
+  static thread_local size_t count = 0;
+  return count;
+}
+
+#ifdef ENABLE_TRAVERSAL_STATS
+TraversalStats& BVHAccel::traversal_stats() {
+  static thread_local TraversalStats stats;
+  return stats;
+}
+#endif
+
+/**
+ * Traversal stack with the interface of std::stack, kept on the call stack.
+ * Only trees deeper than its fixed part spill to the heap.
+ */
+template <typename T>
+class TraversalStack {
+ public:
+  TraversalStack() : count(0) { }
+
+  bool empty() const { return count == 0; }
+  size_t size() const { return count; }
+
+  void push(const T& t) {
+    if (count < kFixed) fixed[count] = t;
+    else spill.push_back(t);
+    count++;
+  }
+
+  T& top() { return count <= kFixed ? fixed[count - 1] : spill.back(); }
+
+  void pop() {
+    if (count > kFixed) spill.pop_back();
+    count--;
+  }
+
+ private:
+  static const size_t kFixed = 64;
+  T fixed[kFixed];
+  vector<T> spill;
+  size_t count;
+};
+
 bool BVHAccel::intersect(const Ray &ray) const {
 
+  ray_count()++;
+
   double t0 = ray.min_t;
   double t1 = ray.max_t;
 
   // try early exit
+  TRAVERSAL_STAT(TraversalStats& stats = traversal_stats());
+  TRAVERSAL_STAT(stats.bbox_tests++);
   if (!root->bb.intersect(ray, t0, t1)) return false;
 
   // create traversal stack
-  stack<BVHNode *> tstack;
+  TraversalStack<BVHNode *> tstack;
 
   // push initial traversal data
   tstack.push(root);
@@ -507,6 +918,7 @@ bool BVHAccel::intersect(const Ray &ray) const {
     // pop traversal data
     BVHNode *current = tstack.top();
     tstack.pop();
+    TRAVERSAL_STAT(stats.nodes_visited++);
 
     // get children
     l = current->l;
@@ -515,6 +927,7 @@ bool BVHAccel::intersect(const Ray &ray) const {
     // if leaf
     if (!(l || r)) {
       for (size_t i = 0; i < current->range; ++i) {
+        TRAVERSAL_STAT(stats.primitive_tests++);
         if (primitives[current->start + i]->intersect(ray)) return true;
       }
     }
@@ -527,6 +940,7 @@ bool BVHAccel::intersect(const Ray &ray) const {
     bool hitL, hitR;
     hitL = (l != NULL) && l->bb.intersect(ray, tl0, tl1);
     hitR = (r != NULL) && r->bb.intersect(ray, tr0, tr1);
+    TRAVERSAL_STAT(stats.bbox_tests += (l != NULL) + (r != NULL));
 
     // both hit
     if (hitL && hitR) {
@@ -537,23 +951,103 @@ bool BVHAccel::intersect(const Ray &ray) const {
     } else if (hitR) {
       tstack.push(r);
     }
+    TRAVERSAL_STAT(stats.max_stack_depth =
+                   max(stats.max_stack_depth, tstack.size()));
   }
 
   return false;
 }
 
+// stream traversal: the rays active at a node are a range of an index buffer
+struct StreamEntry {
+  BVHNode *node;
+  size_t begin, end;
+};
+
+void BVHAccel::intersect(const vector<Ray> &rays, vector<char> *hit) const {
+
+  hit->assign(rays.size(), false);
+  ray_count() += rays.size();
+
+  TRAVERSAL_STAT(TraversalStats& stats = traversal_stats());
+  static thread_local vector<size_t> active;
+  active.clear();
+  for (size_t i = 0; i < rays.size(); ++i) {
+    double t0 = rays[i].min_t;
+    double t1 = rays[i].max_t;
+    TRAVERSAL_STAT(stats.bbox_tests++);
+    if (root->bb.intersect(rays[i], t0, t1)) active.push_back(i);
+  }
+  if (active.empty()) return;
+
+  // the ranges of the nodes on the stack are stacked in the index buffer in
+  // the same order, so everything past the top node's range is done with
+  TraversalStack<StreamEntry> tstack;
+  StreamEntry entry = { root, 0, active.size() };
+  tstack.push(entry);
+
+  while (!tstack.empty()) {
+
+    StreamEntry current = tstack.top();
+    tstack.pop();
+    active.resize(current.end);
+    TRAVERSAL_STAT(stats.nodes_visited++);
+
+    BVHNode *l = current.node->l;
+    BVHNode *r = current.node->r;
+
+    // if leaf
+    if (!(l || r)) {
+      for (size_t k = current.begin; k < current.end; ++k) {
+        size_t i = active[k];
+        for (size_t p = 0; p < current.node->range && !(*hit)[i]; ++p) {
+          TRAVERSAL_STAT(stats.primitive_tests++);
+          (*hit)[i] = primitives[current.node->start + p]->intersect(rays[i]);
+        }
+      }
+      continue;
+    }
+
+    // split the rays between the children, pushing the left one last so it
+    // is visited first
+    BVHNode *children[2] = { r, l };
+    for (BVHNode *child : children) {
+      if (!child) continue;
+      size_t begin = active.size();
+      for (size_t k = current.begin; k < current.end; ++k) {
+        size_t i = active[k];
+        if ((*hit)[i]) continue;
+        double t0 = rays[i].min_t;
+        double t1 = rays[i].max_t;
+        TRAVERSAL_STAT(stats.bbox_tests++);
+        if (child->bb.intersect(rays[i], t0, t1)) active.push_back(i);
+      }
+      if (active.size() > begin) {
+        StreamEntry entry = { child, begin, active.size() };
+        tstack.push(entry);
+      }
+    }
+    TRAVERSAL_STAT(stats.max_stack_depth =
+                   max(stats.max_stack_depth, tstack.size()));
+  }
+}
+
 bool BVHAccel::intersect(const Ray &ray, Intersection *isect) const {
 
   bool hit = false;  // never leave such things uninitialized :D
 
+  ray_count()++;
+
   double t0 = ray.min_t;
   double t1 = ray.max_t;
 
   // try early exit
+  TRAVERSAL_STAT(TraversalStats& stats = traversal_stats());
+  TRAVERSAL_STAT(stats.bbox_tests++);
   if (!root->bb.intersect(ray, t0, t1)) return false;
 
   // create traversal stack
-  stack<BVHNode *> tstack;
+  TraversalStack<BVHNode *> tstack;
 
   // push initial traversal data
   tstack.push(root);
@@ -564,6 +1058,7 @@ bool BVHAccel::intersect(const Ray &ray, Intersection *isect) const {
     // pop traversal data
     BVHNode *current = tstack.top();
     tstack.pop();
+    TRAVERSAL_STAT(stats.nodes_visited++);
 
     // get childrren
     BVHNode *l, *r;
@@ -573,6 +1068,7 @@ bool BVHAccel::intersect(const Ray &ray, Intersection *isect) const {
     // if leaf
     if (!(l || r)) {
       for (size_t p = 0; p < current->range; ++p) {
+        TRAVERSAL_STAT(stats.primitive_tests++);
         if (primitives[current->start + p]->intersect(ray, isect)) hit = true;
       }
     }
@@ -585,6 +1081,7 @@ bool BVHAccel::intersect(const Ray &ray, Intersection *isect) const {
     bool hitL, hitR;
     hitL = (l != NULL) && l->bb.intersect(ray, tl0, tl1);
     hitR = (r != NULL) && r->bb.intersect(ray, tr0, tr1);
+    TRAVERSAL_STAT(stats.bbox_tests += (l != NULL) + (r != NULL));
 
     if (hitL && hitR) {
       tstack.push(r);
@@ -594,9 +1091,14 @@ bool BVHAccel::intersect(const Ray &ray, Intersection *isect) const {
     } else if (hitR) {
       tstack.push(r);
     }
+    TRAVERSAL_STAT(stats.max_stack_depth =
+                   max(stats.max_stack_depth, tstack.size()));
 
   }
 
+  // shading data is only computed for the closest hit
+  if (hit) isect->primitive->finalize_hit(ray, isect);
+
   return hit;
 }
 
@@ -3,12 +3,52 @@
 
 #include "static_scene/scene.h"
 #include "static_scene/aggregate.h"
+#include "thread_pool.h"
 #include "parallelBRTreeBuilder.h"
 
 #include <vector>
+#include <string>
+#include <algorithm>
+
+// Uncomment to count the work done by every BVH traversal (see
+// TraversalStats). When disabled the counters are compiled out entirely.
+//#define ENABLE_TRAVERSAL_STATS
 
 namespace CMU462 { namespace StaticScene {
 
+#ifdef ENABLE_TRAVERSAL_STATS
+
+/**
+ * Counters of the work done by BVH traversal. Every thread accumulates into
+ * its own instance (see BVHAccel::traversal_stats) so that counting does not
+ * need any synchronization.
+ */
+struct TraversalStats {
+
+  TraversalStats() { reset(); }
+
+  void reset() {
+    nodes_visited = 0;
+    bbox_tests = 0;
+    primitive_tests = 0;
+    max_stack_depth = 0;
+  }
+
+  void add(const TraversalStats& s) {
+    nodes_visited += s.nodes_visited;
+    bbox_tests += s.bbox_tests;
+    primitive_tests += s.primitive_tests;
+    max_stack_depth = std::max(max_stack_depth, s.max_stack_depth);
+  }
+
+  size_t nodes_visited;    ///< number of nodes popped from the stack
+  size_t bbox_tests;       ///< number of ray - bbox tests
+  size_t primitive_tests;  ///< number of ray - primitive tests
+  size_t max_stack_depth;  ///< deepest traversal stack seen
+};
+
+#endif // ENABLE_TRAVERSAL_STATS
+
 
 /**
  * A node in the BVH accelerator aggregate.
@@ -34,6 +74,52 @@ struct BVHNode {
   BVHNode* r;     ///< right child node
 };
 
+/**
+ * Wall clock time (in seconds) spent in each phase of a BVH build. Builders
+ * that do not have a phase (e.g. the SAH builder does not compute morton
+ * codes) report zero for it.
+ */
+struct BVHBuildTimes {
+
+  BVHBuildTimes() : morton_encode(0), sort(0), topology(0), bbox(0) { }
+
+  double morton_encode;  ///< root bbox and morton code computation
+  double sort;           ///< sorting primitives by morton code
+  double topology;       ///< building the tree structure
+  double bbox;           ///< computing node bounding boxes
+};
+
+/**
+ * Quality report of a built BVH, see BVHAccel::stats.
+ */
+struct BVHStats {
+
+  double ct;            ///< cost of a traversal step used for the SAH cost
+  double ci;            ///< cost of a primitive test used for the SAH cost
+  double sah_cost;      ///< SAH cost of the tree, relative to the root area
+  double epo;           ///< end-point overlap, relative to the scene area
+
+  size_t node_count;    ///< number of nodes (interior and leaves)
+  size_t leaf_count;    ///< number of leaves
+  size_t max_depth;     ///< depth of the deepest leaf (root is at depth 0)
+  size_t memory_bytes;  ///< memory used by the nodes and primitive list
+
+  std::vector<size_t> leaf_size_histogram; ///< leaves holding i primitives
+  std::vector<size_t> depth_histogram;     ///< leaves at depth i
+
+  BVHBuildTimes build_times; ///< build time per phase
+
+  /**
+   * Print the report to stdout.
+   */
+  void print() const;
+
+  /**
+   * Serialize the report as a JSON object.
+   */
+  std::string to_json() const;
+};
+
 /**
  * Bounding Volume Hierarchy for fast Ray - Primitive intersection.
  * Note that the BVHAccel is an Aggregate (A Primitive itself) that contains
@@ -53,8 +139,11 @@ class BVHAccel : public Aggregate {
    * in memory for the aggregate to function properly.
    * \param primitives primitives to build from
    * \param max_leaf_size maximum number of primitives to be stored in leaves
+   * \param pool worker threads for the morton code builders, the build runs
+   *        on the calling thread if NULL. The pool must be otherwise idle.
    */
-  BVHAccel(const std::vector<Primitive*>& primitives, size_t max_leaf_size = 4);
+  BVHAccel(const std::vector<Primitive*>& primitives, size_t max_leaf_size = 4,
+           ThreadPool* pool = NULL);
 
   /**
    * Destructor.
@@ -86,7 +175,8 @@ class BVHAccel : public Aggregate {
    * intersection information for the point of intersection. Note that the
    * intersected primitive entry in the intersection should be updated to
    * the actual primitive in the aggregate that the ray intersected with and
-   * not the aggregate itself.
+   * not the aggregate itself. Shading data is only evaluated (through
+   * Primitive::finalize_hit) for the closest hit once traversal is done.
    * \param r ray to test intersection with
    * \param i address to store intersection info
    * \return true if the given ray intersects with the aggregate,
@@ -94,6 +184,17 @@ class BVHAccel : public Aggregate {
    */
   bool intersect(const Ray& r, Intersection* i) const;
 
+  /**
+   * Batched Ray - Aggregate intersection.
+   * Same as calling intersect(rays[i]) for every ray, but the batch walks
+   * the tree together: every node is visited once, with the rays that reach
+   * its bbox and are not blocked yet. Coherent rays, such as the shadow rays
+   * of one pixel, then share most of their node visits.
+   * \param rays rays to test intersection with
+   * \param hit set to whether each ray intersects with the aggregate
+   */
+  void intersect(const std::vector<Ray>& rays, std::vector<char>* hit) const;
+
   /**
    * Get BSDF of the surface material
    * Note that this does not make sense for the BVHAccel aggregate
@@ -102,6 +203,20 @@ class BVHAccel : public Aggregate {
    */
   BSDF* get_bsdf() const { return NULL; }
 
+  /**
+   * Compute quality metrics of the tree.
+   * The SAH cost sums ct * SA(n) over interior nodes and ci * N(n) * SA(n)
+   * over leaves, relative to the surface area of the root. The end-point
+   * overlap (EPO) sums, over every node, the area of geometry that lies
+   * inside the node's bbox without belonging to its subtree, weighted the
+   * same way and relative to the total area of the geometry. Primitives other
+   * than triangles are approximated by their bounding boxes for EPO.
+   * \param ct cost of a traversal step
+   * \param ci cost of a ray - primitive test
+   * \return quality report, including the build time of every phase
+   */
+  BVHStats stats(double ct = 1.0, double ci = 1.0) const;
+
   /**
    * Get entry point (root) - used in visualizer
    */
@@ -117,6 +232,20 @@ class BVHAccel : public Aggregate {
    */
   void drawOutline(const Color& c) const { }
 
+  /**
+   * Number of rays the calling thread has tested against any BVH. Every
+   * intersect call adds to it until it is reset by the caller.
+   */
+  static size_t& ray_count();
+
+#ifdef ENABLE_TRAVERSAL_STATS
+  /**
+   * Traversal counters of the calling thread. Every intersect call made from
+   * this thread adds to them until they are reset by the caller.
+   */
+  static TraversalStats& traversal_stats();
+#endif
+
  private:
   BVHNode* root; ///< root node of the BVH
 
@@ -125,7 +254,10 @@ class BVHAccel : public Aggregate {
   unsigned int morton3D(float x, float y, float z);
   unsigned int morton3D(Vector3D pos);
   static bool mortonCompare(Primitive* p1, Primitive* p2);
+  void computeMortonCodes(BBox bb, ThreadPool* pool);
+  bool splitNode(BVHNode* root);
   void constructBVH(BVHNode* root);
+  void refitBVH(BVHNode* root);
   int findSplitPosition(int start, int end);
   BBox generate_bounding_box(int start, int span);
   void constructBVHFromBRTree();
@@ -133,6 +265,8 @@ class BVHAccel : public Aggregate {
   
   BRTreeNode* leaf_nodes;
   BRTreeNode* internal_nodes;
+
+  BVHBuildTimes build_times; ///< time spent in each build phase
 };
 
 } // namespace StaticScene
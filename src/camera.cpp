@@ -151,5 +151,43 @@ Vector2D Camera::get_screen_pos(Vector3D p) const {
   return Vector2D(x, y);
 }
 
+double Camera::pdf_dir(const Vector3D& d) const {
+
+  Matrix3x3 w2c(c2w.T());
+  Vector3D dir = (w2c * d).unit();
+  if (dir.z >= 0) return 0;
+
+  double sensor_height = 2.0 * tan( radians(vFov/2.0) );
+  double sensor_width = ar * sensor_height;
+  if (fabs(dir.x / dir.z) > sensor_width / 2 ||
+      fabs(dir.y / dir.z) > sensor_height / 2) return 0;
+
+  // uniform density 1/A on the sensor one unit away, in solid angle
+  double cos_theta = -dir.z;
+  return 1.0 / (sensor_width * sensor_height *
+                cos_theta * cos_theta * cos_theta);
+}
+
+double Camera::importance(const Vector3D& p, Vector2D* screen) const {
+
+  Vector3D d = p - pos;
+  double dist2 = d.norm2();
+  Matrix3x3 w2c(c2w.T());
+  Vector3D dir = (w2c * d).unit();
+  if (dir.z >= 0) return 0;
+
+  double sensor_height = 2.0 * tan( radians(vFov/2.0) );
+  double sensor_width = ar * sensor_height;
+  double x = dir.x / -dir.z / sensor_width;
+  double y = dir.y / -dir.z / sensor_height;
+  if (fabs(x) > 0.5 || fabs(y) > 0.5) return 0;
+  *screen = Vector2D(x, y);
+
+  // W_e = 1 / (A cos^4), times cos / dist^2
+  double cos_theta = -dir.z;
+  return 1.0 / (sensor_width * sensor_height *
+                cos_theta * cos_theta * cos_theta * dist2);
+}
+
 
 } // namespace CMU462
@@ -87,6 +87,21 @@ class Camera {
   // ===RUI=== 
   Vector2D get_screen_pos(Vector3D p) const;
 
+  /**
+   * Solid angle density of generate_ray producing the world space
+   * direction d, for sensor positions distributed uniformly.
+   */
+  double pdf_dir(const Vector3D& d) const;
+
+  /**
+   * For connecting light paths to the camera: the importance the camera
+   * emits toward world point p, normalized over the whole sensor, times the
+   * cosine at the camera over the squared distance to p.
+   * \param screen set to the normalized sensor position p projects to
+   * \return the importance factor, zero if p is out of the field of view
+   */
+  double importance(const Vector3D& p, Vector2D* screen) const;
+
  private:
   // Computes pos, screenXDir, screenYDir from target, r, phi, theta.
   void compute_position();
@@ -0,0 +1,167 @@
+#include "checkpoint.h"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+namespace CMU462 {
+
+static const char kMagic[8] = { 'P', 'T', 'C', 'K', 'P', 'T', '\0', '\0' };
+static const uint32_t kVersion = 1;
+
+// flags of the file header
+static const uint32_t kUniformCounts = 1;  ///< one count for all pixels
+static const uint32_t kHasSquares = 2;     ///< squared luminance follows
+
+/**
+ * Header of a checkpoint file. The per pixel sums follow, then the counts
+ * and the squared luminance sums if the flags say so. Everything is stored
+ * in host byte order.
+ */
+struct CheckpointHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  RenderSettings settings;
+  uint64_t passes;
+  double elapsed;
+};
+
+bool RenderSettings::operator==(const RenderSettings& s) const {
+  return width == s.width && height == s.height && ns_aa == s.ns_aa &&
+         ns_pass == s.ns_pass && max_ray_depth == s.max_ray_depth &&
+         ns_area_light == s.ns_area_light && ns_diff == s.ns_diff &&
+         ns_glsy == s.ns_glsy && ns_refr == s.ns_refr && bdpt == s.bdpt &&
+         seed == s.seed && sequence == s.sequence &&
+         ns_light_cache == s.ns_light_cache &&
+         adaptive_error == s.adaptive_error && time_budget == s.time_budget;
+}
+
+bool RenderCheckpoint::write(const std::string& filename) const {
+
+  size_t pixels = settings.width * settings.height;
+  if (sums.size() != pixels || counts.size() != pixels) return false;
+
+  CheckpointHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.settings = settings;
+  header.passes = passes;
+  header.elapsed = elapsed;
+  bool uniform = std::count(counts.begin(), counts.end(), counts[0]) ==
+                 (long) pixels;
+  if (uniform) header.flags |= kUniformCounts;
+  if (squares.size() == pixels) header.flags |= kHasSquares;
+
+  std::string temp = filename + ".tmp";
+  FILE* file = fopen(temp.c_str(), "wb");
+  if (!file) return false;
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(&sums[0], sizeof(Spectrum), pixels, file) == pixels &&
+            fwrite(&counts[0], sizeof(unsigned int), uniform ? 1 : pixels,
+                   file) == (uniform ? 1 : pixels);
+  if (ok && (header.flags & kHasSquares)) {
+    ok = fwrite(&squares[0], sizeof(float), pixels, file) == pixels;
+  }
+  ok = (fclose(file) == 0) && ok;
+  ok = ok && rename(temp.c_str(), filename.c_str()) == 0;
+  if (!ok) remove(temp.c_str());
+  return ok;
+}
+
+bool RenderCheckpoint::read(const std::string& filename) {
+
+  FILE* file = fopen(filename.c_str(), "rb");
+  if (!file) return false;
+
+  CheckpointHeader header;
+  bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+            memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+            header.version == kVersion;
+  if (ok) {
+    settings = header.settings;
+    passes = header.passes;
+    elapsed = header.elapsed;
+
+    size_t pixels = settings.width * settings.height;
+    sums.resize(pixels);
+    counts.resize(pixels);
+    ok = fread(&sums[0], sizeof(Spectrum), pixels, file) == pixels;
+    if (ok && (header.flags & kUniformCounts)) {
+      ok = fread(&counts[0], sizeof(unsigned int), 1, file) == 1;
+      std::fill(counts.begin(), counts.end(), counts[0]);
+    } else if (ok) {
+      ok = fread(&counts[0], sizeof(unsigned int), pixels, file) == pixels;
+    }
+    squares.clear();
+    if (ok && (header.flags & kHasSquares)) {
+      squares.resize(pixels);
+      ok = fread(&squares[0], sizeof(float), pixels, file) == pixels;
+    }
+  }
+
+  fclose(file);
+  return ok;
+}
+
+CheckpointWriter::CheckpointWriter()
+    : hasQueued(false), writing(false), stopping(false) { }
+
+CheckpointWriter::~CheckpointWriter() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  changed.notify_all();
+  if (thread.joinable()) thread.join();
+}
+
+void CheckpointWriter::submit(RenderCheckpoint* checkpoint,
+                              const std::string& filename) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    queued = std::move(*checkpoint);
+    queuedFile = filename;
+    hasQueued = true;
+    if (!thread.joinable()) {
+      thread = std::thread(&CheckpointWriter::writer_loop, this);
+    }
+  }
+  changed.notify_all();
+}
+
+void CheckpointWriter::flush() {
+  std::unique_lock<std::mutex> guard(lock);
+  changed.wait(guard, [this] { return !hasQueued && !writing; });
+}
+
+void CheckpointWriter::writer_loop() {
+
+  std::unique_lock<std::mutex> guard(lock);
+  while (true) {
+    changed.wait(guard, [this] { return hasQueued || stopping; });
+    if (!hasQueued) return;
+
+    RenderCheckpoint checkpoint;
+    std::swap(checkpoint, queued);
+    std::string filename = queuedFile;
+    hasQueued = false;
+    writing = true;
+
+    guard.unlock();
+    if (checkpoint.write(filename)) {
+      fprintf(stdout, "[PathTracer] Checkpoint of %zu passes written to %s\n",
+              (size_t) checkpoint.passes, filename.c_str());
+    } else {
+      fprintf(stderr, "[PathTracer] Cannot write checkpoint to %s\n",
+              filename.c_str());
+    }
+    guard.lock();
+
+    writing = false;
+    changed.notify_all();
+  }
+}
+
+} // namespace CMU462
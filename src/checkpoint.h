@@ -0,0 +1,117 @@
+#ifndef CMU462_CHECKPOINT_H
+#define CMU462_CHECKPOINT_H
+
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <condition_variable>
+
+#include "CMU462/spectrum.h"
+
+namespace CMU462 {
+
+/**
+ * The settings that decide what a render computes. A checkpoint can only
+ * be continued with the settings it was rendered with.
+ */
+struct RenderSettings {
+  uint64_t width;
+  uint64_t height;
+  uint64_t ns_aa;
+  uint64_t ns_pass;
+  uint64_t max_ray_depth;
+  uint64_t ns_area_light;
+  uint64_t ns_diff;
+  uint64_t ns_glsy;
+  uint64_t ns_refr;
+  uint64_t bdpt;
+  uint64_t seed;
+  uint64_t sequence;
+  uint64_t ns_light_cache;
+  double adaptive_error;
+  double time_budget;
+
+  bool operator==(const RenderSettings& s) const;
+  bool operator!=(const RenderSettings& s) const { return !(*this == s); }
+};
+
+/**
+ * Accumulation state of a render after a complete pass. The random numbers
+ * of every sample are derived from the seed, the pixel and the sample index,
+ * so the number of passes is all it takes to continue the random streams
+ * where they left off.
+ */
+struct RenderCheckpoint {
+  RenderSettings settings;            ///< settings of the render
+  uint64_t passes;                    ///< passes completed
+  double elapsed;                     ///< seconds spent rendering so far
+  std::vector<Spectrum> sums;         ///< per pixel sums of samples
+  std::vector<unsigned int> counts;   ///< per pixel sample counts
+  std::vector<float> squares;         ///< per pixel sums of squared luminance,
+                                      ///< only kept for adaptive sampling
+
+  /**
+   * Write the checkpoint to a file. The data goes to a temporary file that
+   * is then renamed, so an interrupted write never destroys the previous
+   * checkpoint. Sample counts are stored once if all pixels have the same.
+   * \return true if the file was written
+   */
+  bool write(const std::string& filename) const;
+
+  /**
+   * Read a checkpoint written by write.
+   * \return false if the file cannot be read or is no checkpoint
+   */
+  bool read(const std::string& filename);
+};
+
+/**
+ * Writes checkpoints on a thread of its own, so that the renderer never
+ * waits for the disk. A checkpoint submitted while the previous one is still
+ * queued replaces it, only the latest state is worth writing.
+ */
+class CheckpointWriter {
+ public:
+
+  CheckpointWriter();
+
+  /**
+   * Destructor.
+   * Writes the checkpoint still queued, if any, and stops the thread.
+   */
+  ~CheckpointWriter();
+
+  /**
+   * Queue a checkpoint to be written.
+   * \param checkpoint the checkpoint to write, its data is moved out
+   * \param filename file to write it to
+   */
+  void submit(RenderCheckpoint* checkpoint, const std::string& filename);
+
+  /**
+   * Wait until all submitted checkpoints are written.
+   */
+  void flush();
+
+ private:
+
+  /**
+   * Implementation of the writer thread.
+   */
+  void writer_loop();
+
+  std::thread thread;               ///< writer thread, started on first use
+  std::mutex lock;                  ///< guards everything below
+  std::condition_variable changed;  ///< signaled when the state changes
+  RenderCheckpoint queued;          ///< next checkpoint to write
+  std::string queuedFile;           ///< file to write it to
+  bool hasQueued;                   ///< queued holds a checkpoint
+  bool writing;                     ///< the thread is writing a checkpoint
+  bool stopping;                    ///< the thread should exit
+};
+
+} // namespace CMU462
+
+#endif // CMU462_CHECKPOINT_H
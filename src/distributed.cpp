@@ -0,0 +1,386 @@
+#include "distributed.h"
+
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <algorithm>
+
+#include <poll.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "CMU462/timer.h"
+
+namespace CMU462 {
+
+// seconds of work handed to a worker at once, once its throughput is known
+static const double kRangeSeconds = 4;
+
+// a worker that takes kTimeoutFactor times longer than expected for a range,
+// and at least kMinTimeout seconds, is given up on
+static const double kTimeoutFactor = 10;
+static const double kMinTimeout = 120;
+
+// workers retry connecting kConnectAttempts times, kConnectDelay us apart
+static const int kConnectAttempts = 40;
+static const int kConnectDelay = 250000;
+
+static const uint32_t kMagic = 0x50545231;
+
+enum MessageType {
+  MSG_JOB,     ///< coordinator to worker, a RenderJob follows
+  MSG_READY,   ///< worker to coordinator, the scene is loaded, the
+               ///< worker's RenderSettings follow
+  MSG_WORK,    ///< coordinator to worker, render the range
+  MSG_RESULT,  ///< worker to coordinator, sums and counts of the range follow
+  MSG_DONE     ///< coordinator to worker, no more work
+};
+
+/**
+ * Header of every message. Everything is sent in host byte order, so all
+ * machines of a render must have the same endianness.
+ */
+struct MessageHeader {
+  uint32_t magic;
+  uint32_t type;
+  uint64_t first;  ///< first sample of the range of MSG_WORK and MSG_RESULT
+  uint64_t count;  ///< number of samples of MSG_WORK and MSG_RESULT
+};
+
+static_assert(sizeof(Spectrum) == 3 * sizeof(float),
+              "sample sums are sent as packed floats");
+static_assert(sizeof(unsigned int) == sizeof(uint32_t),
+              "sample counts are sent as 32 bit integers");
+
+static bool send_all(int fd, const void* data, size_t size) {
+  const char* p = (const char*) data;
+  while (size > 0) {
+    ssize_t n = send(fd, p, size, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool recv_all(int fd, void* data, size_t size) {
+  char* p = (char*) data;
+  while (size > 0) {
+    ssize_t n = recv(fd, p, size, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool send_message(int fd, MessageType type,
+                         size_t first = 0, size_t count = 0) {
+  MessageHeader header = { kMagic, (uint32_t) type, first, count };
+  return send_all(fd, &header, sizeof(header));
+}
+
+static bool recv_message(int fd, MessageType type, MessageHeader* header) {
+  return recv_all(fd, header, sizeof(*header)) &&
+         header->magic == kMagic && header->type == (uint32_t) type;
+}
+
+// RenderCoordinator //
+
+RenderCoordinator::RenderCoordinator(const RenderJob& job)
+    : job(job), sampleBuffer(job.width, job.height),
+      sampleCountBuffer(job.width * job.height, 0) {
+  sampleBuffer.clear();
+  SampleRange all = { 0, job.ns_aa };
+  if (all.count > 0) pending.push_back(all);
+  outstanding = 0;
+  samplesDone = 0;
+  numWorkers = 0;
+  done = pending.empty();
+}
+
+bool RenderCoordinator::run(int port) {
+
+  // a worker that dies while we send to it must not take us down too
+  signal(SIGPIPE, SIG_IGN);
+
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (listener < 0 ||
+      setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+      bind(listener, (sockaddr*) &addr, sizeof(addr)) < 0 ||
+      listen(listener, 16) < 0) {
+    fprintf(stderr, "[Coordinator] Cannot listen on port %d: %s\n",
+            port, strerror(errno));
+    if (listener >= 0) close(listener);
+    return false;
+  }
+  fprintf(stdout, "[Coordinator] Waiting for workers on port %d, "
+                  "rendering %zux%zu at %zu samples per pixel\n",
+          port, (size_t) job.width, (size_t) job.height, (size_t) job.ns_aa);
+
+  Timer timer;
+  timer.start();
+
+  // accept workers until the render is done, each is served by its own thread
+  std::vector<std::thread> threads;
+  while (true) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (done) break;
+    }
+    pollfd p = { listener, POLLIN, 0 };
+    if (poll(&p, 1, 200) <= 0) continue;
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) continue;
+    threads.push_back(std::thread(&RenderCoordinator::serve_worker, this,
+                                  fd, threads.size()));
+  }
+  close(listener);
+  for (std::thread& t : threads) t.join();
+
+  timer.stop();
+  fprintf(stdout, "[Coordinator] Done! (%.4f sec)\n", timer.duration());
+  return true;
+}
+
+void RenderCoordinator::serve_worker(int fd, size_t worker_id) {
+
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  // hand out the job and wait for the worker to load the scene, which may
+  // take a while; it gets no work if the render finishes in the meantime
+  MessageHeader header;
+  RenderSettings settings;
+  bool joined = false;
+  bool ok = send_message(fd, MSG_JOB) && send_all(fd, &job, sizeof(job));
+  while (ok) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (done) break;
+    }
+    pollfd p = { fd, POLLIN, 0 };
+    if (poll(&p, 1, 200) > 0) {
+      ok = recv_message(fd, MSG_READY, &header) &&
+           recv_all(fd, &settings, sizeof(settings));
+
+      // a worker rendering anything else would spoil the merged image
+      if (ok && settings != job) {
+        fprintf(stderr, "[Coordinator] Worker %zu does not render with the "
+                        "settings of the job, turned away\n", worker_id);
+        ok = false;
+        break;
+      }
+      if (ok) {
+        std::lock_guard<std::mutex> guard(lock);
+        numWorkers++;
+        joined = true;
+      }
+      break;
+    }
+  }
+  if (!joined) {
+    if (ok) send_message(fd, MSG_DONE);
+    close(fd);
+    return;
+  }
+  fprintf(stdout, "[Coordinator] Worker %zu joined\n", worker_id);
+
+  size_t pixels = (size_t) job.width * job.height;
+  std::vector<Spectrum> sums(pixels);
+  std::vector<unsigned int> counts(pixels);
+  double throughput = 0;
+  bool lost = false;
+  SampleRange range;
+  while (take_range(throughput, &range)) {
+
+    // give up on a worker that takes far longer than it should
+    double expected = throughput > 0 ? range.count / throughput : 0;
+    double timeout = std::max(kMinTimeout, kTimeoutFactor * expected);
+    timeval tv;
+    tv.tv_sec = (time_t) timeout;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    Timer timer;
+    timer.start();
+    bool answered = send_message(fd, MSG_WORK, range.first, range.count) &&
+                    recv_message(fd, MSG_RESULT, &header) &&
+                    header.first == range.first &&
+                    header.count == range.count &&
+                    recv_all(fd, &sums[0], pixels * sizeof(Spectrum)) &&
+                    recv_all(fd, &counts[0], pixels * sizeof(unsigned int));
+    timer.stop();
+
+    if (!answered) {
+      fprintf(stderr, "[Coordinator] Lost worker %zu, samples [%zu, %zu) "
+                      "are handed out again\n", worker_id, range.first,
+              range.first + range.count);
+      return_range(range);
+      lost = true;
+      break;
+    }
+    throughput = range.count / std::max(timer.duration(), 1e-3);
+    finish_range(range, sums, counts);
+  }
+
+  if (!lost) send_message(fd, MSG_DONE);
+  close(fd);
+
+  std::lock_guard<std::mutex> guard(lock);
+  numWorkers--;
+}
+
+bool RenderCoordinator::take_range(double throughput, SampleRange* range) {
+
+  std::unique_lock<std::mutex> guard(lock);
+  changed.wait(guard, [this] { return done || !pending.empty(); });
+  if (done) return false;
+
+  // a single sample until the worker's throughput is known, then about
+  // kRangeSeconds worth, but no more than a fair share of what is left
+  size_t remaining = 0;
+  for (const SampleRange& r : pending) remaining += r.count;
+  size_t share = (remaining + numWorkers - 1) / numWorkers;
+  size_t count = throughput > 0 ? (size_t) (throughput * kRangeSeconds) : 1;
+  count = std::max((size_t) 1, std::min(count, share));
+
+  SampleRange& front = pending.front();
+  range->first = front.first;
+  range->count = std::min(count, front.count);
+  front.first += range->count;
+  front.count -= range->count;
+  if (front.count == 0) pending.pop_front();
+  outstanding++;
+  return true;
+}
+
+void RenderCoordinator::return_range(const SampleRange& range) {
+  std::lock_guard<std::mutex> guard(lock);
+  pending.push_front(range);
+  outstanding--;
+  changed.notify_all();
+}
+
+void RenderCoordinator::finish_range(const SampleRange& range,
+                                     const std::vector<Spectrum>& sums,
+                                     const std::vector<unsigned int>& counts) {
+  std::lock_guard<std::mutex> guard(lock);
+  for (size_t i = 0; i < sums.size(); i++) {
+    sampleBuffer.data[i] += sums[i];
+    sampleCountBuffer[i] += counts[i];
+  }
+  outstanding--;
+  samplesDone += range.count;
+  fprintf(stdout, "[Coordinator] %zu of %zu samples per pixel done\n",
+          samplesDone, (size_t) job.ns_aa);
+  if (pending.empty() && outstanding == 0) done = true;
+  changed.notify_all();
+}
+
+// RenderWorker //
+
+RenderWorker::RenderWorker() : fd(-1) {
+  memset(&job, 0, sizeof(job));
+}
+
+RenderWorker::~RenderWorker() {
+  if (fd >= 0) close(fd);
+}
+
+bool RenderWorker::connect(const std::string& host, int port) {
+
+  // losing the coordinator is reported by serve, not by a signal
+  signal(SIGPIPE, SIG_IGN);
+
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* addrs = NULL;
+  std::string service = std::to_string(port);
+  int err = getaddrinfo(host.c_str(), service.c_str(), &hints, &addrs);
+  if (err != 0) {
+    fprintf(stderr, "[Worker] Cannot resolve %s: %s\n",
+            host.c_str(), gai_strerror(err));
+    return false;
+  }
+
+  for (int attempt = 0; attempt < kConnectAttempts && fd < 0; attempt++) {
+    if (attempt > 0) usleep(kConnectDelay);
+    for (addrinfo* a = addrs; a != NULL && fd < 0; a = a->ai_next) {
+      fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (fd >= 0 && ::connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+      }
+    }
+  }
+  freeaddrinfo(addrs);
+  if (fd < 0) {
+    fprintf(stderr, "[Worker] Cannot connect to %s:%d\n", host.c_str(), port);
+    return false;
+  }
+
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  MessageHeader header;
+  if (!recv_message(fd, MSG_JOB, &header) ||
+      !recv_all(fd, &job, sizeof(job))) {
+    fprintf(stderr, "[Worker] No job from %s:%d\n", host.c_str(), port);
+    close(fd);
+    fd = -1;
+    return false;
+  }
+  fprintf(stdout, "[Worker] Connected to %s:%d, rendering %zux%zu at %zu "
+                  "samples per pixel\n", host.c_str(), port,
+          (size_t) job.width, (size_t) job.height, (size_t) job.ns_aa);
+  return true;
+}
+
+bool RenderWorker::serve(const RenderSettings& settings,
+                         const RenderFunction& render) {
+
+  if (fd < 0 || !send_message(fd, MSG_READY) ||
+      !send_all(fd, &settings, sizeof(settings))) return false;
+
+  size_t pixels = (size_t) job.width * job.height;
+  MessageHeader header;
+  while (recv_all(fd, &header, sizeof(header)) && header.magic == kMagic) {
+    if (header.type == MSG_DONE) return true;
+    if (header.type != MSG_WORK) break;
+
+    const HDRImageBuffer* sums = NULL;
+    const std::vector<unsigned int>* counts = NULL;
+    render(header.first, header.count, &sums, &counts);
+    if (sums->data.size() != pixels || counts->size() != pixels) {
+      fprintf(stderr, "[Worker] Rendered image does not match the job\n");
+      return false;
+    }
+
+    if (!send_message(fd, MSG_RESULT, header.first, header.count) ||
+        !send_all(fd, &sums->data[0], pixels * sizeof(Spectrum)) ||
+        !send_all(fd, &(*counts)[0], pixels * sizeof(unsigned int))) {
+      break;
+    }
+  }
+
+  fprintf(stderr, "[Worker] Lost the connection to the coordinator\n");
+  return false;
+}
+
+} // namespace CMU462
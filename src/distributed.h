@@ -0,0 +1,164 @@
+#ifndef CMU462_DISTRIBUTED_H
+#define CMU462_DISTRIBUTED_H
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <functional>
+#include <condition_variable>
+
+#include "image.h"
+#include "checkpoint.h"
+
+namespace CMU462 {
+
+/**
+ * What a coordinator asks every worker of a distributed render to render:
+ * all settings that decide what the render computes, which the workers
+ * take over. Only the scene and the environment map come from each
+ * worker's own command line.
+ */
+typedef RenderSettings RenderJob;
+
+/**
+ * Coordinator of a distributed render. Workers connect over TCP, get the
+ * job and then render ranges of the samples of every pixel, which the
+ * coordinator sums into one image. Every range is sized so that it takes a
+ * worker about the same time, judging by the throughput of its previous
+ * range. Ranges of workers that disconnect or stop answering are handed out
+ * again, so the image always ends up with ns_aa samples in every pixel.
+ */
+class RenderCoordinator {
+ public:
+
+  /**
+   * Constructor.
+   * \param job the render to distribute
+   */
+  RenderCoordinator(const RenderJob& job);
+
+  /**
+   * Accept workers on the given port and hand out work until every sample
+   * has been rendered. Blocks until then.
+   * \param port TCP port to listen on
+   * \return false if the port cannot be opened
+   */
+  bool run(int port);
+
+  /**
+   * Per pixel sums of the samples returned by the workers.
+   */
+  const HDRImageBuffer& get_sample_buffer() const { return sampleBuffer; }
+
+  /**
+   * Per pixel counts of the samples returned by the workers.
+   */
+  const std::vector<unsigned int>& get_sample_counts() const {
+    return sampleCountBuffer;
+  }
+
+ private:
+
+  /**
+   * Samples [first, first + count) of every pixel.
+   */
+  struct SampleRange {
+    size_t first;
+    size_t count;
+  };
+
+  /**
+   * Talk to one connected worker until the render is done or the worker is
+   * lost. Runs on its own thread.
+   */
+  void serve_worker(int fd, size_t worker_id);
+
+  /**
+   * Take the next range to render, waiting while all remaining ranges are
+   * out with other workers in case one of them gets lost.
+   * \param throughput samples per pixel per second of the worker, 0 if
+   *        not measured yet
+   * \param range the range to render
+   * \return false once the render is done
+   */
+  bool take_range(double throughput, SampleRange* range);
+
+  /**
+   * Hand a range back for other workers to render.
+   */
+  void return_range(const SampleRange& range);
+
+  /**
+   * Add the result of a range to the image.
+   */
+  void finish_range(const SampleRange& range, const std::vector<Spectrum>& sums,
+                    const std::vector<unsigned int>& counts);
+
+  RenderJob job;
+
+  HDRImageBuffer sampleBuffer;                  ///< sums of returned samples
+  std::vector<unsigned int> sampleCountBuffer;  ///< per pixel sample counts
+
+  std::mutex lock;                   ///< guards everything below
+  std::condition_variable changed;   ///< signaled when ranges come and go
+  std::deque<SampleRange> pending;   ///< ranges nobody is rendering
+  size_t outstanding;                ///< ranges being rendered by workers
+  size_t samplesDone;                ///< samples per pixel returned so far
+  size_t numWorkers;                 ///< workers currently connected
+  bool done;                         ///< every sample has been returned
+};
+
+/**
+ * Worker of a distributed render, the counterpart of RenderCoordinator.
+ */
+class RenderWorker {
+ public:
+
+  RenderWorker();
+
+  ~RenderWorker();
+
+  /**
+   * Connect to a coordinator and receive the job. Retries for a few seconds
+   * so that workers can be started together with the coordinator.
+   * \param host name or address of the coordinator
+   * \param port TCP port of the coordinator
+   * \return false if no connection could be made
+   */
+  bool connect(const std::string& host, int port);
+
+  /**
+   * The job received from the coordinator.
+   */
+  const RenderJob& get_job() const { return job; }
+
+  /**
+   * Callback rendering samples [first, first + count) of every pixel into
+   * the given sample sums and counts.
+   */
+  typedef std::function<void(size_t first, size_t count,
+                             const HDRImageBuffer** sums,
+                             const std::vector<unsigned int>** counts)>
+      RenderFunction;
+
+  /**
+   * Tell the coordinator that the worker is ready, then render the ranges
+   * it hands out until it has no more work.
+   * \param settings settings the worker renders with, the coordinator
+   *        turns the worker away unless they are the job's
+   * \param render renders one range
+   * \return false if the connection to the coordinator broke
+   */
+  bool serve(const RenderSettings& settings, const RenderFunction& render);
+
+ private:
+  int fd;        ///< connection to the coordinator, -1 if none
+  RenderJob job; ///< job received from the coordinator
+};
+
+} // namespace CMU462
+
+#endif // CMU462_DISTRIBUTED_H
@@ -11,6 +11,7 @@ namespace CMU462 { namespace DynamicScene {
 class DrawStyle {
  public:
 
+#ifndef DISABLE_GL
   void style_reset() const {
     glLineWidth(1);
     glPointSize(1);
@@ -34,6 +35,7 @@ class DrawStyle {
     glColor4fv(&vertexColor.r);
     glPointSize(vertexRadius);
   }
+#endif
 
   Color halfedgeColor;
   Color vertexColor;
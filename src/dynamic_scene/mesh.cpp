@@ -35,6 +35,7 @@ Mesh::Mesh(Collada::PolymeshInfo& polyMesh, const Matrix4x4& transform) {
 }
 
 void Mesh::render_in_opengl() const {
+#ifndef DISABLE_GL
 
   // TODO: fix drawing with BSDF
   // DiffuseBSDF* diffuse = dynamic_cast<DiffuseBSDF*>(bsdf);
@@ -55,8 +56,10 @@ void Mesh::render_in_opengl() const {
   draw_feature_if_needed(&hoveredFeature);
   draw_feature_if_needed(&selectedFeature);
   glEnable(GL_LIGHTING);
+#endif
 }
 
+#ifndef DISABLE_GL
 void Mesh::draw_faces() const {
 
   for (FaceCIter f = mesh.facesBegin(); f != mesh.facesEnd(); f++) {
@@ -161,6 +164,7 @@ void Mesh::draw_halfedge_arrow(const Halfedge *h) const {
 
   get_draw_style(h)->style_reset();
 }
+#endif
 
 DrawStyle *Mesh::get_draw_style(const HalfedgeElement *element) const {
   if (element == selectedFeature.element) return selectedStyle;
@@ -1,5 +1,7 @@
 #include "scene.h"
 
+#include "../static_scene/light.h"
+
 using std::cout;
 using std::endl;
 
@@ -130,6 +132,23 @@ void Scene::resample_selected_mesh() {
   invalidate_selection();
 }
 
+/**
+ * Whether an emissive mesh is only the visible stand-in of one of the
+ * scene's area lights, which already emits for it. The Cornell boxes put
+ * an emissive quad on the rectangle of their area light.
+ * \param mesh the emissive mesh
+ * \param lights the lights of the scene, without those of emissive objects
+ */
+static bool stands_in_for_light(
+    const StaticScene::Mesh *mesh,
+    const std::vector<StaticScene::SceneLight *>& lights) {
+  for (StaticScene::SceneLight *light : lights) {
+    StaticScene::AreaLight *area = dynamic_cast<StaticScene::AreaLight *>(light);
+    if (area && area->coincides_with(mesh)) return true;
+  }
+  return false;
+}
+
 StaticScene::Scene *Scene::get_static_scene() {
   std::vector<StaticScene::SceneObject *> staticObjects;
   std::vector<StaticScene::SceneLight *> staticLights;
@@ -141,6 +160,24 @@ StaticScene::Scene *Scene::get_static_scene() {
     staticLights.push_back(light->get_static_light());
   }
 
+  // objects with emission BSDFs become mesh and sphere lights, so that they
+  // are sampled like the other lights instead of only found by chance
+  std::vector<StaticScene::SceneLight *> sceneLights = staticLights;
+  for (StaticScene::SceneObject *obj : staticObjects) {
+    const Spectrum& emission = obj->get_bsdf()->get_emission();
+    if (emission.illum() <= 0) continue;
+
+    StaticScene::SceneLight *light = NULL;
+    if (StaticScene::Mesh *mesh = dynamic_cast<StaticScene::Mesh *>(obj)) {
+      if (stands_in_for_light(mesh, sceneLights)) continue;
+      light = new StaticScene::MeshLight(emission, mesh);
+    } else if (StaticScene::SphereObject *sphere =
+               dynamic_cast<StaticScene::SphereObject *>(obj)) {
+      light = new StaticScene::SphereLight(emission, sphere);
+    }
+    if (light) staticLights.push_back(light);
+  }
+
   return new StaticScene::Scene(staticObjects, staticLights);
 }
 
@@ -8,7 +8,9 @@
 #include "CMU462/CMU462.h"
 #include "CMU462/color.h"
 
+#ifndef DISABLE_GL
 #include "GL/glew.h"
+#endif
 
 #include "draw_style.h"
 #include "mesh_view.h"
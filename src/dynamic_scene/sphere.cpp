@@ -1,7 +1,9 @@
 #include "sphere.h"
 
 #include "../static_scene/object.h"
+#ifndef DISABLE_GL
 #include "../misc/sphere_drawing.h"
+#endif
 
 namespace CMU462 { namespace DynamicScene {
 
@@ -21,7 +23,9 @@ void Sphere::set_draw_styles(DrawStyle *defaultStyle, DrawStyle *hoveredStyle,
 }
 
 void Sphere::render_in_opengl() const {
+#ifndef DISABLE_GL
   Misc::draw_sphere_opengl(p, r);
+#endif
 }
 
 BBox Sphere::get_bbox() {
@@ -0,0 +1,98 @@
+#include "image.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "CMU462/lodepng.h"
+#include "CMU462/tinyexr.h"
+
+namespace CMU462 {
+
+bool write_png(const std::string& filename, const ImageBuffer& buffer) {
+
+  const uint32_t* frame = &buffer.data[0];
+  size_t w = buffer.w;
+  size_t h = buffer.h;
+  uint32_t* frame_out = new uint32_t[w * h];
+  for(size_t i = 0; i < h; ++i) {
+    memcpy(frame_out + i * w, frame + (h - i - 1) * w, 4 * w);
+  }
+
+  fprintf(stderr, "[PathTracer] Saving to file: %s... ", filename.c_str());
+  unsigned error = lodepng::encode(filename, (unsigned char*) frame_out, w, h);
+  if (error) {
+    fprintf(stderr, "Failed! (%s)\n", lodepng_error_text(error));
+  } else {
+    fprintf(stderr, "Done!\n");
+  }
+
+  delete[] frame_out;
+  return error == 0;
+}
+
+bool write_exr(const std::string& filename, const HDRImageBuffer& buffer,
+               const std::vector<unsigned int>& counts) {
+
+  size_t w = buffer.w;
+  size_t h = buffer.h;
+  std::vector<float> channels[3];
+  for (int c = 0; c < 3; ++c) channels[c].resize(w * h);
+  for (size_t y = 0; y < h; ++y) {
+    for (size_t x = 0; x < w; ++x) {
+      size_t i = x + y * w;
+      size_t o = x + (h - y - 1) * w;
+      Spectrum s = buffer.data[i] * (1.0f / std::max(1u, counts[i]));
+      channels[0][o] = s.b;
+      channels[1][o] = s.g;
+      channels[2][o] = s.r;
+    }
+  }
+
+  // tinyexr expects the channels in B, G, R order
+  const char* names[3] = { "B", "G", "R" };
+  unsigned char* images[3] = {
+    (unsigned char*) &channels[0][0],
+    (unsigned char*) &channels[1][0],
+    (unsigned char*) &channels[2][0]
+  };
+  int pixel_types[3] = { TINYEXR_PIXELTYPE_FLOAT, TINYEXR_PIXELTYPE_FLOAT,
+                         TINYEXR_PIXELTYPE_FLOAT };
+
+  EXRImage exr;
+  InitEXRImage(&exr);
+  exr.num_channels = 3;
+  exr.channel_names = names;
+  exr.images = images;
+  exr.pixel_types = pixel_types;
+  exr.requested_pixel_types = pixel_types;
+  exr.width = w;
+  exr.height = h;
+
+  fprintf(stderr, "[PathTracer] Saving to file: %s... ", filename.c_str());
+  const char* err = NULL;
+  int ret = SaveMultiChannelEXRToFile(&exr, filename.c_str(), &err);
+  if (ret != 0) {
+    fprintf(stderr, "Failed! (%s)\n", err ? err : "unknown error");
+  } else {
+    fprintf(stderr, "Done!\n");
+  }
+
+  return ret == 0;
+}
+
+bool write_image(const std::string& filename, const HDRImageBuffer& buffer,
+                 const std::vector<unsigned int>& counts) {
+
+  const std::string ext = ".exr";
+  if (filename.size() >= ext.size() &&
+      filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0) {
+    return write_exr(filename, buffer, counts);
+  }
+
+  ImageBuffer frame(buffer.w, buffer.h);
+  frame.clear();
+  buffer.toColor(frame, 0, 0, buffer.w, buffer.h, counts);
+  return write_png(filename, frame);
+}
+
+} // namespace CMU462
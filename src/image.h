@@ -5,6 +5,7 @@
 #include "CMU462/spectrum.h"
 
 #include <string.h>
+#include <string>
 #include <vector>
 
 namespace CMU462 {
@@ -183,7 +184,7 @@ struct HDRImageBuffer {
   /**
    * Convert the given tile of the buffer to color.
    */
-  void toColor(ImageBuffer& target, size_t x0, size_t y0, size_t x1, size_t y1) {
+  void toColor(ImageBuffer& target, size_t x0, size_t y0, size_t x1, size_t y1) const {
 
     float gamma = 2.2f;
     float level = 1.0f;
@@ -200,6 +201,31 @@ struct HDRImageBuffer {
     }
   }
 
+  /**
+   * Convert the given tile of a buffer holding per pixel sums of samples to
+   * color, dividing each pixel by its sample count. Pixels that have no
+   * samples yet are left untouched in the target.
+   */
+  void toColor(ImageBuffer& target, size_t x0, size_t y0, size_t x1, size_t y1,
+               const std::vector<unsigned int>& counts) const {
+
+    float gamma = 2.2f;
+    float level = 1.0f;
+    float one_over_gamma = 1.0f / gamma;
+    float exposure = sqrt(pow(2,level));
+    for (size_t y = y0; y < y1; ++y) {
+      for (size_t x = x0; x < x1; ++x) {
+        unsigned int n = counts[x + y * w];
+        if (n == 0) continue;
+        Spectrum s = data[x + y * w] * (1.0f / n);
+        float r = pow(s.r * exposure, one_over_gamma);
+        float g = pow(s.g * exposure, one_over_gamma);
+        float b = pow(s.b * exposure, one_over_gamma);
+        target.update_pixel(Color(r, g, b, 1.0), x, y);
+      }
+    }
+  }
+
   /**
    * If the buffer is empty
    */
@@ -216,6 +242,37 @@ struct HDRImageBuffer {
 
 }; // class HDRImageBuffer
 
+/**
+ * Write a frame buffer to a png file, flipping it so that the image is
+ * stored top row first.
+ * \param filename path of the png file
+ * \param buffer image to write
+ * \return true if the file was written
+ */
+bool write_png(const std::string& filename, const ImageBuffer& buffer);
+
+/**
+ * Write the linear radiance of a buffer holding per pixel sums of samples to
+ * an exr file, dividing each pixel by its sample count.
+ * \param filename path of the exr file
+ * \param buffer per pixel sums of samples
+ * \param counts per pixel sample counts
+ * \return true if the file was written
+ */
+bool write_exr(const std::string& filename, const HDRImageBuffer& buffer,
+               const std::vector<unsigned int>& counts);
+
+/**
+ * Write a buffer holding per pixel sums of samples to a file: linear
+ * radiance if the name ends in .exr, a tone mapped png otherwise.
+ * \param filename path of the image file
+ * \param buffer per pixel sums of samples
+ * \param counts per pixel sample counts
+ * \return true if the file was written
+ */
+bool write_image(const std::string& filename, const HDRImageBuffer& buffer,
+                 const std::vector<unsigned int>& counts);
+
 
 } // namespace CMU462
 
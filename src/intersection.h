@@ -19,12 +19,20 @@ class Primitive;
  */
 struct Intersection {
 
-  Intersection() : t (INF_D), primitive(NULL), bsdf(NULL) { }
+  Intersection() : t (INF_D), primitive(NULL), b1(0), b2(0), bsdf(NULL) { }
 
   double t;    ///< time of intersection
 
   const Primitive* primitive;  ///< the primitive intersected
 
+  double b1;   ///< barycentric coordinate of the hit for the second vertex
+  double b2;   ///< barycentric coordinate of the hit for the third vertex
+
+  // NOTE:
+  // Traversal only records t, primitive and the barycentric coordinates for
+  // every candidate hit. The shading data below is filled in once for the
+  // closest hit by Primitive::finalize_hit.
+
   Vector3D n;  ///< normal at point of intersection
 
   BSDF* bsdf; ///< BSDF of the surface at point of intersection
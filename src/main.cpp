@@ -1,5 +1,11 @@
 #include "CMU462/CMU462.h"
+#ifndef DISABLE_GL
 #include "CMU462/viewer.h"
+#endif
+
+// the miniz inside tinyexr includes <time.h> in its own namespace, the
+// global declarations have to come first
+#include <ctime>
 
 #define TINYEXR_IMPLEMENTATION
 #include "CMU462/tinyexr.h"
@@ -8,26 +14,99 @@
 #include "image.h"
 
 #include <iostream>
+#include <cstring>
 #include <unistd.h>
+#include <getopt.h>
 
 using namespace std;
 using namespace CMU462;
 
 #define msg(s) cerr << "[PathTracer] " << s << endl;
 
+// headless image size, same as the viewer's initial window
+#define DEFAULT_W 960
+#define DEFAULT_H 640
+
 void usage(const char* binaryName) {
   printf("Usage: %s [options] <scenefile>\n", binaryName);
   printf("Program Options:\n");
   printf("  -s  <INT>        Number of camera rays per pixel\n");
+  printf("  -P  <INT>        Render progressively, INT camera rays per pixel per pass\n");
+  printf("  -a  <FLOAT>      Adaptive sampling to a relative error target, -s is the maximum\n");
+  printf("  -T  <FLOAT>      Render passes for FLOAT seconds instead of -s samples\n");
+  printf("  -k  <INT>        Image tile size in pixels (default 32)\n");
+  printf("  -S  <INT>        Random seed\n");
+  printf("  -q  <NAME>       Sample sequence: random, sobol, halton or bluenoise\n");
   printf("  -l  <INT>        Number of samples per area light\n");
   printf("  -t  <INT>        Number of render threads\n");
   printf("  -m  <INT>        Maximum ray depth\n");
+  printf("  --ns-diff <INT>  Classic: paths continued from each diffuse surface\n");
+  printf("                   camera rays hit (default 1)\n");
+  printf("  --ns-glsy <INT>  Classic: same for glossy surfaces\n");
+  printf("  --ns-refr <INT>  Classic: same for glass surfaces\n");
+  printf("                   Mirrors and pure refraction are not split, the\n");
+  printf("                   path splits at the next surface instead\n");
   printf("  -e  <PATH>       Path to environment map\n");
   printf("  -h               Print this help message\n");
-  printf("  -p               1 for BDPT; 0 for classic path tracing");
+  printf("  -p               1 for BDPT; 0 for classic path tracing\n");
+  printf("  -L  <INT>        BDPT: share INT cached light subpaths per pass\n");
+  printf("  -j  <PATH>       Print BVH quality report, write it as json to PATH\n");
+  printf("  -c  <FLOAT>      Traversal cost (Ct) for the reported SAH cost\n");
+  printf("  -i  <FLOAT>      Intersection cost (Ci) for the reported SAH cost\n");
+  printf("  -C  <PATH>       Checkpoint the render to PATH every minute\n");
+  printf("  --checkpoint-interval <FLOAT>\n");
+  printf("                   Seconds between checkpoints (default 60)\n");
+  printf("  --resume <PATH>  Continue the checkpointed render in PATH headless,\n");
+  printf("                   with its settings. Requires -o, checkpoints to\n");
+  printf("                   PATH unless -C is given\n");
+  printf("  --headless       Render without a window and exit, requires -o\n");
+  printf("                   or -j, with -j and no -o only writes the report\n");
+  printf("  -o  <PATH>       Headless: output image, .exr for radiance, else png\n");
+  printf("  --width  <INT>   Headless: image width (default %d)\n", DEFAULT_W);
+  printf("  --height <INT>   Headless: image height (default %d)\n", DEFAULT_H);
+  printf("  --coordinator <PORT>\n");
+  printf("                   Distribute a headless render of -s samples at\n");
+  printf("                   --width x --height to workers connecting to PORT,\n");
+  printf("                   write it to -o. Takes no scene file\n");
+  printf("  --worker <HOST:PORT>\n");
+  printf("                   Render for the coordinator at HOST:PORT with its\n");
+  printf("                   settings, only the scene and -e are the worker's\n");
+#ifdef DISABLE_GL
+  printf("\n");
+  printf("Built without GL: there is no viewer, every render is headless\n");
+#endif
   printf("\n");
 }
 
+// long only options
+enum {
+  OPT_HEADLESS = 256,
+  OPT_WIDTH,
+  OPT_HEIGHT,
+  OPT_COORDINATOR,
+  OPT_WORKER,
+  OPT_CHECKPOINT_INTERVAL,
+  OPT_RESUME,
+  OPT_NS_DIFF,
+  OPT_NS_GLSY,
+  OPT_NS_REFR
+};
+
+static const struct option long_options[] = {
+  { "headless",    no_argument,       NULL, OPT_HEADLESS    },
+  { "width",       required_argument, NULL, OPT_WIDTH       },
+  { "height",      required_argument, NULL, OPT_HEIGHT      },
+  { "coordinator", required_argument, NULL, OPT_COORDINATOR },
+  { "worker",      required_argument, NULL, OPT_WORKER      },
+  { "checkpoint-interval", required_argument, NULL, OPT_CHECKPOINT_INTERVAL },
+  { "resume",      required_argument, NULL, OPT_RESUME      },
+  { "ns-diff",     required_argument, NULL, OPT_NS_DIFF     },
+  { "ns-glsy",     required_argument, NULL, OPT_NS_GLSY     },
+  { "ns-refr",     required_argument, NULL, OPT_NS_REFR     },
+  { "output",      required_argument, NULL, 'o'             },
+  { NULL,          0,                 NULL, 0               }
+};
+
 HDRImageBuffer* load_exr(const char* file_path) {
   
   const char* err;
@@ -67,17 +146,139 @@ HDRImageBuffer* load_exr(const char* file_path) {
   return envmap;
 }
 
+/**
+ * The settings that decide what a render with the given configuration
+ * computes.
+ */
+static RenderSettings config_settings(const AppConfig& config,
+                                      size_t width, size_t height) {
+  RenderSettings settings;
+  memset(&settings, 0, sizeof(settings));
+  settings.width = width;
+  settings.height = height;
+  settings.ns_aa = config.pathtracer_ns_aa;
+  settings.ns_pass = config.pathtracer_ns_pass;
+  settings.max_ray_depth = config.pathtracer_max_ray_depth;
+  settings.ns_area_light = config.pathtracer_ns_area_light;
+  settings.ns_diff = config.pathtracer_ns_diff;
+  settings.ns_glsy = config.pathtracer_ns_glsy;
+  settings.ns_refr = config.pathtracer_ns_refr;
+  settings.bdpt = config.pathtracer_BDPT;
+  settings.seed = config.pathtracer_seed;
+  settings.sequence = config.pathtracer_sequence;
+  settings.ns_light_cache = config.pathtracer_ns_light_cache;
+  settings.adaptive_error = config.pathtracer_adaptive_error;
+  settings.time_budget = config.pathtracer_time_budget;
+  return settings;
+}
+
+/**
+ * Configure a render to compute what the settings say, for resumed renders
+ * and for the workers of a distributed one.
+ */
+static void apply_settings(const RenderSettings& settings, AppConfig* config,
+                           size_t* width, size_t* height) {
+  *width = settings.width;
+  *height = settings.height;
+  config->pathtracer_ns_aa = settings.ns_aa;
+  config->pathtracer_ns_pass = settings.ns_pass;
+  config->pathtracer_max_ray_depth = settings.max_ray_depth;
+  config->pathtracer_ns_area_light = settings.ns_area_light;
+  config->pathtracer_ns_diff = settings.ns_diff;
+  config->pathtracer_ns_glsy = settings.ns_glsy;
+  config->pathtracer_ns_refr = settings.ns_refr;
+  config->pathtracer_BDPT = settings.bdpt;
+  config->pathtracer_seed = settings.seed;
+  config->pathtracer_sequence = (SampleSequence) settings.sequence;
+  config->pathtracer_ns_light_cache = settings.ns_light_cache;
+  config->pathtracer_adaptive_error = settings.adaptive_error;
+  config->pathtracer_time_budget = settings.time_budget;
+}
+
 int main( int argc, char** argv ) {
 
   // get the options
   AppConfig config; int opt;
 
+  // headless rendering, the only kind a build without GL does
+#ifdef DISABLE_GL
+  bool headless = true;
+#else
+  bool headless = false;
+#endif
+  string outputPath;
+  size_t width = DEFAULT_W;
+  size_t height = DEFAULT_H;
+
+  // distributed rendering
+  int coordinatorPort = 0;
+  string workerAddress;
 
-  while ( (opt = getopt(argc, argv, "s:l:t:p:m:h:e")) != -1 ) {  // for each option...
+  // checkpointed rendering
+  string resumePath;
+
+  while ( (opt = getopt_long(argc, argv, "s:l:t:p:m:he:j:c:i:P:a:S:q:L:o:T:k:C:",
+                             long_options, NULL)) != -1 ) {  // for each option...
     switch ( opt ) {
+    case OPT_HEADLESS:
+        headless = true;
+        break;
+    case OPT_WIDTH:
+        width = atoi(optarg);
+        break;
+    case OPT_HEIGHT:
+        height = atoi(optarg);
+        break;
+    case OPT_COORDINATOR:
+        coordinatorPort = atoi(optarg);
+        break;
+    case OPT_WORKER:
+        workerAddress = optarg;
+        break;
+    case 'o':
+        outputPath = optarg;
+        break;
+    case 'C':
+        config.pathtracer_checkpoint = optarg;
+        break;
+    case OPT_CHECKPOINT_INTERVAL:
+        config.pathtracer_checkpoint_interval = atof(optarg);
+        break;
+    case OPT_RESUME:
+        resumePath = optarg;
+        break;
     case 's':
         config.pathtracer_ns_aa = atoi(optarg);
         break;
+    case 'P':
+        config.pathtracer_ns_pass = atoi(optarg);
+        break;
+    case 'a':
+        config.pathtracer_adaptive_error = atof(optarg);
+        break;
+    case 'T':
+        config.pathtracer_time_budget = atof(optarg);
+        break;
+    case 'k':
+        config.pathtracer_tile_size = atoi(optarg);
+        break;
+    case 'S':
+        config.pathtracer_seed = strtoul(optarg, NULL, 10);
+        break;
+    case 'q':
+        if (!strcmp(optarg, "random")) {
+          config.pathtracer_sequence = SEQUENCE_RANDOM;
+        } else if (!strcmp(optarg, "sobol")) {
+          config.pathtracer_sequence = SEQUENCE_SOBOL;
+        } else if (!strcmp(optarg, "halton")) {
+          config.pathtracer_sequence = SEQUENCE_HALTON;
+        } else if (!strcmp(optarg, "bluenoise")) {
+          config.pathtracer_sequence = SEQUENCE_BLUE_NOISE;
+        } else {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
     case 'l':
         config.pathtracer_ns_area_light = atoi(optarg);
         break;
@@ -87,20 +288,77 @@ int main( int argc, char** argv ) {
     case 'p':
         config.pathtracer_BDPT = atoi(optarg);
         break;
+    case 'L':
+        config.pathtracer_ns_light_cache = atoi(optarg);
+        break;
     case 'm':
         config.pathtracer_max_ray_depth = atoi(optarg);
         break;
+    case OPT_NS_DIFF:
+        config.pathtracer_ns_diff = atoi(optarg);
+        break;
+    case OPT_NS_GLSY:
+        config.pathtracer_ns_glsy = atoi(optarg);
+        break;
+    case OPT_NS_REFR:
+        config.pathtracer_ns_refr = atoi(optarg);
+        break;
     case 'e':
         config.pathtracer_envmap = load_exr(optarg);
         break;
+    case 'j':
+        config.pathtracer_bvh_report = optarg;
+        break;
+    case 'c':
+        config.pathtracer_sah_ct = atof(optarg);
+        break;
+    case 'i':
+        config.pathtracer_sah_ci = atof(optarg);
+        break;
     default:
         usage(argv[0]);
         return 1;
     }
   }
 
+  // the coordinator only merges what the workers render
+  if (coordinatorPort > 0) {
+    if (outputPath.empty() || width == 0 || height == 0) {
+      usage(argv[0]);
+      return 1;
+    }
+    // ranges of a fixed number of samples rule out time budgets and
+    // adaptivity
+    config.pathtracer_time_budget = 0;
+    config.pathtracer_adaptive_error = 0;
+    RenderCoordinator coordinator(config_settings(config, width, height));
+    bool saved = coordinator.run(coordinatorPort) &&
+                 write_image(outputPath, coordinator.get_sample_buffer(),
+                             coordinator.get_sample_counts());
+    exit(saved ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  // a resumed render continues headless with the checkpoint's settings
+  RenderCheckpoint checkpoint;
+  if (!resumePath.empty()) {
+    if (!checkpoint.read(resumePath)) {
+      msg("Cannot read checkpoint " << resumePath);
+      exit(EXIT_FAILURE);
+    }
+    apply_settings(checkpoint.settings, &config, &width, &height);
+    if (config.pathtracer_checkpoint.empty()) {
+      config.pathtracer_checkpoint = resumePath;
+    }
+    headless = true;
+  }
+
+  // a headless run with a BVH report to write but no image only builds
+  bool reportOnly = headless && outputPath.empty() && resumePath.empty() &&
+                    !config.pathtracer_bvh_report.empty();
+
   // print usage if no argument given
-  if (optind >= argc) {
+  if (optind >= argc || (headless && ((outputPath.empty() && !reportOnly) ||
+                                      width == 0 || height == 0))) {
     usage(argv[0]);
     return 1;
   }
@@ -109,12 +367,55 @@ int main( int argc, char** argv ) {
   msg("Input scene file: " << sceneFilePath);
 
   // parse scene
+  Timer timer;
+  timer.start();
   Collada::SceneInfo *sceneInfo = new Collada::SceneInfo();
   if (Collada::ColladaParser::load(sceneFilePath.c_str(), sceneInfo) < 0) {
     delete sceneInfo;
     exit(0);
   }
+  timer.stop();
+
+  // render sample ranges for a coordinator, also without a viewer
+  if (!workerAddress.empty()) {
+    size_t colon = workerAddress.rfind(':');
+    RenderWorker worker;
+    if (colon == string::npos ||
+        !worker.connect(workerAddress.substr(0, colon),
+                        atoi(workerAddress.c_str() + colon + 1))) {
+      delete sceneInfo;
+      exit(EXIT_FAILURE);
+    }
+    // the coordinator decides everything but the scene, the settings given
+    // to the worker are replaced by the job's
+    apply_settings(worker.get_job(), &config, &width, &height);
+    config.pathtracer_checkpoint.clear();
+    Application app (config);
+    bool served = app.render_worker(sceneInfo, &worker);
+    delete sceneInfo;
+    exit(served ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  // build the BVH for its report and exit, without rendering
+  if (reportOnly) {
+    msg("Scene parsed (" << timer.duration() << " sec)");
+    Application app (config);
+    bool written = app.report_headless(sceneInfo, width, height);
+    delete sceneInfo;
+    exit(written ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  // render without a viewer, no window or GL context is ever created
+  if (headless) {
+    msg("Scene parsed (" << timer.duration() << " sec)");
+    Application app (config);
+    bool saved = app.render_headless(sceneInfo, outputPath, width, height,
+                                     resumePath.empty() ? NULL : &checkpoint);
+    delete sceneInfo;
+    exit(saved ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
 
+#ifndef DISABLE_GL
   // create viewer
   Viewer viewer = Viewer();
 
@@ -144,6 +445,7 @@ int main( int argc, char** argv ) {
   // not sure if this is due to the recent refactor but if anyone got some
   // free time, check the destructor for Application.
   exit(EXIT_SUCCESS); // shamelessly faking it
+#endif
 
   return 0;
 
@@ -7,15 +7,19 @@
 #include <stack>
 #include <random>
 #include <algorithm>
+#include <limits>
 
 #include "CMU462/CMU462.h"
 #include "CMU462/vector3D.h"
 #include "CMU462/matrix3x3.h"
 #include "CMU462/lodepng.h"
 
+#ifndef DISABLE_GL
 #include "GL/glew.h"
+#endif
 
 #include "random_util.h"
+#include "arena.h"
 
 #include "static_scene/sphere.h"
 #include "static_scene/triangle.h"
@@ -31,6 +35,79 @@ using std::max;
 namespace CMU462 {
 
 //#define ENABLE_RAY_LOGGING 1
+
+// adaptive sampling: samples per pass if none are given, and minimum number
+// of samples before a pixel's error estimate is trusted
+static const size_t kAdaptivePassSamples = 4;
+static const size_t kAdaptiveMinSamples = 8;
+
+// samples per pixel in each pass of a time budgeted render, unless -P is set
+static const size_t kBudgetPassSamples = 4;
+
+// tiles that took more than 1/kTileSplitFactor of a worker's share of the
+// last pass are split in four for the next one, down to kMinTileSize pixels
+static const size_t kTileSplitFactor = 16;
+static const int kMinTileSize = 8;
+
+// bounces every path of the classic integrator takes before Russian roulette
+// may end it
+static const size_t kRouletteMinBounces = 3;
+
+/**
+ * Position of the d-th cell along a Hilbert curve through an n x n grid,
+ * n being a power of two.
+ */
+static void hilbert_cell(size_t n, size_t d, size_t* x, size_t* y) {
+  *x = *y = 0;
+  for (size_t s = 1; s < n; s *= 2) {
+    size_t rx = 1 & (d / 2);
+    size_t ry = 1 & (d ^ rx);
+    if (ry == 0) {
+      if (rx == 1) {
+        *x = s - 1 - *x;
+        *y = s - 1 - *y;
+      }
+      std::swap(*x, *y);
+    }
+    *x += s * rx;
+    *y += s * ry;
+    d /= 4;
+  }
+}
+
+// BDPT light tracing splats a thread holds before flushing them
+static const size_t kSplatFlushSize = 4096;
+
+// cached light subpaths every BDPT eye path connects to
+static const size_t kLightCacheConnections = 2;
+
+struct Splat {
+  size_t pixel;
+  Spectrum s;
+};
+
+static std::vector<Splat>& thread_splats() {
+  static thread_local std::vector<Splat> splats;
+  return splats;
+}
+
+// BDPT connections whose shadow rays are still to be traced, in batches
+struct ConnectionBatch {
+  std::vector<Ray> rays;      // shadow ray of each connection
+  std::vector<Spectrum> L;    // weighted contribution if it is unoccluded
+  std::vector<size_t> pixel;  // pixel to splat to, or kNoSplat
+  std::vector<char> hit;
+};
+
+static const size_t kNoSplat = (size_t) -1;
+
+// light cache subpath connections a thread queues before tracing them
+static const size_t kConnectionBatchSize = 1024;
+
+static ConnectionBatch& thread_connections() {
+  static thread_local ConnectionBatch batch;
+  return batch;
+}
 //#define ENABLE_RAY_TEST
 
 //#define ENABLE_PATH_TRACING /* Quote this to enable Bidirectional Path Tracing; Unquote this to use classic path tracing */
@@ -38,17 +115,40 @@ namespace CMU462 {
 PathTracer::PathTracer(size_t ns_aa,
                        size_t max_ray_depth, size_t ns_area_light,
                        size_t ns_diff, size_t ns_glsy, size_t ns_refr,
-                       size_t num_threads, HDRImageBuffer* envmap, size_t ifBDPT) 
+                       size_t num_threads, HDRImageBuffer* envmap, size_t ifBDPT,
+                       const std::string& bvh_report,
+                       double sah_ct, double sah_ci,
+                       ThreadPool* thread_pool, size_t ns_pass,
+                       double adaptive_error, size_t seed,
+                       SampleSequence sequence, size_t ns_light_cache,
+                       double time_budget, size_t tile_size,
+                       const std::string& checkpoint,
+                       double checkpoint_interval)
 {
   state = INIT,
   this->ns_aa = ns_aa;
+  this->ns_pass = ns_pass;
+  this->adaptive_error = adaptive_error;
+  this->seed = seed;
+  this->sequence = sequence;
+  this->ns_light_cache = ns_light_cache;
+  this->time_budget = time_budget;
+  this->checkpoint_file = checkpoint;
+  this->checkpoint_interval = checkpoint_interval;
+  resumedSeconds = 0;
+  lastCheckpoint = 0;
+  checkpointing = false;
   set_sample_pattern();
   this->max_ray_depth = max_ray_depth;
   this->ns_area_light = ns_area_light;
   this->ns_diff = ns_diff;
-  this->ns_glsy = ns_diff;
+  this->ns_glsy = ns_glsy;
   this->ns_refr = ns_refr;
   this->useBDPT = ifBDPT;
+  this->bvh_report = bvh_report;
+  bvhReportWritten = false;
+  this->sah_ct = sah_ct;
+  this->sah_ci = sah_ci;
   cout<<"this->useBDPT"<<this->useBDPT<<endl;
 
   if (envmap) {
@@ -60,15 +160,22 @@ PathTracer::PathTracer(size_t ns_aa,
   bvh = NULL;
   scene = NULL;
   camera = NULL;
+  lightDistribution = NULL;
+  lightTree = NULL;
+  allDeltaLights = false;
+  lightSamples = 0;
 
   gridSampler = new UniformGridSampler2D();
+  sequenceSampler = new_sequence_sampler(sequence);
   hemisphereSampler = new UniformHemisphereSampler3D();
 
   show_rays = true;
 
-  imageTileSize = 32;
-  numWorkerThreads = num_threads;
-  workerThreads.resize(numWorkerThreads);
+  imageTileSize = tile_size > 0 ? tile_size : 32;
+  continueRaytracing = false;
+  ownsThreadPool = (thread_pool == NULL);
+  threadPool = ownsThreadPool ? new ThreadPool(num_threads) : thread_pool;
+  numWorkerThreads = threadPool->size();
 
   tm_gamma = 2.2f;
   tm_level = 1.0f;
@@ -79,8 +186,15 @@ PathTracer::PathTracer(size_t ns_aa,
 
 PathTracer::~PathTracer() {
 
+  continueRaytracing = false;
+  threadPool->wait();
+  if (ownsThreadPool) delete threadPool;
+
   delete bvh;
+  delete lightDistribution;
+  delete lightTree;
   delete gridSampler;
+  delete sequenceSampler;
   delete hemisphereSampler;
 
 }
@@ -103,6 +217,7 @@ void PathTracer::set_scene(Scene *scene) {
 
   this->scene = scene;
   build_accel();
+  build_light_distribution();
 
   if (has_valid_configuration()) {
     state = READY;
@@ -127,7 +242,13 @@ void PathTracer::set_frame_size(size_t width, size_t height) {
     stop();
   }
   sampleBuffer.resize(width, height);
+  splatBuffer.resize(width, height);
+  sampleCountBuffer.assign(width * height, 0);
+  sampleSqBuffer.assign(width * height, 0);
   frameBuffer.resize(width, height);
+#ifdef ENABLE_TRAVERSAL_STATS
+  traversalBuffer.resize(width * height);
+#endif
   if (has_valid_configuration()) {
     state = READY;
   }
@@ -139,6 +260,7 @@ bool PathTracer::has_valid_configuration() {
 }
 
 void PathTracer::update_screen() {
+#ifndef DISABLE_GL
   switch (state) {
     case INIT:
     case READY:
@@ -156,6 +278,7 @@ void PathTracer::update_screen() {
                    GL_UNSIGNED_BYTE, &frameBuffer.data[0]);
       break;
   }
+#endif
 }
 
 void PathTracer::stop() {
@@ -172,10 +295,7 @@ void PathTracer::stop() {
     case RENDERING:
       continueRaytracing = false;
     case DONE:
-      for (int i=0; i<numWorkerThreads; i++) {
-            workerThreads[i]->join();
-            delete workerThreads[i];
-        }
+      threadPool->wait();
       state = READY;
       break;
   }
@@ -185,11 +305,21 @@ void PathTracer::clear() {
   if (state != READY) return;
   delete bvh;
   bvh = NULL;
+  delete lightDistribution;
+  lightDistribution = NULL;
+  delete lightTree;
+  lightTree = NULL;
   scene = NULL;
   camera = NULL;
   selectionHistory.pop();
   sampleBuffer.resize(0, 0);
+  splatBuffer.resize(0, 0);
+  sampleCountBuffer.clear();
+  sampleSqBuffer.clear();
   frameBuffer.resize(0, 0);
+#ifdef ENABLE_TRAVERSAL_STATS
+  traversalBuffer.clear();
+#endif
   state = INIT;
 }
 
@@ -201,6 +331,28 @@ void PathTracer::start_visualizing() {
 }
 
 void PathTracer::start_raytracing() {
+  start_raytracing(0, ns_aa);
+}
+
+void PathTracer::start_raytracing(size_t first, size_t count) {
+  start_render(first, count, NULL);
+}
+
+bool PathTracer::resume_raytracing(const RenderCheckpoint& checkpoint) {
+  if (state != READY) return false;
+
+  if (checkpoint.settings != render_settings()) {
+    fprintf(stderr, "[PathTracer] The checkpoint was rendered with other "
+                    "settings\n");
+    return false;
+  }
+
+  start_render(0, ns_aa, &checkpoint);
+  return true;
+}
+
+void PathTracer::start_render(size_t first, size_t count,
+                              const RenderCheckpoint* checkpoint) {
   if (state != READY) return;
 
   rayLog.clear();
@@ -211,23 +363,104 @@ void PathTracer::start_raytracing() {
   workerDoneCount = 0;
 
   sampleBuffer.clear();
+  splatBuffer.clear();
+  sampleCountBuffer.assign(sampleBuffer.w * sampleBuffer.h, 0);
+  sampleSqBuffer.assign(sampleBuffer.w * sampleBuffer.h, 0);
   frameBuffer.clear();
+#ifdef ENABLE_TRAVERSAL_STATS
+  traversalBuffer.assign(sampleBuffer.w * sampleBuffer.h, TraversalStats());
+#endif
   num_tiles_w = sampleBuffer.w / imageTileSize + 1;
   num_tiles_h = sampleBuffer.h / imageTileSize + 1;
-  tile_samples.resize(num_tiles_w * num_tiles_h);
-  memset(&tile_samples[0], 0, num_tiles_w * num_tiles_h * sizeof(int));
-
-  // populate the tile work queue
-  for (size_t y = 0; y < sampleBuffer.h; y += imageTileSize) {
-      for (size_t x = 0; x < sampleBuffer.w; x += imageTileSize) {
-          workQueue.put_work(WorkItem(x, y, imageTileSize, imageTileSize));
-      }
+  tile_active.assign(num_tiles_w * num_tiles_h, 1);
+  pixel_converged.assign(sampleBuffer.w * sampleBuffer.h, 0);
+
+  // a delta light gives the same sample every time; ns_area_light may have
+  // changed since the scene was set
+  lightSamples = allDeltaLights ? 1 : ns_area_light;
+
+  // adaptive sampling is only supported by the classic integrator, since
+  // BDPT splats make per pixel error estimates meaningless
+  adaptive = adaptive_error > 0 && useBDPT == 0;
+
+  // split the samples into passes, every pass renders all active tiles. A
+  // time budgeted render has no sample count, pass_barrier stops it
+  if (time_budget > 0) {
+    passSamples = (ns_pass != 0) ? ns_pass : kBudgetPassSamples;
+    maxSamples = std::numeric_limits<size_t>::max();
+    numPasses = std::numeric_limits<size_t>::max();
+  } else {
+    passSamples = (ns_pass != 0) ? ns_pass :
+                  adaptive ? kAdaptivePassSamples : count;
+    passSamples = std::min(passSamples, count);
+    maxSamples = count;
+    numPasses = (count + passSamples - 1) / passSamples;
+  }
+  firstSample = first;
+  currentPass = 0;
+  passArrivals = 0;
+  lastPassDone = false;
+
+  // BDPT light cache, refilled by the workers at the start of every pass
+  cachePaths.resize(useBDPT ? ns_light_cache : 0);
+  cacheNext = 0;
+  cacheTraced = 0;
+
+  // populate the per worker tile queues in Hilbert curve order, so that each
+  // worker's contiguous chunk of tiles is a compact region of the image
+  tiles.clear();
+  size_t tiles_x = (sampleBuffer.w + imageTileSize - 1) / imageTileSize;
+  size_t tiles_y = (sampleBuffer.h + imageTileSize - 1) / imageTileSize;
+  size_t n = 1;
+  while (n < tiles_x || n < tiles_y) n *= 2;
+  for (size_t d = 0; d < n * n; d++) {
+    size_t x, y;
+    hilbert_cell(n, d, &x, &y);
+    if (x >= tiles_x || y >= tiles_y) continue;
+    tiles.push_back(WorkItem(x * imageTileSize, y * imageTileSize,
+                             imageTileSize, imageTileSize, tiles.size()));
+  }
+  tile_cost.assign(tiles.size(), 0);
+
+  // continue a checkpointed render after its last complete pass
+  resumedSeconds = 0;
+  if (checkpoint) {
+    std::copy(checkpoint->sums.begin(), checkpoint->sums.end(),
+              sampleBuffer.data.begin());
+    sampleCountBuffer = checkpoint->counts;
+    if (!checkpoint->squares.empty()) sampleSqBuffer = checkpoint->squares;
+    sampleBuffer.toColor(frameBuffer, 0, 0, sampleBuffer.w, sampleBuffer.h,
+                         sampleCountBuffer);
+    currentPass = checkpoint->passes;
+    resumedSeconds = checkpoint->elapsed;
+    if (adaptive) update_convergence();
+  }
+  vector<WorkItem> active;
+  for (const WorkItem& tile : tiles) {
+    size_t idx = tile.tile_x / imageTileSize +
+                 tile.tile_y / imageTileSize * num_tiles_w;
+    if (tile_active[idx]) active.push_back(tile);
   }
+  if (currentPass >= numPasses || active.empty() ||
+      (time_budget > 0 && resumedSeconds >= time_budget)) {
+    fprintf(stdout, "[PathTracer] Nothing left to render\n");
+    state = DONE;
+    return;
+  }
+
+  // checkpoints only make sense for complete renders
+  checkpointing = !checkpoint_file.empty() && first == 0 && count == ns_aa;
+  lastCheckpoint = resumedSeconds;
+
+  workQueue.reset(numWorkerThreads, tiles.size());
+  workQueue.put_work(active);
 
   // launch threads
   fprintf(stdout, "[PathTracer] Rendering... "); fflush(stdout);
-  for (int i=0; i<numWorkerThreads; i++) {
-      workerThreads[i] = new std::thread(&PathTracer::worker_thread, this);
+  raysTraced = 0;
+  renderTimer.start();
+  for (size_t i = 0; i < numWorkerThreads; i++) {
+      threadPool->submit([this, i] { worker_thread(i); });
   }
 }
 
@@ -249,14 +482,89 @@ void PathTracer::build_accel() {
   // build BVH //
   fprintf(stdout, "[PathTracer] Building BVH... "); fflush(stdout);
   timer.start();
-  bvh = new BVHAccel(primitives);
+  bvh = new BVHAccel(primitives, 4, threadPool);
   timer.stop();
   fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
 
+  // BVH quality report //
+  bvhReportWritten = false;
+  if (!bvh_report.empty()) {
+    BVHStats stats = bvh->stats(sah_ct, sah_ci);
+    stats.print();
+    FILE* file = fopen(bvh_report.c_str(), "w");
+    if (file) {
+      fputs(stats.to_json().c_str(), file);
+      fclose(file);
+      bvhReportWritten = true;
+      fprintf(stdout, "[PathTracer] BVH report written to %s\n",
+              bvh_report.c_str());
+    } else {
+      fprintf(stderr, "[PathTracer] Cannot write BVH report to %s\n",
+              bvh_report.c_str());
+    }
+  }
+
   // initial visualization //
   selectionHistory.push(bvh->get_root());
 }
 
+void PathTracer::build_light_distribution() {
+
+  delete lightDistribution;
+  lightDistribution = NULL;
+  delete lightTree;
+  lightTree = NULL;
+  lightPowerPmf.clear();
+  objectLights.clear();
+  allDeltaLights = false;
+  size_t n = scene->lights.size();
+  if (n == 0) return;
+
+  // lights at infinity deliver their power through the scene's cross section
+  double radius = bvh->get_bbox().extent.norm() / 2;
+  double *weights = new double[n];
+  double total = 0;
+  allDeltaLights = true;
+  for (size_t i = 0; i < n; i++) {
+    weights[i] = std::max(0.f, scene->lights[i]->power(radius).illum());
+    total += weights[i];
+    allDeltaLights = allDeltaLights && scene->lights[i]->is_delta_light();
+  }
+
+  // fall back to picking uniformly if no light has a power estimate
+  if (total <= 0) {
+    std::fill(weights, weights + n, 1.0);
+    total = n;
+  }
+  for (size_t i = 0; i < n; i++) {
+    lightPowerPmf[scene->lights[i]] = weights[i] / total;
+    if (scene->lights[i]->get_object())
+      objectLights[scene->lights[i]->get_object()] = scene->lights[i];
+  }
+  // the alias table takes ownership of the weights
+  lightTree = new LightTree(scene->lights, weights);
+  lightDistribution = new AliasTable(weights, n);
+}
+
+SceneLight* PathTracer::sample_light(float* pmf) const {
+  if (!lightDistribution) {
+    *pmf = 0;
+    return NULL;
+  }
+  // lights without power are never picked, not even by roundoff
+  int i = lightDistribution->sample(sample_1d(), pmf);
+  return *pmf > 0 ? scene->lights[i] : NULL;
+}
+
+SceneLight* PathTracer::sample_light(const Vector3D& p, const Vector3D& n,
+                                     float* pmf) const {
+  if (!lightTree) {
+    *pmf = 0;
+    return NULL;
+  }
+  return lightTree->sample(p, n, sample_1d(), pmf);
+}
+
 void PathTracer::log_ray_miss(const Ray& r) {
     rayLog.push_back(LoggedRay(r, -1.0));
 }
@@ -266,6 +574,7 @@ void PathTracer::log_ray_hit(const Ray& r, double hit_t) {
 }
 
 void PathTracer::visualize_accel() const {
+#ifndef DISABLE_GL
 
   glPushAttrib(GL_ENABLE_BIT);
   glDisable(GL_LIGHTING);
@@ -370,6 +679,7 @@ void PathTracer::visualize_accel() const {
 
   glDepthMask(GL_TRUE);
   glPopAttrib();
+#endif
 }
 
 void PathTracer::key_press(int key) {
@@ -414,11 +724,17 @@ void PathTracer::key_press(int key) {
 
 // If ns_aa == 1, sample from the middle of the pixel. Otherwise, decompose your
 // number ns_aa into a sum of perfect squares, and do stratified sampling on
-// each of the respective grids.
+// each of the respective grids. A time budgeted render has no final sample
+// count, so there every pass is stratified on its own, even single samples.
 void PathTracer::set_sample_pattern() {
   sample_grids.clear();
-  if (ns_aa == 1) return;
-  int nSamples = ns_aa;
+  patternSamples = 0;
+  if (time_budget > 0) {
+    patternSamples = (ns_pass != 0) ? ns_pass : kBudgetPassSamples;
+  } else if (ns_aa > 1) {
+    patternSamples = ns_aa;
+  }
+  int nSamples = patternSamples;
   while (nSamples > 0) {
     int root = (int) sqrt(nSamples);
     int rsq = root * root;
@@ -432,55 +748,114 @@ void PathTracer::set_sample_pattern() {
 
 // ======================================= trace_ray =======================================
 /**
- * the old ray-tracer, Unchanged
+ * Power heuristic weight of a sample taken with density f, against another
+ * strategy that samples the same direction with density g (Veach 1997,
+ * section 9.2). Densities include the number of samples taken.
+ **/
+static inline float power_heuristic(double f, double g) {
+  if (f == 0) return 0;
+  double r = g / f;
+  return 1 / (1 + r * r);
+}
+
+/**
+ * the old ray-tracer, as a loop over the bounces of the path
+ * Direct light at every vertex comes from light samples and from the
+ * BSDF sample continuing the path, combined with multiple importance
+ * sampling. Lights that the path cannot hit, like area lights that are not
+ * part of the scene geometry, are found with light samples only.
  **/
 Spectrum PathTracer::trace_ray(const Ray &r, bool includeLe) {
+  return trace_path(r, Spectrum(1, 1, 1), includeLe, Vector3D(), Vector3D(),
+                    0, 0);
+}
 
-  Intersection isect;
+size_t PathTracer::num_branches(const BSDF* bsdf) const {
+  switch (bsdf->type()) {
+    case BSDF_GLOSSY:     return max(ns_glsy, (size_t) 1);
+    case BSDF_REFRACTIVE: return max(ns_refr, (size_t) 1);
+    default:              return max(ns_diff, (size_t) 1);
+  }
+}
 
-  if (!bvh->intersect(r, &isect)) {
+Spectrum PathTracer::trace_path(const Ray &r, Spectrum throughput,
+                                bool includeLe, Vector3D prev_p,
+                                Vector3D prev_n, float bsdfPdf,
+                                size_t bounce) {
 
-    // log ray miss
-    #ifdef ENABLE_RAY_LOGGING
-    log_ray_miss(r);
-    #endif
+  // throughput is the product of the bsdf weights of the path so far, the
+  // radiance found at a vertex reaches the camera scaled by it. prev_p and
+  // bsdfPdf give the vertex the ray leaves from and the density of the
+  // ray's direction, to weight emission the ray finds against the vertex's
+  // light samples
+  Spectrum L_out;
 
-    return (envLight && includeLe) ? envLight->sample_dir(r) : Spectrum();
-  }
+  // the camera ray's path splits at its first surface that samples
+  // directions at random, mirrors before it would only repeat their ray
+  bool unsplit = bounce == 0;
 
-  // log ray hit
-  #ifdef ENABLE_RAY_LOGGING
-  log_ray_hit(r, isect.t);
-  #endif
+  Ray ray = r;
+  for (; ; bounce++) {
 
-  Spectrum L_out = includeLe ? isect.bsdf->get_emission() : Spectrum();
+    Intersection isect;
 
-  const Vector3D& hit_p = r.o + r.d * isect.t;
+    if (!bvh->intersect(ray, &isect)) {
 
-  // make a coordinate system for a hit point
-  // with N aligned with the Z direction.
-  Matrix3x3 o2w;
-  make_coord_space(o2w, isect.n);
-  Matrix3x3 w2o(o2w.T());
+      // log ray miss
+      #ifdef ENABLE_RAY_LOGGING
+      log_ray_miss(ray);
+      #endif
+
+      if (envLight && (includeLe || bsdfPdf > 0)) {
+        float w = includeLe ? 1 : bsdf_weight(prev_p, prev_n, bsdfPdf,
+                                              envLight, ray.d, isect);
+        L_out += throughput * envLight->sample_dir(ray) * w;
+      }
+      break;
+    }
 
-  // w_out points towards the source of the ray (e.g.,
-  // toward the camera if this is a primary ray)
-  const Vector3D& w_out = (w2o * (r.o - hit_p)).unit();
-  if (!isect.bsdf->is_delta()) {
-    Vector3D dir_to_light;
-    float dist_to_light;
-    float pr;
+    // log ray hit
+    #ifdef ENABLE_RAY_LOGGING
+    log_ray_hit(ray, isect.t);
+    #endif
 
-    //
-    // estimate direct lighting integral
-    //
-    for (SceneLight* light : scene->lights) {
+    Spectrum L_hit;
+    if (includeLe) {
+      L_hit = isect.bsdf->get_emission();
+    } else if (bsdfPdf > 0) {
+      // emitters without a light of their own are only seen directly
+      auto it = objectLights.find(isect.primitive->get_object());
+      if (it != objectLights.end())
+        L_hit = isect.bsdf->get_emission() *
+                bsdf_weight(prev_p, prev_n, bsdfPdf, it->second, ray.d, isect);
+    }
+
+    const Vector3D& hit_p = ray.o + ray.d * isect.t;
 
-      // no need to take multiple samples from a point/directional source
-      int num_light_samples = light->is_delta_light() ? 1 : ns_area_light;
+    // make a coordinate system for a hit point
+    // with N aligned with the Z direction.
+    Matrix3x3 o2w;
+    make_coord_space(o2w, isect.n);
+    Matrix3x3 w2o(o2w.T());
 
-      // integrate light over the hemisphere about the normal
-      for (int i = 0; i < num_light_samples; i++) {
+    // w_out points towards the source of the ray (e.g.,
+    // toward the camera if this is a primary ray)
+    const Vector3D& w_out = (w2o * (ray.o - hit_p)).unit();
+    if (!isect.bsdf->is_delta()) {
+      Vector3D dir_to_light;
+      float dist_to_light;
+      float pr;
+
+      //
+      // estimate direct lighting integral, from lights picked in
+      // proportion to their power so that the cost does not grow with
+      // the number of lights
+      //
+      for (size_t i = 0; i < lightSamples; i++) {
+
+        float pl;
+        SceneLight* light = sample_light(hit_p, isect.n, &pl);
+        if (!light) continue;
 
         // returns a vector 'dir_to_light' that is a direction from
         // point hit_p to the point on the light source.  It also returns
@@ -488,6 +863,7 @@ Spectrum PathTracer::trace_ray(const Ray &r, bool includeLe) {
         // (pr is the probability of randomly selecting the random
         // sample point on the light source -- more on this in part 2)
         const Spectrum& light_L = light->sample_L(hit_p, &dir_to_light, &dist_to_light, &pr);
+        if (pr <= 0) continue;
 
         // convert direction into coordinate space of the surface, where
         // the surface normal is [0 0 1]
@@ -504,111 +880,262 @@ Spectrum PathTracer::trace_ray(const Ray &r, bool includeLe) {
           // evaluate surface bsdf
           const Spectrum& f = isect.bsdf->f(w_out, w_in);
 
-          L_out += (cos_theta / (num_light_samples * pr)) * f * light_L;
+          // the BSDF sample finds lights the path can hit as well
+          float w = 1;
+          if (light->get_object() || light == envLight)
+            w = power_heuristic(lightSamples * pl * pr,
+                                isect.bsdf->pdf(w_out, w_in));
+
+          L_hit += (cos_theta * w / (lightSamples * pl * pr)) * f * light_L;
         }
       }
     }
+    L_out += throughput * L_hit;
+
+    //
+    // indirect illumination component, continue the path along a
+    // reflection or refraction ray
+    //
+    if (ray.depth == 0) break;
+
+    // split the first bounce: the camera ray and the direct light at its
+    // hit are shared by several continuations, which each go on as a path
+    // of their own with its own roulette
+    size_t branches = unsplit && !isect.bsdf->is_deterministic() ?
+                      num_branches(isect.bsdf) : 1;
+    if (branches > 1) {
+      bool delta = isect.bsdf->is_delta();
+      Spectrum L_branches;
+      for (size_t i = 0; i < branches; i++) {
+        float pdf;
+        Vector3D w_in;
+        const Spectrum& f = isect.bsdf->sample_f(w_out, &w_in, &pdf);
+        if (pdf <= 0) continue;
+
+        const Vector3D& w_in_world = (o2w * w_in).unit();
+        L_branches += trace_path(
+            Ray(hit_p + EPS_D * w_in_world, w_in_world, INF_D, ray.depth - 1),
+            throughput * f * (fabs(w_in.z) / pdf), delta, hit_p, isect.n,
+            delta ? 0 : pdf, bounce + 1);
+      }
+      L_out += L_branches * (1.f / branches);
+      break;
+    }
+
+    float pdf;
+    Vector3D w_in;
+    const Spectrum& f = isect.bsdf->sample_f(w_out, &w_in, &pdf);
+    if (pdf <= 0) break;
+
+    double cos_theta = fabs(w_in.z);
+    throughput *= f * (cos_theta / pdf);
+
+    // Russian Roulette -
+    //
+    // Past the first few bounces, continue the path with a probability that
+    // follows its throughput, and weight the survivors to keep the estimate
+    // unbiased. Paths that carry little energy end early, bright ones go on.
+    float survive = max(throughput.r, max(throughput.g, throughput.b));
+    if (survive <= 0) break;
+    if (bounce + 1 >= kRouletteMinBounces && survive < 1) {
+      if (sample_1d() >= survive) break;
+      throughput *= 1 / survive;
+    }
+
+    // compute reflected / refracted ray direction
+    const Vector3D& w_in_world = (o2w * w_in).unit();
+    ray = Ray(hit_p + EPS_D * w_in_world, w_in_world, INF_D, ray.depth - 1);
+    includeLe = isect.bsdf->is_delta();
+    prev_p = hit_p;
+    prev_n = isect.n;
+    bsdfPdf = includeLe ? 0 : pdf;
+    unsplit = unsplit && isect.bsdf->is_deterministic();
   }
 
-  //
-  // indirect illumination component, recursively trace/reflection
-  // rays
-  //
-  if (r.depth == 0) return L_out;
+  return L_out;
+}
 
-  float pdf;
-  Vector3D w_in;
-  const Spectrum& f = isect.bsdf->sample_f(w_out, &w_in, &pdf);
+float PathTracer::bsdf_weight(const Vector3D& p, const Vector3D& n,
+                              float bsdfPdf, const SceneLight* light,
+                              const Vector3D& wi,
+                              const Intersection& isect) const {
+  float pl = lightTree ? lightTree->pmf(p, n, light) : 0;
+  return power_heuristic(bsdfPdf,
+                         lightSamples * pl * light->pdf_L(p, wi, isect));
+}
 
-  // Russian Roulette -
-  //
-  // Pick a uniform random value p, and terminate path if p < terminate_prob.
-  // Otherwise, trace the ray in the direction of w_in
+// ======================================= TODO - pathWeight =======================================
 
-  float reflectance = clamp(0.f, 1.f, f.illum());
-  float terminate_prob = 1.f - reflectance;
+// maximum number of surface vertices of a BDPT subpath
+static const size_t kMaxPathVertices = 30;
 
-  if (coin_flip(terminate_prob)) return L_out;
+/**
+ * Room for a subpath from the calling thread's arena.
+ **/
+static SubPath new_subpath() {
+  SubPath path;
+  path.v = MemoryArena::thread_arena().alloc<Vertice>(kMaxPathVertices + 1);
+  path.size = 0;
+  return path;
+}
 
-  // compute reflected / refracted ray direction
-  const Vector3D& w_in_world = (o2w * w_in).unit();
-  Ray rec(hit_p + EPS_D * w_in_world, w_in_world, INF_D, r.depth - 1);
+static inline float remap0(float f) {
+  return f != 0 ? f : 1;
+}
 
-  // compute Monte Carlo estimator by tracing ray (result weighted
-  // by (1-terminate_prob) to account for Russian roulette)
-  double cos_theta = fabs(w_in.z);
-  double denom = pdf * (1 - terminate_prob);
-  double scale = denom ? cos_theta / denom : 0;
+/**
+ * Convert the solid angle density of sampling vertex to from vertex from
+ * into an area density at to.
+ **/
+static float to_area(float pdf, const Vertice &from, const Vertice &to) {
+  Vector3D w = to.p - from.p;
+  double d2 = w.norm2();
+  if (d2 == 0) return 0;
+  return pdf * fabs(dot(to.n, w)) / (d2 * sqrt(d2));
+}
 
-  return L_out + scale * f * trace_ray(rec, isect.bsdf->is_delta());
+/**
+ * Direction from a surface vertex toward p, in the vertex's local frame.
+ **/
+static Vector3D local_dir(const Vertice &v, const Vector3D &p) {
+  Matrix3x3 o2w;
+  make_coord_space(o2w, v.n);
+  Matrix3x3 w2o(o2w.T());
+  return (w2o * (p - v.p)).unit();
 }
 
-// ======================================= TODO - pathWeight =======================================
 /**
- * get weight for a path
+ * Area density at next of sampling it from vertex v, which was reached
+ * from prev. Endpoints sample with the camera or light emission densities.
  **/
-float pathWeight(int i, int j){
-  return 1.f / float(i + j + 1);
+float PathTracer::vertex_pdf(const Vertice *prev, const Vertice &v,
+                             const Vertice &next) const {
+  Vector3D w = (next.p - v.p).unit();
+  float pdf;
+  if (v.light)
+    pdf = v.light->pdf_dir(v.n, w);
+  else if (!v.bsdf)
+    pdf = camera->pdf_dir(w);
+  else
+    pdf = v.bsdf->pdf(local_dir(v, prev->p), local_dir(v, next.p));
+  return to_area(pdf, v, next);
 }
 
-// ======================================= TODO - trace_ray_bpt =======================================
 /**
- * the new BDPT ray-tracer
+ * Power heuristic weight of the strategy connecting the first t eye
+ * vertices with the first s light vertices, against all other strategies
+ * that could have sampled the same path (Veach 1997, section 10.2). The
+ * ratios of the other strategies' densities to this one's are built up
+ * vertex by vertex from the recorded forward and reverse densities, with
+ * the reverse densities at the connection recomputed for this path.
+ * Lights cannot be hit by eye paths, so there is no strategy without
+ * light vertices for paths that start on a light.
  **/
-Spectrum PathTracer::trace_ray_bpt(const Ray &r, size_t x, size_t y) {
-  Spectrum Le;
-  for (SceneLight* light : scene->lights) {
-
-  /* Case I: Direct ray from light to eye */
-    // Eye path length = 0; Light path length = 0
-  Intersection isect;
-  if (bvh->intersect(r, &isect))
-  {
-      Spectrum L_out = isect.bsdf->get_emission(); // Le
-      sampleBuffer.update_pixel_add(L_out, x, y);
+float PathTracer::mis_weight(const Vertice *eyePath, int t,
+                             const Vertice *lightPath, int s) const {
+  const Vertice &pt = eyePath[t-1];
+  const Vertice &qs = lightPath[s-1];
+
+  // connect_to_light picks the light by its importance to the vertex next
+  // to the light, light subpaths pick it by power, so the strategy with
+  // one light vertex starts the path with a different density
+  double c2 = lightPath[0].pickRatio * lightPath[0].pickRatio;
+
+  // reverse densities of the connection vertices and their predecessors
+  float ptRev = vertex_pdf(s > 1 ? &lightPath[s-2] : NULL, qs, pt);
+  float ptMinusRev = t > 2 ? vertex_pdf(&qs, pt, eyePath[t-2]) : 0;
+  float qsRev = vertex_pdf(t > 1 ? &eyePath[t-2] : NULL, pt, qs);
+  float qsMinusRev = s > 2 ? vertex_pdf(&pt, qs, lightPath[s-2]) : 0;
+
+  double sumRi = 0;
+
+  // strategies with fewer eye vertices
+  double ri = 1;
+  for (int i = t - 1; i > 0; --i) {
+    float pdfRev = i == t - 1 ? ptRev : i == t - 2 ? ptMinusRev
+                                                   : eyePath[i].pdfRev;
+    double r = remap0(pdfRev) / remap0(eyePath[i].pdfFwd);
+    ri *= r * r;
+    bool delta = i == t - 1 ? false : eyePath[i].delta;
+    if (!delta && !eyePath[i-1].delta) sumRi += s == 1 ? ri / c2 : ri;
   }
 
-  Ray lightRay(Vector3D(0, 0, 0), Vector3D(0, 0, 0));
-  float lightPdf;
-  Le = light->sampleLight(&lightRay, &lightPdf);
-  if (lightPdf != 0.0f)
-  {
-    Le = 1.f / lightPdf * Le;
-    render_paths(x, y, r, lightRay, Le);
+  // strategies with fewer light vertices
+  ri = 1;
+  for (int i = s - 1; i > 0; --i) {
+    float pdfRev = i == s - 1 ? qsRev : i == s - 2 ? qsMinusRev
+                                                   : lightPath[i].pdfRev;
+    double r = remap0(pdfRev) / remap0(lightPath[i].pdfFwd);
+    ri *= r * r;
+    bool delta = i == s - 1 ? false : lightPath[i].delta;
+    if (!delta && !lightPath[i-1].delta) sumRi += i == 1 ? ri * c2 : ri;
   }
+
+  return 1 / (1 + sumRi);
+}
+
+// ======================================= TODO - trace_ray_bpt =======================================
+/**
+ * the new BDPT ray-tracer
+ * Traces an eye path from the camera ray and combines it with light
+ * samples (next event estimation) and with a light path, which is traced
+ * here or taken from the light cache. The connections are queued for
+ * trace_connections, which traces their shadow rays in batches.
+ **/
+Spectrum PathTracer::trace_ray_bpt(const Ray &r) {
+  SubPath eyePath = new_subpath();
+  trace_eye_path(r, eyePath);
+
+  /* Case II: next event estimation, one light vertex */
+  for (int t = 2; t <= (int) eyePath.size; t++)
+    connect_to_light(eyePath, t);
+
+  if (ns_light_cache) {
+    render_cached_paths(eyePath);
+  } else {
+    SubPath lightPath = new_subpath();
+    trace_light_path(lightPath);
+    if (lightPath.size) {
+      render_paths(eyePath, lightPath.v, lightPath.size, 1);
+      splat_light_path(lightPath.v, lightPath.size, 1);
+    }
   }
-  return Le;
+
+  /* Case I: emission seen straight from the camera. Like trace_ray, emitters
+     that are not lights do not illuminate the scene */
+  return eyePath.size > 1 ? eyePath.v[1].bsdf->get_emission() : Spectrum();
 }
 
 // ======================================= TODO - randomWalk =======================================
 /**
- * the random walk: generate Eye path and Light path with sample_f() (sample the BSDF);
- * \param cumulative The total attenuation factor
- * \param vertices Store the path
- * \param eye Eye path (true); Light path (false)
- * \param emission Light spectrum
+ * the random walk: extend a subpath from its last vertex with sample_f() (sample the BSDF);
+ * Every vertex records the throughput of the subpath reaching it, the area
+ * density of sampling it from its predecessor, and the area density of
+ * sampling the predecessor from it.
+ * \param ray Ray leaving the last vertex
+ * \param path Store the path, holding at least its endpoint
+ * \param beta Throughput of the subpath along ray
+ * \param pdfDir Solid angle density of the direction of ray
  **/
-void PathTracer::randomWalk(Ray ray, std::vector<Vertice> &vertices, bool eye, Spectrum emission) {
-  ray.depth = 0;
-  Intersection its;
-  Spectrum cumulative(1.0f, 1.0f, 1.0f); // Cumulative attenuation factor
-  // if (!eye) cumulative *= emission;
-
-  while(true)
+void PathTracer::randomWalk(Ray ray, SubPath &path, Spectrum beta, float pdfDir) {
+  while (path.size <= kMaxPathVertices) // Repeat extending the path until a maximun length
   {
-
+    Intersection its;
     if (!bvh->intersect(Ray(ray.o, ray.d), &its)){
       break;
     }
 
-    BSDF *bsdf = its.bsdf;
-    float bsdfPdf;
-
     Vertice v;
-    const Vector3D& hit_p = ray.o + ray.d * its.t;
-    v.p = hit_p;
+    v.p = ray.o + ray.d * its.t;
     v.n = its.n;
-    v.bsdf = bsdf;
+    v.bsdf = its.bsdf;
+    v.light = NULL;
+    v.cumulative = beta;
+    v.delta = its.bsdf->is_delta();
+    v.pdfRev = 0;
+
+    Vertice &prev = path.v[path.size - 1];
+    v.pdfFwd = to_area(pdfDir, prev, v);
 
     // make a coordinate system for a hit point
     // with N aligned with the Z direction.
@@ -616,211 +1143,391 @@ void PathTracer::randomWalk(Ray ray, std::vector<Vertice> &vertices, bool eye, S
     make_coord_space(o2w, its.n);
     Matrix3x3 w2o(o2w.T());
 
-    if (eye)
-    {
-      // cout<<"EyeRay! ray.depth: "<<ray.depth<<endl;
-      v.wo = (w2o * (-ray.d)).unit();
-      cumulative = cumulative * its.bsdf->sample_f(v.wo, &v.wi, &bsdfPdf) + its.bsdf->get_emission();
-      ray.d = (o2w * v.wi).unit();
-      cumulative *= std::abs(v.wi.z) / bsdfPdf;
-    }
-    else
-    {
-      const Ray &r = ray;
-      // log_ray_hit(r, its.t);
-      v.wi = (w2o * (-ray.d)).unit();
-      cumulative = cumulative * its.bsdf->sample_f(v.wi, &v.wo, &bsdfPdf);
-      ray.d = (o2w * v.wo).unit();
-      cumulative *= std::abs(v.wo.z) / bsdfPdf;
+    v.wo = (w2o * (-ray.d)).unit();
+    Vector3D wi;
+    float bsdfPdf;
+    Spectrum f = v.bsdf->sample_f(v.wo, &wi, &bsdfPdf);
+
+    // densities of delta scattering are left out of the MIS weights
+    float pdfRev = 0;
+    pdfDir = 0;
+    if (!v.delta) {
+      pdfDir = bsdfPdf;
+      pdfRev = v.bsdf->pdf(wi, v.wo);
     }
-    ray.depth ++;
+    prev.pdfRev = to_area(pdfRev, v, prev);
+    path.v[path.size++] = v;
 
-    v.cumulative = cumulative;
-    if (ray.depth > 30 || cumulative.illum() < 1E-7) // Repeat extending the path until a maximun length
+    if (bsdfPdf == 0)
+      break;
+    beta *= f * (std::abs(wi.z) / bsdfPdf);
+    if (beta.illum() < 1E-7)
       break;
 
-    vertices.push_back(v);
-    ray.o = hit_p + ray.d * EPS_D; // Origion of the next light
+    ray.d = (o2w * wi).unit();
+    ray.o = v.p + ray.d * EPS_D; // Origion of the next light
   }
 }
 
-// ======================================= TODO - evalPaths =======================================
 /**
- * Get total attenuation along a path in case IV (where Eye path length >= 1 && Light path length >= 1)\
+ * Start an eye path at the camera and extend it from the camera ray.
  **/
-Spectrum PathTracer::evalPath(
-  const std::vector<Vertice> &eyePath,
-  const std::vector<Vertice> &lightPath,
-  int nEye, int nLight) const {
-
-    const Vertice &ev = eyePath[nEye - 1];
-    const Vertice &lv = lightPath[nLight - 1];
-
-    Spectrum L(1.0f, 1.0f, 1.0f);
+void PathTracer::trace_eye_path(const Ray &r, SubPath &path) {
+  Vertice c;
+  c.p = r.o;
+  c.n = r.d;
+  c.bsdf = NULL;
+  c.light = NULL;
+  c.cumulative = Spectrum(1, 1, 1);
+  c.delta = false;
+  c.pdfFwd = 1;
+  c.pdfRev = 0;
+  path.v[path.size++] = c;
+
+  randomWalk(r, path, c.cumulative, camera->pdf_dir(r.d));
+}
 
-    // Accumulate attenuation from last reflection
-    if (nEye > 1)
-      L *= eyePath[nEye - 2].cumulative;
-    if (nLight > 1)
-      L *= lightPath[nLight - 2].cumulative;
+/**
+ * Start a light path on a light picked in proportion to its power and
+ * extend it from a ray leaving the light. Leaves the path empty if the
+ * light cannot emit.
+ **/
+void PathTracer::trace_light_path(SubPath &path) {
+  float pl;
+  SceneLight* light = sample_light(&pl);
+  if (!light || pl <= 0) return;
+
+  Vertice v;
+  float pdfPos, pdfDir;
+  Spectrum Le = light->sample_point(&v.p, &v.n, &pdfPos);
+  if (pdfPos == 0) return;
+  Vector3D d = light->sample_dir(v.n, &pdfDir);
+  if (pdfDir == 0) return;
+
+  v.bsdf = NULL;
+  v.light = light;
+  v.cumulative = Le * (1 / (pl * pdfPos));
+  v.delta = false;
+  v.pdfFwd = pdfPos * pl;
+  v.pdfRev = 0;
+  v.pickRatio = 1;
+  path.v[path.size++] = v;
+
+  Spectrum beta = v.cumulative * (std::abs(dot(v.n, d)) / pdfDir);
+  randomWalk(Ray(v.p + EPS_F * v.n, d), path, beta, pdfDir);
+
+  // how likely connect_to_light would have picked the light for the first
+  // bounce, for the MIS weights of all connections of this subpath
+  if (path.size > 1) {
+    const Vertice &next = path.v[1];
+    path.v[0].pickRatio = lightTree->pmf(next.p, next.n, light) / pl;
+  }
+}
 
-    // Get the Geometric Term
-    Vector3D etl = lv.p - ev.p;
-    float lengthSquared = etl.norm2();
-    etl /= std::sqrt(lengthSquared);
+// ======================================= TODO - evalPaths =======================================
+/**
+ * Get the unoccluded contribution of the path made of the first t eye
+ * vertices and the first s light vertices (t >= 2, s >= 1), without MIS
+ * weight. Zero if either connection vertex cannot scatter toward the other.
+ **/
+Spectrum PathTracer::evalPath(
+  const Vertice *eyePath, int t,
+  const Vertice *lightPath, int s) const {
 
-    float geoTerm = fabs(dot(etl, ev.n)) * fabs(dot(-etl, lv.n)) / lengthSquared;
+    const Vertice &ev = eyePath[t - 1];
+    const Vertice &lv = lightPath[s - 1];
 
-    if (lengthSquared < 0.05)
+    if (ev.delta || lv.delta)
       return Spectrum();
 
-    // make a coordinate system for a hit point
-    // with N aligned with the Z direction.
-    Matrix3x3 o2w1;
-    make_coord_space(o2w1, ev.n);
-    Matrix3x3 w2o1(o2w1.T());
-
     // convert direction into coordinate space of the surface, where the surface normal is [0 0 1]
-    L *= ev.bsdf->f(ev.wi, (w2o1 * etl).unit());
-
-    Matrix3x3 o2w2;
-    make_coord_space(o2w2, lv.n);
-    Matrix3x3 w2o2(o2w2.T());
+    Vector3D wi = local_dir(ev, lv.p);
+    if (wi.z <= 0)
+      return Spectrum();
 
-    L *= lv.bsdf->f((w2o2 * (-etl)).unit(), lv.wo);
+    Spectrum L = ev.cumulative * ev.bsdf->f(ev.wo, wi) * lv.cumulative;
+
+    double cosLight;
+    if (lv.light) {
+      // lights emit on the side of their normal only
+      cosLight = dot(lv.n, (ev.p - lv.p).unit());
+      if (cosLight <= 0)
+        return Spectrum();
+    } else {
+      Vector3D wo = local_dir(lv, ev.p);
+      if (wo.z <= 0)
+        return Spectrum();
+      L *= lv.bsdf->f(lv.wo, wo);
+      cosLight = wo.z;
+    }
 
-    L *= geoTerm;
+    // Get the Geometric Term
+    float lengthSquared = (lv.p - ev.p).norm2();
+    L *= wi.z * cosLight / lengthSquared;
 
     return L;
 }
 
-
-// ======================================= TODO - render_paths =======================================
 /**
- * Render paths across light and eye paths in Case II, III, and IV
+ * Queue the connection of eye vertex t and light vertex s, given its
+ * unoccluded contribution. Connections that cannot contribute are dropped
+ * here, before they cost a shadow ray.
  **/
-void PathTracer::render_paths(size_t x, size_t y, const Ray &eyeRay, const Ray &lightRay, const Spectrum &Le){
-  Vector3D wi;
-  Vector3D onLight;
-
-  std::vector<Vertice> m_eyePath;
-  std::vector<Vertice> m_lightPath;
-
-  randomWalk(eyeRay, m_eyePath, true, Le);
-  randomWalk(lightRay, m_lightPath, false, Le);
-
-  /* Case II and IV */
-  for (int i=1; i<m_eyePath.size()+1; i++){
-    const Vertice &ev = m_eyePath[i-1];
-
-    for (SceneLight* light : scene->lights) {
-
-      /* Case II: Classic Ray Tracing */
-       // Eye path length > 0; Light path length = 0
-
-      // shoot a ray to the light based on hit_p, return dir_to_light, &dist_to_light, &pr
-      Spectrum localLe = light->sampleLightFromP(ev.p, onLight, wi);
-
-      // make a coordinate system for a hit point
-      // with N aligned with the Z direction.
-      Matrix3x3 o2w;
-      make_coord_space(o2w, ev.n);
-      Matrix3x3 w2o(o2w.T());
-
-      // convert direction into coordinate space of the surface, where
-        // the surface normal is [0 0 1]
-      const Vector3D& localWi = (w2o * wi).unit();
-      if (localWi.z < 0) continue;
-
-      // do shadow ray test
-      if (!bvh->intersect(Ray(ev.p + EPS_D * ev.n, (onLight - ev.p).unit(),
-                              (onLight - ev.p).norm() - EPS_D))) {
-        if (i > 1)
-          localLe *= m_eyePath[i-2].cumulative;
+void PathTracer::connect(const Vertice *eyePath, int t,
+                         const Vertice *lightPath, int s,
+                         const Spectrum &L) const {
+  if (L.illum() == 0)
+    return;
 
-        // note that computing dot(n,w_in) is simple
-        // in surface coordinates since the normal is (0,0,1)
-        double cos_theta = localWi.z;
+  const Vertice &ev = eyePath[t - 1];
+  const Vertice &lv = lightPath[s - 1];
 
-        Spectrum s = localLe * ev.bsdf->f(ev.wo, ev.wi) * cos_theta * pathWeight(i, 0);
-        s = (1.0 / double(ns_aa)) * s;
+  // shadow ray, stopping short of surfaces at both ends
+  Vector3D o = ev.p + EPS_F * ev.n;
+  queue_connection(Ray(o, (lv.p - o).unit(), (lv.p - o).norm() - EPS_F),
+                   L * mis_weight(eyePath, t, lightPath, s), kNoSplat);
+}
 
-        sampleBuffer.update_pixel_add(s, x, y);
-      }
+void PathTracer::queue_connection(const Ray &r, const Spectrum &L,
+                                  size_t pixel) const {
+  ConnectionBatch &batch = thread_connections();
+  batch.rays.push_back(r);
+  batch.L.push_back(L);
+  batch.pixel.push_back(pixel);
+}
 
-      /* Case IV: Bi-Path */
-       // Eye path length > 0; Light path length > 0
+Spectrum PathTracer::trace_connections() {
+  ConnectionBatch &batch = thread_connections();
+  bvh->intersect(batch.rays, &batch.hit);
 
-      for (int j=1; j<m_lightPath.size()+1; j++){
-        const Vertice &lv = m_lightPath[j-1];
-        // do shadow ray test
-        if (!bvh->intersect(Ray(ev.p + EPS_D * ev.n, (lv.p - ev.p).unit(),
-                                (lv.p - ev.p).norm() - EPS_D))) {
+  Spectrum L;
+  for (size_t i = 0; i < batch.rays.size(); i++) {
+    if (batch.hit[i]) continue;
+    if (batch.pixel[i] == kNoSplat)
+      L += batch.L[i];
+    else
+      add_splat(batch.L[i], batch.pixel[i] % sampleBuffer.w,
+                batch.pixel[i] / sampleBuffer.w);
+  }
 
-          Spectrum s = Le * evalPath(m_eyePath, m_lightPath, i, j) * pathWeight(i, j);
-          s = (1.0 / double(ns_aa)) * s;
+  batch.rays.clear();
+  batch.L.clear();
+  batch.pixel.clear();
+  return L;
+}
 
-          sampleBuffer.update_pixel_add(s, x, y);
-        }
-      }
 
+// ======================================= TODO - render_paths =======================================
+/**
+ * Connect every eye vertex to every vertex of a light path (Case IV, both
+ * subpaths have surface vertices).
+ **/
+void PathTracer::render_paths(const SubPath &eyePath,
+                              const Vertice *lightPath, size_t lightLength,
+                              float scale) {
+  for (int t = 2; t <= (int) eyePath.size; t++) {
+    for (int s = 2; s <= (int) lightLength; s++) {
+      connect(eyePath.v, t, lightPath, s,
+              evalPath(eyePath.v, t, lightPath, s) * scale);
     }
   }
+}
 
-  /* Case III: LightPath directly to eye */
-   // Eye path length = 0; Light path length > 0
-
-  for (int j = 1; j < m_lightPath.size()+1; j++){
-    const Vertice &lv = m_lightPath[j-1];
-
-    if (!bvh->intersect(Ray(lv.p + EPS_D * lv.n, (camera->pos - lv.p).unit(),
-                                (camera->pos - lv.p).norm() - EPS_D))) {
-      Spectrum localLe = Le;
-      Vector3D wo = camera->pos - lv.p;
-      float lengthSquared = wo.norm2();
-      wo /= std::sqrt(lengthSquared);
-
-      if (lengthSquared < 0.05)
-        continue;
-
-      Matrix3x3 o2w;
-      make_coord_space(o2w, lv.n);
-      Matrix3x3 w2o(o2w.T());
-      Vector3D localWo = (w2o * wo).unit();
+/**
+ * Like render_paths, but connects the eye path to a few subpaths of the
+ * light cache instead of tracing its own light path.
+ **/
+void PathTracer::render_cached_paths(const SubPath &eyePath) {
+  size_t paths = cacheOffsets.size() - 1;
+  for (size_t m = 0; m < kLightCacheConnections; m++) {
+    size_t k = std::min((size_t) (sample_1d() * paths), paths - 1);
+    size_t length = cacheOffsets[k + 1] - cacheOffsets[k];
+    if (length)
+      render_paths(eyePath, &cacheVertices[cacheOffsets[k]], length,
+                   1.f / kLightCacheConnections);
+  }
+}
 
-      if (j > 1)
-        localLe *= m_lightPath[j-2].cumulative;
+/**
+ * Case II: Classic Ray Tracing
+ * Connect eye vertex t to a point sampled on a light picked from the light
+ * tree for that vertex.
+ **/
+void PathTracer::connect_to_light(const SubPath &eyePath, int t) {
+  const Vertice &ev = eyePath.v[t-1];
+  if (ev.delta) return;
+  float pl;
+  SceneLight* light = sample_light(ev.p, ev.n, &pl);
+  if (!light) return;
+
+  Vertice v;
+  float pdfPos;
+  Spectrum Le = light->sample_point(&v.p, &v.n, &pdfPos);
+  if (pdfPos == 0) return;
+
+  v.bsdf = NULL;
+  v.light = light;
+  v.cumulative = Le * (1 / (pl * pdfPos));
+  v.delta = false;
+  v.pdfFwd = pdfPos * pl;
+  v.pdfRev = 0;
+  auto it = lightPowerPmf.find(light);
+  if (it == lightPowerPmf.end() || it->second <= 0) return;
+  v.pickRatio = pl / it->second;
+
+  connect(eyePath.v, t, &v, 1, evalPath(eyePath.v, t, &v, 1));
+}
 
-      localLe *= lv.bsdf->f(lv.wi, localWo) * std::abs(localWo.z) * (1.f / lengthSquared);
+/**
+ * Case III: LightPath directly to eye
+ * Connect every surface vertex of a light path to the camera, splatting
+ * the contributions to the pixels they land on.
+ **/
+void PathTracer::splat_light_path(const Vertice *lightPath, size_t lightLength,
+                                  float scale) {
+  for (int s = 2; s <= (int) lightLength; s++){
+    const Vertice &lv = lightPath[s-1];
+    if (lv.delta)
+      continue;
+
+    Vector2D screenPos;
+    double importance = camera->importance(lv.p, &screenPos);
+    if (importance == 0)
+      continue;
+
+    Vector3D wo = local_dir(lv, camera->pos);
+    if (wo.z <= 0)
+      continue;
+
+    Spectrum L = lv.cumulative * lv.bsdf->f(lv.wo, wo) * (wo.z * importance);
+    if (L.illum() == 0)
+      continue;
+
+    // Where in the film does this ray shoot to?
+    size_t x = (screenPos.x + 0.5) * sampleBuffer.w;
+    size_t y = (screenPos.y + 0.5) * sampleBuffer.h;
+    if (x >= sampleBuffer.w || y >= sampleBuffer.h)
+      continue;
+
+    Vertice c;
+    c.p = camera->pos;
+    c.n = (lv.p - camera->pos).unit();
+    c.bsdf = NULL;
+    c.light = NULL;
+    c.delta = false;
+    c.pdfFwd = 1;
+    c.pdfRev = 0;
+    L *= mis_weight(&c, 1, lightPath, s) * scale;
+
+    Vector3D o = lv.p + EPS_F * lv.n;
+    queue_connection(Ray(o, (camera->pos - o).unit(), (camera->pos - o).norm()),
+                     L, x + y * sampleBuffer.w);
+  }
+}
 
-      Spectrum s = localLe * pathWeight(0, j);
-      s = (1.0 / double(ns_aa)) * s;
+void PathTracer::trace_light_cache(size_t first, size_t count) {
+  size_t total = ns_light_cache;
+
+  // every cached subpath stands in for the light subpaths of this many eye
+  // paths when splatting straight to the camera
+  float scale = (float) sampleBuffer.w * sampleBuffer.h * count /
+                ns_light_cache;
+
+  size_t traced = 0;
+  for (size_t k = cacheNext++; k < total; k = cacheNext++) {
+    start_sample(sequenceSampler, 0, 0, first * ns_light_cache + k,
+                 mix_bits(seed) + 1);
+
+    SubPath path = new_subpath();
+    trace_light_path(path);
+    if (path.size)
+      splat_light_path(path.v, path.size, scale);
+    if (thread_connections().rays.size() >= kConnectionBatchSize)
+      trace_connections();
+    cachePaths[k].assign(path.v, path.v + path.size);
+    MemoryArena::thread_arena().reset();
+    traced++;
+  }
+  trace_connections();
+
+  // the worker finishing the last subpath packs them into one buffer
+  std::unique_lock<std::mutex> guard(passLock);
+  size_t before = cacheTraced;
+  cacheTraced += traced;
+  if (before < total && cacheTraced == total) {
+    cacheVertices.clear();
+    cacheOffsets.assign(1, 0);
+    for (const std::vector<Vertice>& path : cachePaths) {
+      cacheVertices.insert(cacheVertices.end(), path.begin(), path.end());
+      cacheOffsets.push_back(cacheVertices.size());
+    }
+    passCond.notify_all();
+  } else {
+    passCond.wait(guard, [this, total] { return cacheTraced == total; });
+  }
+}
 
-      // Where in the film does this ray shoot to?
-      Vector2D pixelPos = camera->get_screen_pos(lv.p);
-      size_t screenW = sampleBuffer.w;
-      size_t screenH = sampleBuffer.h;
-      double x = (pixelPos.x + 0.5) * screenW;
-      double y = (pixelPos.y + 0.5) * screenH;
+void PathTracer::add_splat(const Spectrum& s, size_t x, size_t y) {
+  std::vector<Splat>& splats = thread_splats();
+  Splat splat = { x + y * splatBuffer.w, s };
+  splats.push_back(splat);
+  if (splats.size() >= kSplatFlushSize) flush_splats();
+}
 
-      if (x > 0 && x < screenW && y >0 && y < screenH){
-        sampleBuffer.update_pixel_add(s, x, y);
-      }
+void PathTracer::flush_splats() {
+  std::vector<Splat>& splats = thread_splats();
+  if (splats.empty()) return;
+  {
+    std::lock_guard<std::mutex> guard(splatLock);
+    for (const Splat& splat : splats) {
+      splatBuffer.update_pixel_add(splat.s, splat.pixel % splatBuffer.w,
+                                   splat.pixel / splatBuffer.w);
     }
   }
+  splats.clear();
+}
+
+void PathTracer::merge_splats() {
+  size_t w = sampleBuffer.w;
+  size_t h = sampleBuffer.h;
+  for (size_t i = 0; i < w * h; ++i) {
+    sampleBuffer.data[i] += splatBuffer.data[i];
+  }
+  splatBuffer.clear();
+  sampleBuffer.toColor(frameBuffer, 0, 0, w, h, sampleCountBuffer);
 }
 
 // ======================================= TODO - raytrace_pixel =======================================
 /**
  * Modified to adapt for BDPT option. Generate eye and light path from an eye (camera) ray, and then render
  **/
-Spectrum PathTracer::raytrace_pixel(size_t x, size_t y) {
+Spectrum PathTracer::raytrace_pixel(size_t x, size_t y,
+                                    size_t first, size_t count) {
 
 
   size_t screenW = sampleBuffer.w;
   size_t screenH = sampleBuffer.h;
 
+  Spectrum s = Spectrum();
+
+  // sample sequences place every sample, even a single one
+  if (sequenceSampler) {
+    for (size_t i = first; i < first + count; i++) {
+      start_sample(sequenceSampler, x, y, i, seed);
+      const Vector2D &p = sequenceSampler->get_sample();
+      Ray r = camera->generate_ray((x + p.x) / screenW, (y + p.y) / screenH);
+      r.depth = max_ray_depth;
+
+      if (this->useBDPT == 0)
+        s += trace_ray(r, true);
+      else
+        s += trace_ray_bpt(r);
+    }
+    return s;
+  }
+
   if (sample_grids.empty()) {
+    start_sample(NULL, x, y, 0, seed);
     Ray r = camera->generate_ray((x + 0.5) / screenW,
                                  (y + 0.5) / screenH);
     r.depth = max_ray_depth;
@@ -830,43 +1537,53 @@ Spectrum PathTracer::raytrace_pixel(size_t x, size_t y) {
       return trace_ray(r); // use traditional ray-traycing
     // #else
     else
-    {
-      Spectrum trace_ray_bpt_spt = trace_ray_bpt(r, x, y); // use bdrt
-      return trace_ray_bpt_spt;
-    }
+      return trace_ray_bpt(r); // use bdrt
     // #endif
   }
 
-  Spectrum s = Spectrum();
-
-  for (int gridSize : sample_grids) {
-    double cellSize = 1.0 / gridSize;
-    for (int subY = 0; subY < gridSize; subY++) {
-      for (int subX = 0; subX < gridSize; subX++) {
-        const Vector2D &p = gridSampler->get_sample();
-        double dx = (subX + p.x) * cellSize;
-        double dy = (subY + p.y) * cellSize;
-        Ray r = camera->generate_ray((x + dx) / screenW, (y + dy) / screenH);
-        r.depth = max_ray_depth;
-        
-        // #ifdef ENABLE_PATH_TRACING
-        if (this->useBDPT == 0)
-          s += trace_ray(r, true); // use traditional ray-traycing
-        // #else
-        else
-          Spectrum trace_ray_bpt_spt = trace_ray_bpt(r, x, y); // use bdrt
-        // #endif
-      }
+  // walk the stratified grids, starting with the one holding sample first.
+  // Past patternSamples the grids repeat (time budgeted renders only)
+  size_t grid = 0;
+  size_t start = first - first % patternSamples;
+  size_t offset = start;
+  for (size_t i = first; i < first + count; i++) {
+    if (i - start == patternSamples) {
+      grid = 0;
+      start = offset = i;
+    }
+    while (i - offset >= (size_t) (sample_grids[grid] * sample_grids[grid])) {
+      offset += sample_grids[grid] * sample_grids[grid];
+      grid++;
     }
+    int gridSize = sample_grids[grid];
+    double cellSize = 1.0 / gridSize;
+    int subX = (i - offset) % gridSize;
+    int subY = (i - offset) / gridSize;
+
+    start_sample(NULL, x, y, i, seed);
+    const Vector2D &p = gridSampler->get_sample();
+    double dx = (subX + p.x) * cellSize;
+    double dy = (subY + p.y) * cellSize;
+    Ray r = camera->generate_ray((x + dx) / screenW, (y + dy) / screenH);
+    r.depth = max_ray_depth;
+
+    // #ifdef ENABLE_PATH_TRACING
+    if (this->useBDPT == 0)
+      s += trace_ray(r, true); // use traditional ray-traycing
+    // #else
+    else
+      s += trace_ray_bpt(r); // use bdrt
+    // #endif
   }
 
-  return s * (1.0 / ns_aa);
+  return s;
 }
 
 // ======================================= TODO - raytrace_pixel =======================================
 
 void PathTracer::raytrace_tile(int tile_x, int tile_y,
-                               int tile_w, int tile_h) 
+                               int tile_w, int tile_h,
+                               size_t first, size_t count)
 {
 
   size_t w = sampleBuffer.w;
@@ -878,42 +1595,73 @@ void PathTracer::raytrace_tile(int tile_x, int tile_y,
   size_t tile_end_x = std::min(tile_start_x + tile_w, w);
   size_t tile_end_y = std::min(tile_start_y + tile_h, h);
 
-  size_t tile_idx_x = tile_x / imageTileSize;
-  size_t tile_idx_y = tile_y / imageTileSize;
-  size_t num_samples_tile = tile_samples[tile_idx_x + tile_idx_y * num_tiles_w];
-
   for (size_t y = tile_start_y; y < tile_end_y; y++) {
     if (!continueRaytracing) return;
     for (size_t x = tile_start_x; x < tile_end_x; x++) {
-        Spectrum s = raytrace_pixel(x, y);
+        size_t i = x + y * w;
+        if (adaptive && pixel_converged[i]) continue;
+#ifdef ENABLE_TRAVERSAL_STATS
+        TraversalStats& stats = BVHAccel::traversal_stats();
+        stats.reset();
+#endif
          // #ifdef ENABLE_PATH_TRACING
-        if (this->useBDPT == 0)
-          sampleBuffer.update_pixel(s, x, y);
+        if (this->useBDPT == 0) {
+          // one sample at a time to track the luminance second moment
+          Spectrum s;
+          float sq = 0;
+          for (size_t k = 0; k < count; k++) {
+            Spectrum sk = raytrace_pixel(x, y, first + k, 1);
+            s += sk;
+            sq += sk.illum() * sk.illum();
+          }
+          sampleBuffer.update_pixel_add(s, x, y);
+          sampleSqBuffer[i] += sq;
+        }
+        // #else
+        else {
+          // shadow rays of all the pixel's samples are traced as one batch
+          Spectrum s = raytrace_pixel(x, y, first, count);
+          s += trace_connections();
+          sampleBuffer.update_pixel_add(s, x, y);
+          MemoryArena::thread_arena().reset();
+        }
         // #endif
+#ifdef ENABLE_TRAVERSAL_STATS
+        traversalBuffer[i].add(stats);
+#endif
+        sampleCountBuffer[i] += count;
     }
   }
 
-  tile_samples[tile_idx_x + tile_idx_y * num_tiles_w] += 1;
-
-  // #ifdef ENABLE_PATH_TRACING
-  if (this->useBDPT == 0)
-    sampleBuffer.toColor(frameBuffer, tile_start_x, tile_start_y, tile_end_x, tile_end_y);
-  // #else
-  else
-    sampleBuffer.toColor(frameBuffer, 0, 0, w, h); // need to also render tiles in case (iii) which does not originate in the camera ray (pixel)
-  // #endif
+  // in BDPT mode, splats to other pixels show up when the pass ends
+  sampleBuffer.toColor(frameBuffer, tile_start_x, tile_start_y, tile_end_x, tile_end_y, sampleCountBuffer);
 }
 
-void PathTracer::worker_thread() {
+void PathTracer::worker_thread(size_t worker_id) {
 
   Timer timer;
   timer.start();
+  BVHAccel::ray_count() = 0;
+
+  do {
+    size_t done = currentPass * passSamples;
+    size_t first = firstSample + done;
+    size_t count = std::min(passSamples, maxSamples - done);
+    if (useBDPT && ns_light_cache) trace_light_cache(first, count);
+
+    WorkItem work;
+    Timer tileTimer;
+    while (continueRaytracing && workQueue.try_get_work(worker_id, &work)) {
+      tileTimer.start();
+      raytrace_tile(work.tile_x, work.tile_y, work.tile_w, work.tile_h,
+                    first, count);
+      tileTimer.stop();
+      tile_cost[work.index] = tileTimer.duration();
+    }
+    if (useBDPT) flush_splats();
+  } while (pass_barrier());
 
-  WorkItem work;
-  while (continueRaytracing && workQueue.try_get_work(&work)) {
-    raytrace_tile(work.tile_x, work.tile_y, work.tile_w, work.tile_h);
-  }
-
+  raysTraced += BVHAccel::ray_count();
   workerDoneCount++;
   if (!continueRaytracing && workerDoneCount == numWorkerThreads) {
     timer.stop();
@@ -924,10 +1672,209 @@ void PathTracer::worker_thread() {
   if (continueRaytracing && workerDoneCount == numWorkerThreads) {
     timer.stop();
     fprintf(stdout, "Done! (%.4fs)\n", timer.duration());
+    size_t total = 0;
+    for (unsigned int n : sampleCountBuffer) total += n;
+    double spp = (double) total / sampleCountBuffer.size();
+    if (time_budget > 0) {
+      fprintf(stdout, "[PathTracer] Time budget %.2fs: %.2f samples per pixel "
+                      "in %zu passes\n", time_budget, spp, currentPass + 1);
+    } else if (adaptive) {
+      fprintf(stdout, "[PathTracer] Adaptive sampling: %.2f samples per pixel "
+                      "(max %zu)\n", spp, ns_aa);
+    }
+    fprintf(stdout, "[PathTracer] Traced %.2fM rays (%.2fM rays/sec)\n",
+            raysTraced * 1e-6, raysTraced * 1e-6 / timer.duration());
     state = DONE;
   }
 }
 
+void PathTracer::update_convergence() {
+
+  size_t w = sampleBuffer.w;
+  size_t h = sampleBuffer.h;
+
+  // mean luminance of every pixel and the variance of that mean
+  vector<float> mean(w * h, 0);
+  vector<float> mean_var(w * h, 0);
+  for (size_t i = 0; i < w * h; ++i) {
+    size_t n = sampleCountBuffer[i];
+    if (n < 2) continue;
+    mean[i] = sampleBuffer.data[i].illum() / n;
+    float var = (sampleSqBuffer[i] / n - mean[i] * mean[i]) * n / (n - 1);
+    mean_var[i] = std::max(var, 0.0f) / n;
+  }
+
+  // the error of a pixel is estimated over its 3x3 neighborhood, so that
+  // a pixel whose own few samples happen to agree does not stop early
+  std::fill(tile_active.begin(), tile_active.end(), 0);
+  for (size_t y = 0; y < h; ++y) {
+    for (size_t x = 0; x < w; ++x) {
+      size_t i = x + y * w;
+      size_t n = sampleCountBuffer[i];
+      bool converged = n >= maxSamples;
+
+      if (!converged && n >= kAdaptiveMinSamples) {
+        double m = 0, v = 0;
+        int k = 0;
+        for (size_t ny = (y > 0 ? y - 1 : 0); ny <= std::min(y + 1, h - 1); ++ny) {
+          for (size_t nx = (x > 0 ? x - 1 : 0); nx <= std::min(x + 1, w - 1); ++nx) {
+            size_t j = nx + ny * w;
+            if (sampleCountBuffer[j] < 2) continue;
+            m += mean[j];
+            v += mean_var[j];
+            k++;
+          }
+        }
+
+        // relative to the mean, with a floor so black pixels converge too
+        converged = sqrt(v / k) <= adaptive_error * std::max(m / k, 1e-3);
+      }
+
+      pixel_converged[i] = converged;
+      if (!converged) {
+        tile_active[x / imageTileSize + y / imageTileSize * num_tiles_w] = 1;
+      }
+    }
+  }
+}
+
+bool PathTracer::pass_barrier() {
+
+  std::unique_lock<std::mutex> guard(passLock);
+  size_t pass = currentPass;
+
+  if (++passArrivals < numWorkerThreads) {
+    passCond.wait(guard, [this, pass] {
+      return currentPass != pass || lastPassDone;
+    });
+    return !lastPassDone;
+  }
+
+  // last worker to arrive sets up the next pass
+  passArrivals = 0;
+  cacheNext = 0;
+  cacheTraced = 0;
+  if (useBDPT) merge_splats();
+  vector<WorkItem> next;
+  if (continueRaytracing && pass + 1 < numPasses && pass_fits_budget(pass)) {
+    if (adaptive) update_convergence();
+    split_costly_tiles();
+    for (const WorkItem& tile : tiles) {
+      size_t idx = tile.tile_x / imageTileSize +
+                   tile.tile_y / imageTileSize * num_tiles_w;
+      if (tile_active[idx]) next.push_back(tile);
+    }
+  }
+  if (!next.empty()) {
+    workQueue.put_work(next);
+    currentPass++;
+  } else {
+    lastPassDone = true;
+  }
+  if (checkpointing && continueRaytracing) {
+    save_checkpoint(pass + 1, lastPassDone);
+  }
+  passCond.notify_all();
+  return !lastPassDone;
+}
+
+void PathTracer::split_costly_tiles() {
+
+  // with a single worker nobody waits for a slow tile
+  if (numWorkerThreads < 2) return;
+
+  double total = 0;
+  for (double cost : tile_cost) total += cost;
+  double limit = total / (numWorkerThreads * kTileSplitFactor);
+
+  // quadrants are added in a U shape, keeping the Hilbert order local
+  vector<WorkItem> split;
+  for (const WorkItem& tile : tiles) {
+    if (tile_cost[tile.index] <= limit ||
+        tile.tile_w < 2 * kMinTileSize || tile.tile_h < 2 * kMinTileSize) {
+      split.push_back(tile);
+      continue;
+    }
+    int x = tile.tile_x, y = tile.tile_y;
+    int w = tile.tile_w / 2, h = tile.tile_h / 2;
+    WorkItem quadrants[4] = {
+      WorkItem(x,     y,     w,               h),
+      WorkItem(x,     y + h, w,               tile.tile_h - h),
+      WorkItem(x + w, y + h, tile.tile_w - w, tile.tile_h - h),
+      WorkItem(x + w, y,     tile.tile_w - w, h)
+    };
+    for (const WorkItem& q : quadrants) {
+      if ((size_t) q.tile_x < sampleBuffer.w &&
+          (size_t) q.tile_y < sampleBuffer.h) {
+        split.push_back(q);
+      }
+    }
+  }
+
+  if (split.size() != tiles.size()) {
+    for (size_t i = 0; i < split.size(); i++) split[i].index = i;
+    tiles.swap(split);
+    workQueue.reset(numWorkerThreads, tiles.size());
+  }
+
+  // tiles skipped by adaptive sampling do not count in the next pass
+  tile_cost.assign(tiles.size(), 0);
+}
+
+bool PathTracer::pass_fits_budget(size_t pass) {
+
+  if (time_budget <= 0) return true;
+
+  // assume the next pass takes as long as the passes so far did on average
+  renderTimer.stop();
+  double elapsed = resumedSeconds + renderTimer.duration();
+  return elapsed + elapsed / (pass + 1) <= time_budget;
+}
+
+RenderSettings PathTracer::render_settings() const {
+  RenderSettings settings;
+  memset(&settings, 0, sizeof(settings));
+  settings.width = sampleBuffer.w;
+  settings.height = sampleBuffer.h;
+  settings.ns_aa = ns_aa;
+  settings.ns_pass = ns_pass;
+  settings.max_ray_depth = max_ray_depth;
+  settings.ns_area_light = ns_area_light;
+  settings.ns_diff = ns_diff;
+  settings.ns_glsy = ns_glsy;
+  settings.ns_refr = ns_refr;
+  settings.bdpt = useBDPT;
+  settings.seed = seed;
+  settings.sequence = sequence;
+  settings.ns_light_cache = ns_light_cache;
+  settings.adaptive_error = adaptive_error;
+  settings.time_budget = time_budget;
+  return settings;
+}
+
+void PathTracer::save_checkpoint(size_t passes, bool last) {
+
+  renderTimer.stop();
+  double elapsed = resumedSeconds + renderTimer.duration();
+  if (!last && elapsed - lastCheckpoint < checkpoint_interval) return;
+  lastCheckpoint = elapsed;
+
+  // a copy of the buffers is all the workers wait for, the writer thread
+  // takes it from here
+  RenderCheckpoint checkpoint;
+  checkpoint.settings = render_settings();
+  checkpoint.passes = passes;
+  checkpoint.elapsed = elapsed;
+  checkpoint.sums = sampleBuffer.data;
+  checkpoint.counts = sampleCountBuffer;
+  if (adaptive) checkpoint.squares = sampleSqBuffer;
+  checkpointWriter.submit(&checkpoint, checkpoint_file);
+}
+
+void PathTracer::wait_for_checkpoints() {
+  checkpointWriter.flush();
+}
+
 void PathTracer::increase_area_light_sample_count() {
   ns_area_light *= 2;
   fprintf(stdout, "[PathTracer] Area light sample count increased to %zu!\n", ns_area_light);
@@ -950,17 +1897,118 @@ void PathTracer::save_image() {
   filename.erase(filename.end() - 1);
   filename += string(".png");
 
-  uint32_t* frame = &frameBuffer.data[0];
-  size_t w = frameBuffer.w;
-  size_t h = frameBuffer.h;
-  uint32_t* frame_out = new uint32_t[w * h];
-  for(size_t i = 0; i < h; ++i) {
-    memcpy(frame_out + i * w, frame + (h - i - 1) * w, 4 * w);
+  write_png(filename, frameBuffer);
+}
+
+bool PathTracer::save_image(const string& filename) {
+
+  if (state != DONE) {
+    fprintf(stderr, "[PathTracer] No finished render to save to %s\n",
+            filename.c_str());
+    return false;
+  }
+
+  return write_image(filename, sampleBuffer, sampleCountBuffer);
+}
+
+#ifdef ENABLE_TRAVERSAL_STATS
+
+/**
+ * Map t in [0, 1] to a blue - cyan - green - yellow - red color ramp.
+ */
+static Color heat_color(float t) {
+  static const Color ramp[] = {
+    Color(0, 0, 1), Color(0, 1, 1), Color(0, 1, 0), Color(1, 1, 0), Color(1, 0, 0)
+  };
+  t = clamp(t, 0.f, 1.f) * 4;
+  int i = min((int) t, 3);
+  float f = t - i;
+  const Color& a = ramp[i];
+  const Color& b = ramp[i + 1];
+  return Color(a.r + (b.r - a.r) * f,
+               a.g + (b.g - a.g) * f,
+               a.b + (b.b - a.b) * f, 1.0);
+}
+
+/**
+ * Print a linear histogram of per pixel counter values.
+ */
+static void print_histogram(const char* name, const vector<size_t>& values) {
+
+  const size_t kNumBins = 10;
+  const size_t kBarWidth = 50;
+
+  size_t lo = *std::min_element(values.begin(), values.end());
+  size_t hi = *std::max_element(values.begin(), values.end());
+  double mean = 0;
+  for (size_t v : values) mean += v;
+  mean /= values.size();
+
+  size_t bin_width = (hi - lo) / kNumBins + 1;
+  vector<size_t> bins(kNumBins, 0);
+  for (size_t v : values) bins[(v - lo) / bin_width]++;
+  size_t peak = *std::max_element(bins.begin(), bins.end());
+
+  fprintf(stdout, "[PathTracer] %s per pixel: min %zu, mean %.1f, max %zu\n",
+          name, lo, mean, hi);
+  for (size_t i = 0; i < kNumBins; ++i) {
+    fprintf(stdout, "  [%10zu, %10zu) %8zu ", lo + i * bin_width,
+            lo + (i + 1) * bin_width, bins[i]);
+    for (size_t j = 0; j < bins[i] * kBarWidth / peak; ++j) fputc('#', stdout);
+    fputc('\n', stdout);
   }
+}
+
+#endif // ENABLE_TRAVERSAL_STATS
+
+void PathTracer::save_traversal_heatmap() {
+
+#ifndef ENABLE_TRAVERSAL_STATS
+  fprintf(stderr, "[PathTracer] Traversal stats are disabled "
+                  "(define ENABLE_TRAVERSAL_STATS in bvh.h)\n");
+#else
+  if (state != DONE) return;
+
+  size_t w = sampleBuffer.w;
+  size_t h = sampleBuffer.h;
+
+  vector<size_t> nodes(w * h), bboxes(w * h), prims(w * h), depth(w * h);
+  for (size_t i = 0; i < w * h; ++i) {
+    nodes[i]  = traversalBuffer[i].nodes_visited;
+    bboxes[i] = traversalBuffer[i].bbox_tests;
+    prims[i]  = traversalBuffer[i].primitive_tests;
+    depth[i]  = traversalBuffer[i].max_stack_depth;
+  }
+
+  print_histogram("Nodes visited", nodes);
+  print_histogram("BBox tests", bboxes);
+  print_histogram("Primitive tests", prims);
+  print_histogram("Max stack depth", depth);
+
+  // scale to the 99th percentile so that a handful of very hot pixels
+  // does not wash out the rest of the map
+  vector<size_t> sorted(nodes);
+  size_t k = (sorted.size() - 1) * 99 / 100;
+  std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+  float scale = sorted[k] ? 1.f / sorted[k] : 0.f;
+
+  ImageBuffer heatmap(w, h);
+  for (size_t y = 0; y < h; ++y) {
+    for (size_t x = 0; x < w; ++x) {
+      heatmap.update_pixel(heat_color(nodes[x + y * w] * scale), x, y);
+    }
+  }
+
+  time_t rawtime;
+  time (&rawtime);
+
+  string filename = "Traversal Heatmap ";
+  filename += string(ctime(&rawtime));
+  filename.erase(filename.end() - 1);
+  filename += string(".png");
 
-  fprintf(stderr, "[PathTracer] Saving to file: %s... ", filename.c_str());
-  lodepng::encode(filename, (unsigned char*) frame_out, w, h);
-  fprintf(stderr, "Done!\n");
+  write_png(filename, heatmap);
+#endif
 }
 
 }  // namespace CMU462
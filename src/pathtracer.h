@@ -4,8 +4,11 @@
 #include <stack>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <vector>
 #include <algorithm>
+#include <unordered_map>
 
 #include "CMU462/timer.h"
 
@@ -13,16 +16,29 @@
 #include "camera.h"
 #include "sampler.h"
 #include "image.h"
+#include "checkpoint.h"
 #include "work_queue.h"
+#include "thread_pool.h"
 
 #include "static_scene/scene.h"
 using CMU462::StaticScene::Scene;
+using CMU462::StaticScene::SceneLight;
+using CMU462::StaticScene::SceneObject;
+using CMU462::StaticScene::Intersection;
 
 #include "static_scene/environment_light.h"
 using CMU462::StaticScene::EnvironmentLight;
+using CMU462::StaticScene::AliasTable;
+
+#include "static_scene/light_tree.h"
+using CMU462::StaticScene::LightTree;
 
 using CMU462::StaticScene::BVHNode;
 using CMU462::StaticScene::BVHAccel;
+using CMU462::StaticScene::BVHStats;
+#ifdef ENABLE_TRAVERSAL_STATS
+using CMU462::StaticScene::TraversalStats;
+#endif
 
 namespace CMU462 {
 
@@ -31,24 +47,43 @@ struct WorkItem {
   // Default constructor.
   WorkItem() : WorkItem(0, 0, 0, 0) { }
 
-  WorkItem(int x, int y, int w, int h)
-      : tile_x(x), tile_y(y), tile_w(w), tile_h(h) {}
+  WorkItem(int x, int y, int w, int h, size_t index = 0)
+      : tile_x(x), tile_y(y), tile_w(w), tile_h(h), index(index) {}
 
   int tile_x;
   int tile_y;
   int tile_w;
   int tile_h;
+  size_t index; ///< position in the pathtracer's tile list
 
 };
 
 // ===RUI=== 
+/**
+ * A vertex of a BDPT subpath. Subpaths start with their endpoint: the
+ * camera (no bsdf and no light) or a point on a light.
+ */
 struct Vertice {
   Vector3D p;
-  Vector3D n;
-  Vector3D dgdu, dudv;
-  Vector3D wi, wo;
-  BSDF *bsdf;
-  Spectrum cumulative;
+  Vector3D n;           ///< normal, facing the side the subpath arrived from
+  Vector3D wo;          ///< local direction to the predecessor
+  BSDF *bsdf;           ///< NULL for endpoints
+  SceneLight *light;    ///< light of a light endpoint, else NULL
+  Spectrum cumulative;  ///< throughput of the subpath up to this vertex
+  float pdfFwd;         ///< area density of sampling it from its predecessor
+  float pdfRev;         ///< area density of sampling the predecessor from it
+  float pickRatio;      ///< light endpoints: probability of connect_to_light
+                        ///< picking the light over that of light subpaths
+  bool delta;           ///< scatters with a delta distribution
+};
+
+/**
+ * A BDPT subpath in fixed capacity storage from the thread's MemoryArena,
+ * which is reset after every pixel.
+ */
+struct SubPath {
+  Vertice *v;           ///< vertices, with room for the longest subpath
+  size_t size;          ///< number of vertices
 };
 
 
@@ -66,13 +101,23 @@ class PathTracer {
 
   /**
    * Default constructor.
-   * Creates a new pathtracer instance.
+   * Creates a new pathtracer instance. Rendering and BVH construction run on
+   * the given thread pool, which is not owned by the pathtracer. If no pool
+   * is given, the pathtracer creates its own with num_threads threads.
    */
   PathTracer(size_t ns_aa = 1,
              size_t max_ray_depth = 4, size_t ns_area_light = 1,
              size_t ns_diff = 1, size_t ns_glsy = 1, size_t ns_refr = 1,
              size_t num_threads = 1,
-             HDRImageBuffer* envmap = NULL, size_t ifBDPT = 0);
+             HDRImageBuffer* envmap = NULL, size_t ifBDPT = 0,
+             const std::string& bvh_report = "",
+             double sah_ct = 1, double sah_ci = 1,
+             ThreadPool* thread_pool = NULL, size_t ns_pass = 0,
+             double adaptive_error = 0, size_t seed = 0,
+             SampleSequence sequence = SEQUENCE_RANDOM,
+             size_t ns_light_cache = 0, double time_budget = 0,
+             size_t tile_size = 32, const std::string& checkpoint = "",
+             double checkpoint_interval = 60);
 
   /**
    * Destructor.
@@ -135,6 +180,49 @@ class PathTracer {
    */
   void start_raytracing();
 
+  /**
+   * Same as start_raytracing, but renders only samples [first, first + count)
+   * of every pixel, for instance as one work item of a distributed render.
+   * \param first index of the first sample of every pixel to render
+   * \param count number of samples per pixel to render
+   */
+  void start_raytracing(size_t first, size_t count);
+
+  /**
+   * Same as start_raytracing, but continues the render a checkpoint was taken
+   * of. The scene, camera and frame size must be set up as they were.
+   * \param checkpoint checkpoint taken by a render with the same settings
+   * \return false if the checkpoint's settings differ from the pathtracer's
+   */
+  bool resume_raytracing(const RenderCheckpoint& checkpoint);
+
+  /**
+   * Wait until the checkpoints taken so far are written.
+   */
+  void wait_for_checkpoints();
+
+  /**
+   * Per pixel sums of the samples rendered so far.
+   */
+  const HDRImageBuffer& get_sample_buffer() const { return sampleBuffer; }
+
+  /**
+   * Per pixel counts of the samples rendered so far.
+   */
+  const std::vector<unsigned int>& get_sample_counts() const {
+    return sampleCountBuffer;
+  }
+
+  /**
+   * The settings that decide what a render computes.
+   */
+  RenderSettings render_settings() const;
+
+  /**
+   * If the BVH quality report was written for the current scene.
+   */
+  bool bvh_report_written() const { return bvhReportWritten; }
+
   /**
    * If the pathtracer is in VISUALIZE, handle key presses to traverse the bvh.
    */
@@ -155,6 +243,21 @@ class PathTracer {
    */
   void save_image();
 
+  /**
+   * Save rendered result to the given file. Files ending in .exr get the
+   * linear radiance, everything else is written as a tone mapped png.
+   * \param filename path of the output image
+   * \return true if a finished render was written
+   */
+  bool save_image(const std::string& filename);
+
+  /**
+   * Save a false-color heatmap of the BVH nodes visited per pixel to a png
+   * file and print histograms of the per pixel traversal counters. Only
+   * available when built with ENABLE_TRAVERSAL_STATS.
+   */
+  void save_traversal_heatmap();
+
  private:
 
   /**
@@ -167,6 +270,30 @@ class PathTracer {
    */
   void build_accel();
 
+  /**
+   * Build the distributions lights are picked from: in proportion to their
+   * estimated power, and by their importance to a point with the light
+   * tree. Needs the BVH for the size of the scene.
+   */
+  void build_light_distribution();
+
+  /**
+   * Pick a light in proportion to its power.
+   * \param pmf probability of picking the returned light
+   * \return the picked light, NULL if the scene has no lights
+   */
+  SceneLight* sample_light(float* pmf) const;
+
+  /**
+   * Pick a light to shade a point with, from the light tree.
+   * \param p the shading point
+   * \param n normal at p
+   * \param pmf probability of picking the returned light
+   * \return the picked light, NULL if no light can reach p
+   */
+  SceneLight* sample_light(const Vector3D& p, const Vector3D& n,
+                           float* pmf) const;
+
   /**
    * Visualize acceleration structures.
    */
@@ -179,39 +306,228 @@ class PathTracer {
   Spectrum trace_ray(const Ray& ray, bool includeLe = false);
 
   /**
-   * Trace an ray in the scene with Bidirectional Path Tracing.
+   * Trace the rest of a path, from the camera ray or from a branch of a
+   * split first bounce. The first surface the path hits continues it
+   * along ns_diff, ns_glsy or ns_refr BSDF samples, by the kind of the
+   * surface, sharing the camera ray among them. Mirrors and other
+   * surfaces that reflect deterministically pass the split on to the
+   * next surface.
+   * \param throughput weight of the radiance the ray finds
    * \param includeLe if emission value should be added to output
+   * \param prev_p the vertex the ray leaves from
+   * \param prev_n normal at prev_p
+   * \param bsdfPdf solid angle density of the ray's direction at prev_p,
+   *        0 if the ray was not sampled from a BSDF that lights sample too
+   * \param bounce number of surfaces the path hit before the ray
    */
-  Spectrum trace_ray_bpt(const Ray &r, size_t x, size_t y);
+  Spectrum trace_path(const Ray& ray, Spectrum throughput, bool includeLe,
+                      Vector3D prev_p, Vector3D prev_n, float bsdfPdf,
+                      size_t bounce);
+
+  /**
+   * Number of BSDF samples that continue a path at its first hit.
+   */
+  size_t num_branches(const BSDF* bsdf) const;
+
+  /**
+   * Multiple importance sampling weight of emission a BSDF sample found,
+   * against the light samples trace_ray takes at the sample's vertex.
+   * \param p the vertex the BSDF was sampled at
+   * \param n normal at p
+   * \param bsdfPdf solid angle density of the sampled direction
+   * \param light the light the ray found
+   * \param wi the sampled direction
+   * \param isect where the ray hit the light's object
+   */
+  float bsdf_weight(const Vector3D& p, const Vector3D& n, float bsdfPdf,
+                    const SceneLight* light, const Vector3D& wi,
+                    const Intersection& isect) const;
+
+  /**
+   * Trace an ray in the scene with Bidirectional Path Tracing.
+   * Connections between the subpaths are only queued; trace_connections
+   * tests them and adds up their radiance.
+   * \return emission seen along the ray
+   */
+  Spectrum trace_ray_bpt(const Ray &r);
 
   // ===RUI=== 
-  void randomWalk(Ray ray, std::vector<Vertice> &vertices, bool eye, Spectrum emission);
+  void randomWalk(Ray ray, SubPath &path, Spectrum beta, float pdfDir);
+
+  /**
+   * Trace an eye path for a camera ray, starting with the camera vertex.
+   */
+  void trace_eye_path(const Ray &r, SubPath &path);
+
+  /**
+   * Trace a light path from a uniformly chosen light, starting with the
+   * vertex on the light.
+   */
+  void trace_light_path(SubPath &path);
 
   // ===RUI=== 
   Spectrum evalPath(
-  const std::vector<Vertice> &eyePath,
-  const std::vector<Vertice> &lightPath,
-  int nEye, int nLight) const;
+  const Vertice *eyePath, int t,
+  const Vertice *lightPath, int s) const;
+
+  /**
+   * Weight a connection and queue it for its visibility test.
+   * \param L unoccluded contribution of the connection from evalPath
+   */
+  void connect(const Vertice *eyePath, int t,
+               const Vertice *lightPath, int s, const Spectrum &L) const;
+
+  /**
+   * Queue a connection of the calling thread for trace_connections.
+   * \param r shadow ray of the connection
+   * \param L contribution of the connection if r is unoccluded
+   * \param pixel pixel to splat L to, or -1 for the pixel being rendered
+   */
+  void queue_connection(const Ray &r, const Spectrum &L, size_t pixel) const;
+
+  /**
+   * Trace the shadow rays of the calling thread's queued connections as one
+   * batch, splat the unoccluded contributions that land on other pixels and
+   * empty the queue.
+   * \return sum of the unoccluded contributions to the pixel being rendered
+   */
+  Spectrum trace_connections();
+
+  /**
+   * Area density with which vertex v, reached from prev, samples next.
+   */
+  float vertex_pdf(const Vertice *prev, const Vertice &v,
+                   const Vertice &next) const;
+
+  /**
+   * MIS weight of connecting the first t eye vertices to the first s light
+   * vertices.
+   */
+  float mis_weight(const Vertice *eyePath, int t,
+                   const Vertice *lightPath, int s) const;
 
   // ===RUI=== 
-  void render_paths(size_t x, size_t y, const Ray &eyeRay, const Ray &lightRay, const Spectrum &Le);
+  void render_paths(const SubPath &eyePath,
+                    const Vertice *lightPath, size_t lightLength, float scale);
+
+  /**
+   * Render an eye path against a few subpaths of the light cache.
+   */
+  void render_cached_paths(const SubPath &eyePath);
+
+  /**
+   * Connect eye vertex t straight to a sample on a light.
+   */
+  void connect_to_light(const SubPath &eyePath, int t);
+
+  /**
+   * Connect every vertex of a light path to the camera, splatting the
+   * contributions to the pixels they land on.
+   * \param scale weight of the light path in the estimate
+   */
+  void splat_light_path(const Vertice *lightPath, size_t lightLength,
+                        float scale);
+
+  /**
+   * Trace this pass's light cache, sharing the subpaths to trace with the
+   * other workers, and wait until all of them are traced. Also splats the
+   * subpaths to the camera in place of the eye paths' own light paths.
+   * \param count camera rays per pixel in the pass
+   */
+  void trace_light_cache(size_t first, size_t count);
 
+  /**
+   * Add a light tracing contribution to a pixel of any tile. Splats are
+   * kept per thread and flushed to splatBuffer in batches, so workers never
+   * write to the tiles other workers are rendering.
+   */
+  void add_splat(const Spectrum& s, size_t x, size_t y);
+
+  /**
+   * Flush the calling thread's splats to splatBuffer.
+   */
+  void flush_splats();
 
   /**
-   * Trace a camera ray given by the pixel coordinate.
+   * Add the splats of the pass to sampleBuffer and refresh the whole frame
+   * buffer. Only call while no worker is rendering.
    */
-  Spectrum raytrace_pixel(size_t x, size_t y);
+  void merge_splats();
+
+
+  /**
+   * Trace camera rays through the given pixel.
+   * Samples are numbered 0 to ns_aa - 1 over the stratified sample grids, so
+   * a pixel can be rendered over several calls with disjoint sample ranges.
+   * The random numbers of every sample are seeded from its pixel, its index
+   * and the render seed, so the result does not depend on scheduling. With
+   * a low discrepancy sequence, the samples of a pixel are its points in
+   * sequence order instead, and all their dimensions come from it.
+   * \param first index of the first sample to take
+   * \param count number of samples to take
+   * \return sum of the sample radiances (BDPT adds to the buffer directly)
+   */
+  Spectrum raytrace_pixel(size_t x, size_t y, size_t first, size_t count);
 
   /**
    * Raytrace a tile of the scene and update the frame buffer. Is run
    * in a worker thread.
+   * \param first index of the first sample to take in each pixel
+   * \param count number of samples to take in each pixel
    */
-  void raytrace_tile(int tile_x, int tile_y, int tile_w, int tile_h);
+  void raytrace_tile(int tile_x, int tile_y, int tile_w, int tile_h,
+                     size_t first, size_t count);
 
   /**
    * Implementation of a ray tracer worker thread
+   * \param worker_id index of the worker's own tile queue
+   */
+  void worker_thread(size_t worker_id);
+
+  /**
+   * Wait until all workers have finished the current pass. The last worker
+   * to arrive queues the tiles for the next pass.
+   * \return true if there is another pass to render
+   */
+  bool pass_barrier();
+
+  /**
+   * Whether a time budgeted render can start another pass and still finish
+   * it within the budget. Always true without a time budget.
+   * \param pass index of the pass that just ended
    */
-  void worker_thread();
+  bool pass_fits_budget(size_t pass);
+
+  /**
+   * Start rendering samples [first, first + count) of every pixel, resuming
+   * from the given checkpoint if there is one.
+   */
+  void start_render(size_t first, size_t count,
+                    const RenderCheckpoint* checkpoint);
+
+  /**
+   * Hand a copy of the accumulation state to the checkpoint writer, if the
+   * checkpoint interval has passed since the last one.
+   * \param passes number of passes the state includes
+   * \param last whether this is the last pass of the render
+   */
+  void save_checkpoint(size_t passes, bool last);
+
+  /**
+   * Split the tiles that took much longer than the others in the last pass
+   * into quadrants, so that no single tile keeps the workers waiting at the
+   * end of the next pass. Only call between passes.
+   */
+  void split_costly_tiles();
+
+  /**
+   * Adaptive sampling: flag the pixels that need no more samples, and the
+   * tiles that still have pixels which do. A pixel is converged once the
+   * standard error of the mean luminance in its neighborhood is below
+   * adaptive_error relative to that mean, or it has taken ns_aa samples.
+   * Only call while no worker is rendering.
+   */
+  void update_convergence();
 
   /**
    * Log a ray miss.
@@ -247,27 +563,70 @@ class PathTracer {
   size_t max_ray_depth; ///< maximum allowed ray depth (applies to all rays)
   size_t ns_aa;         ///< number of camera rays in one pixel
   size_t ns_area_light; ///< number samples per area light source
-  size_t ns_diff;       ///< number of samples - diffuse surfaces
-  size_t ns_glsy;       ///< number of samples - glossy surfaces
-  size_t ns_refr;       ///< number of samples - refractive surfaces
+  size_t ns_diff;       ///< first bounce samples - diffuse surfaces
+  size_t ns_glsy;       ///< first bounce samples - glossy surfaces
+  size_t ns_refr;       ///< first bounce samples - refractive surfaces
+  size_t ns_pass;       ///< number of camera rays in one pixel per pass
+  double adaptive_error;///< relative error target, 0 disables adaptive sampling
+  size_t seed;          ///< seed of the per sample random number streams
+  SampleSequence sequence; ///< sample sequence of the camera rays
+  size_t ns_light_cache;///< BDPT light subpaths cached per pass, 0 disables
+  double time_budget;   ///< seconds to keep rendering passes, 0 renders ns_aa
+  std::string checkpoint_file; ///< file to checkpoint renders to, if any
+  double checkpoint_interval;  ///< seconds between checkpoints
   size_t useBDPT;
   vector<size_t> sample_grids; ///< decomposition of ns_aa for stratified sampling
+  size_t patternSamples;       ///< number of samples covered by sample_grids
+
+  // BVH report settings //
+
+  std::string bvh_report;  ///< json file for the BVH quality report, if any
+  bool bvhReportWritten;   ///< the report was written for the current BVH
+  double sah_ct;           ///< traversal cost used for the reported SAH cost
+  double sah_ci;           ///< intersection cost used for the reported SAH cost
 
   // Integration state //
 
-  vector<int> tile_samples; ///< current sample rate for tile
   size_t num_tiles_w;       ///< number of tiles along width of the image
   size_t num_tiles_h;       ///< number of tiles along height of the image
+  vector<WorkItem> tiles;   ///< tiles to render in every pass, Hilbert order
+  vector<double> tile_cost; ///< seconds each tile took in the last pass
+  vector<char> tile_active; ///< tile has unconverged pixels
+  vector<char> pixel_converged; ///< pixel needs no more samples
+  bool adaptive;            ///< adaptive sampling in the current render
+  size_t passSamples;       ///< camera rays per pixel in each pass
+  size_t firstSample;       ///< index of the first sample of the render
+  size_t maxSamples;        ///< camera rays per pixel at which rendering stops
+  size_t numPasses;         ///< maximum number of passes in the current render
+  size_t currentPass;       ///< pass the workers are rendering
 
   // Components //
 
   BVHAccel* bvh;                 ///< BVH accelerator aggregate
   EnvironmentLight *envLight;    ///< environment map
+  AliasTable* lightDistribution; ///< picks lights by power, NULL without lights
+  LightTree* lightTree;          ///< picks lights for a shading point
+  std::unordered_map<const SceneLight*, float> lightPowerPmf; ///< by power
+  bool allDeltaLights;           ///< every light of the scene is a delta light
+  size_t lightSamples;           ///< light samples per shading point
+  std::unordered_map<const SceneObject*, SceneLight*> objectLights; ///< lights of emissive objects
   Sampler2D* gridSampler;        ///< samples unit grid
+  Sampler2D* sequenceSampler;    ///< low discrepancy sequence, NULL for random
   Sampler3D* hemisphereSampler;  ///< samples unit hemisphere
-  HDRImageBuffer sampleBuffer;   ///< sample buffer
+  HDRImageBuffer sampleBuffer;   ///< sample buffer, sums of samples
+  HDRImageBuffer splatBuffer;    ///< light tracing splats of the current pass
+  std::vector<unsigned int> sampleCountBuffer; ///< per pixel sample counts
+  std::vector<float> sampleSqBuffer; ///< per pixel sums of squared luminance
+#ifdef ENABLE_TRAVERSAL_STATS
+  std::vector<TraversalStats> traversalBuffer; ///< per pixel traversal counters
+#endif
   ImageBuffer frameBuffer;       ///< frame buffer
   Timer timer;                   ///< performance test timer
+  Timer renderTimer;             ///< started when the current render started
+  double resumedSeconds;         ///< render time before the resumed checkpoint
+  double lastCheckpoint;         ///< render time of the last checkpoint
+  bool checkpointing;            ///< the current render takes checkpoints
+  CheckpointWriter checkpointWriter; ///< writes checkpoints in the background
 
   // Internals //
 
@@ -275,9 +634,24 @@ class PathTracer {
   size_t imageTileSize;
 
   bool continueRaytracing;                  ///< rendering should continue
-  std::vector<std::thread*> workerThreads;  ///< pool of worker threads
+  ThreadPool* threadPool;                   ///< pool running the workers
+  bool ownsThreadPool;                      ///< threadPool is ours to delete
   std::atomic<int> workerDoneCount;         ///< worker threads management
-  WorkQueue<WorkItem> workQueue;            ///< queue of work for the workers
+  std::atomic<size_t> raysTraced;           ///< rays traced by the workers
+  std::mutex passLock;                      ///< guards the pass barrier
+  std::condition_variable passCond;         ///< signaled when a pass ends
+  size_t passArrivals;                      ///< workers done with the pass
+  bool lastPassDone;                        ///< no more passes to render
+  WorkQueue<WorkItem> workQueue;            ///< per worker work stealing queues
+  std::mutex splatLock;                     ///< guards splatBuffer
+
+  // BDPT Light Cache //
+
+  std::vector<std::vector<Vertice> > cachePaths; ///< subpaths as traced
+  std::vector<Vertice> cacheVertices;       ///< vertices of all subpaths
+  std::vector<size_t> cacheOffsets;         ///< first vertex of each subpath
+  std::atomic<size_t> cacheNext;            ///< next subpath to trace
+  size_t cacheTraced;                       ///< subpaths traced, guarded by passLock
 
   // Tonemapping Controls //
 
@@ -2,14 +2,87 @@
 #define CMU462_RANDOMUTIL_H
 
 #include <cstdlib>
+#include <stdint.h>
 
 namespace CMU462 {
 
 /**
- * Returns a number distributed uniformly over [0, 1].
+ * PCG32 random number generator (O'Neill, pcg-random.org).
+ * 64 bits of state, 32 bit outputs, with independent streams selected by
+ * the increment. Small, fast and of much better quality than std::rand.
+ */
+struct PCG32 {
+
+  uint64_t state = 0x853c49e6748fea9bULL;  ///< generator state
+  uint64_t inc = 0xda3e39cb94b95bdbULL;    ///< stream, always odd
+
+  /**
+   * Reset the generator.
+   * \param initstate starting state
+   * \param initseq stream to generate
+   */
+  void seed(uint64_t initstate, uint64_t initseq) {
+    state = 0;
+    inc = (initseq << 1) | 1;
+    next_uint();
+    state += initstate;
+    next_uint();
+  }
+
+  /**
+   * Returns a number distributed uniformly over all 32 bit integers.
+   */
+  uint32_t next_uint() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + inc;
+    uint32_t xorshifted = (uint32_t) (((old >> 18) ^ old) >> 27);
+    uint32_t rot = (uint32_t) (old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+  }
+
+  /**
+   * Returns a number distributed uniformly over [0, 1).
+   */
+  double next_double() {
+    return next_uint() * (1.0 / 4294967296.0);
+  }
+};
+
+/**
+ * The random number generator of the calling thread. Each thread has its
+ * own generator, so there is no shared state between render threads.
+ */
+inline PCG32& thread_rng() {
+  static thread_local PCG32 rng;
+  return rng;
+}
+
+/**
+ * splitmix64 finalizer, used to turn structured keys into seeds.
+ */
+inline uint64_t mix_bits(uint64_t v) {
+  v += 0x9e3779b97f4a7c15ULL;
+  v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  v = (v ^ (v >> 27)) * 0x94d049bb133111ebULL;
+  return v ^ (v >> 31);
+}
+
+/**
+ * Reseed the calling thread's generator for one camera sample, so that the
+ * random numbers used by the sample only depend on the pixel, the index of
+ * the sample in the pixel and the render seed, and not on which thread
+ * takes the sample or when. This makes renders reproducible.
+ */
+inline void seed_sample(size_t x, size_t y, size_t sample, uint64_t seed) {
+  uint64_t pixel = mix_bits(seed ^ mix_bits(((uint64_t) y << 32) | x));
+  thread_rng().seed(mix_bits(pixel + sample), pixel);
+}
+
+/**
+ * Returns a number distributed uniformly over [0, 1).
  */
 inline double random_uniform() {
-  return ((double)std::rand()) / RAND_MAX;
+  return thread_rng().next_double();
 }
 
 /**
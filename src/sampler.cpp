@@ -1,13 +1,299 @@
 #include "sampler.h"
 
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
 #include "random_util.h"
 
 namespace CMU462 {
 
+// Sample Context //
+
+SampleContext& sample_context() {
+  static thread_local SampleContext context = { 0, 0, 0, 0, 0, 0, NULL };
+  return context;
+}
+
+void start_sample(const Sampler2D* sequence, size_t x, size_t y,
+                  size_t index, uint64_t seed) {
+  SampleContext& c = sample_context();
+  c.x = x;
+  c.y = y;
+  c.index = index;
+  c.seed = seed;
+  c.scramble = mix_bits(seed ^ mix_bits(((uint64_t) y << 32) | x));
+  c.dimension = 0;
+  c.sequence = sequence;
+  seed_sample(x, y, index, seed);
+}
+
+Vector2D sample_2d() {
+  const Sampler2D* sequence = sample_context().sequence;
+  if (sequence) return sequence->get_sample();
+  return Vector2D(random_uniform(), random_uniform());
+}
+
+double sample_1d() {
+  return sample_2d().x;
+}
+
 // Uniform Sampler2D Implementation //
 
 Vector2D UniformGridSampler2D::get_sample() const {
-  return Vector2D(random_uniform(), random_uniform());
+  return sample_2d();
+}
+
+// Sobol Sampler2D Implementation //
+
+static uint32_t reverse_bits(uint32_t v) {
+  v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+  v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+  v = ((v >> 4) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4);
+  v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+  return (v >> 16) | (v << 16);
+}
+
+// hash in which every bit only depends on the bits below it, which makes
+// it an Owen scramble when applied to bit reversed values
+static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+
+static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+  return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// second Sobol dimension, its direction numbers are v_k = v_k-1 ^ v_k-1 >> 1
+static uint32_t sobol_second(uint32_t index) {
+  uint32_t r = 0;
+  for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+    if (index & 1) r ^= v;
+  }
+  return r;
+}
+
+// point index of the shuffled, Owen scrambled 2D Sobol sequence given by
+// seed, as 32 bit fixed point coordinates
+static void sobol_2d(uint32_t index, uint32_t seed, uint32_t* x, uint32_t* y) {
+  index = nested_uniform_scramble(index, seed);
+  *x = nested_uniform_scramble(reverse_bits(index), (uint32_t) mix_bits(seed));
+  *y = nested_uniform_scramble(sobol_second(index),
+                               (uint32_t) mix_bits(seed + 1));
+}
+
+Vector2D SobolSampler2D::get_sample() const {
+  SampleContext& c = sample_context();
+  uint32_t seed = (uint32_t) mix_bits(c.scramble + c.dimension);
+  c.dimension += 2;
+
+  uint32_t x, y;
+  sobol_2d((uint32_t) c.index, seed, &x, &y);
+  return Vector2D(x * (1.0 / 4294967296.0), y * (1.0 / 4294967296.0));
+}
+
+// Halton Sampler2D Implementation //
+
+static const uint32_t kHaltonPrimes[] = {
+    2,   3,   5,   7,  11,  13,  17,  19,  23,  29,  31,  37,  41,  43,  47,
+   53,  59,  61,  67,  71,  73,  79,  83,  89,  97, 101, 103, 107, 109, 113,
+  127, 131, 137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197,
+  199, 211, 223, 227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281,
+  283, 293, 307, 311
+};
+static const uint32_t kHaltonDimensions =
+    sizeof(kHaltonPrimes) / sizeof(kHaltonPrimes[0]);
+
+// element i of a random permutation of [0, l) chosen by p, computed by
+// hashing (Kensler, "Correlated Multi-Jittered Sampling", 2013)
+static uint32_t permute(uint32_t i, uint32_t l, uint32_t p) {
+  uint32_t w = l - 1;
+  w |= w >> 1;
+  w |= w >> 2;
+  w |= w >> 4;
+  w |= w >> 8;
+  w |= w >> 16;
+  do {
+    i ^= p; i *= 0xe170893d;
+    i ^= p >> 16;
+    i ^= (i & w) >> 4;
+    i ^= p >> 8; i *= 0x0929eb3f;
+    i ^= p >> 23;
+    i ^= (i & w) >> 1; i *= 1 | p >> 27;
+    i *= 0x6935fa69;
+    i ^= (i & w) >> 11; i *= 0x74dcb303;
+    i ^= (i & w) >> 2; i *= 0x9e501cc3;
+    i ^= (i & w) >> 2; i *= 0xc860a3df;
+    i &= w;
+    i ^= i >> 5;
+  } while (i >= l);
+  return (i + p) % l;
+}
+
+// radical inverse of index in the given base, with each digit permuted by
+// a random permutation that depends on the digits before it (an Owen
+// scramble)
+static double scrambled_radical_inverse(uint64_t index, uint32_t base,
+                                        uint64_t seed) {
+  double inv = 1.0 / base;
+  double f = inv;
+  double r = 0;
+  uint64_t h = seed;
+  while (f > 1e-10) {
+    uint32_t digit = (uint32_t) (index % base);
+    index /= base;
+    r += permute(digit, base, (uint32_t) mix_bits(h)) * f;
+    h = mix_bits(h ^ (digit + 1));
+    f *= inv;
+  }
+  return std::min(r, 1.0 - 1e-12);
+}
+
+Vector2D HaltonSampler2D::get_sample() const {
+  SampleContext& c = sample_context();
+  uint32_t d = c.dimension;
+  c.dimension += 2;
+  if (d + 1 >= kHaltonDimensions) {
+    return Vector2D(random_uniform(), random_uniform());
+  }
+
+  return Vector2D(
+    scrambled_radical_inverse(c.index, kHaltonPrimes[d],
+                              mix_bits(c.scramble + d)),
+    scrambled_radical_inverse(c.index, kHaltonPrimes[d + 1],
+                              mix_bits(c.scramble + d + 1)));
+}
+
+// Blue Noise Sampler2D Implementation //
+
+// Ulichney's void-and-cluster method: rank every pixel of a toroidal mask
+// by the order in which it is added to a progressively denser pattern that
+// always fills the largest void
+static std::vector<float> void_and_cluster(size_t n) {
+  size_t count = n * n;
+  const double sigma = 1.5;
+
+  // energy of a point seen at toroidal offset (dx, dy)
+  std::vector<float> kernel(count);
+  for (size_t dy = 0; dy < n; dy++) {
+    for (size_t dx = 0; dx < n; dx++) {
+      double x = std::min(dx, n - dx);
+      double y = std::min(dy, n - dy);
+      kernel[dy * n + dx] = exp(-(x * x + y * y) / (2 * sigma * sigma));
+    }
+  }
+
+  std::vector<char> bits(count, 0);
+  std::vector<float> energy(count, 0);
+  auto set = [&](size_t p, char b) {
+    bits[p] = b;
+    float sign = b ? 1.f : -1.f;
+    size_t px = p % n, py = p / n;
+    for (size_t y = 0; y < n; y++) {
+      const float* row = &kernel[((y + n - py) % n) * n];
+      for (size_t x = 0; x < n; x++) {
+        energy[y * n + x] += sign * row[(x + n - px) % n];
+      }
+    }
+  };
+  auto tightest_cluster = [&]() {
+    size_t best = 0;
+    float e = -1;
+    for (size_t p = 0; p < count; p++) {
+      if (bits[p] && energy[p] > e) { e = energy[p]; best = p; }
+    }
+    return best;
+  };
+  auto largest_void = [&]() {
+    size_t best = 0;
+    float e = 1e30f;
+    for (size_t p = 0; p < count; p++) {
+      if (!bits[p] && energy[p] < e) { e = energy[p]; best = p; }
+    }
+    return best;
+  };
+
+  // initial pattern: random points, relaxed by moving the point in the
+  // tightest cluster to the largest void until that changes nothing
+  PCG32 rng;
+  size_t ones = count / 10;
+  for (size_t i = 0; i < ones;) {
+    size_t p = rng.next_uint() % count;
+    if (!bits[p]) { set(p, 1); i++; }
+  }
+  for (size_t i = 0; i < count; i++) {
+    size_t c = tightest_cluster();
+    set(c, 0);
+    size_t v = largest_void();
+    set(v, 1);
+    if (v == c) break;
+  }
+  std::vector<char> initialBits = bits;
+  std::vector<float> initialEnergy = energy;
+
+  // rank the initial points by removing the tightest clusters first, then
+  // the rest of the mask by filling the largest voids
+  std::vector<size_t> rank(count);
+  for (size_t r = ones; r-- > 0;) {
+    size_t c = tightest_cluster();
+    set(c, 0);
+    rank[c] = r;
+  }
+  bits = initialBits;
+  energy = initialEnergy;
+  for (size_t r = ones; r < count; r++) {
+    size_t v = largest_void();
+    set(v, 1);
+    rank[v] = r;
+  }
+
+  std::vector<float> mask(count);
+  for (size_t p = 0; p < count; p++) {
+    mask[p] = (rank[p] + 0.5f) / count;
+  }
+  return mask;
+}
+
+static const std::vector<float>& blue_noise_mask() {
+  static const std::vector<float> mask =
+      void_and_cluster(BlueNoiseSampler2D::mask_size);
+  return mask;
+}
+
+Vector2D BlueNoiseSampler2D::get_sample() const {
+  const std::vector<float>& mask = blue_noise_mask();
+  SampleContext& c = sample_context();
+  uint32_t d = c.dimension;
+  c.dimension += 2;
+
+  // every pixel takes the same scrambled Sobol points for a dimension, so
+  // they are well spread over the samples of the pixel, rotated by the mask
+  // read at a toroidal offset of the dimension. Both only depend on the
+  // render seed, so the rotations stay blue over the image.
+  const size_t n = mask_size;
+  uint64_t hx = mix_bits(c.seed + d);
+  uint64_t hy = mix_bits(hx);
+  uint32_t x, y;
+  sobol_2d((uint32_t) c.index, (uint32_t) mix_bits(hy), &x, &y);
+  double u = x * (1.0 / 4294967296.0) +
+             mask[((c.y + (hx >> 32)) % n) * n + (c.x + hx) % n];
+  double v = y * (1.0 / 4294967296.0) +
+             mask[((c.y + (hy >> 32)) % n) * n + (c.x + hy) % n];
+  return Vector2D(u - floor(u), v - floor(v));
+}
+
+Sampler2D* new_sequence_sampler(SampleSequence sequence) {
+  switch (sequence) {
+    case SEQUENCE_SOBOL: return new SobolSampler2D();
+    case SEQUENCE_HALTON: return new HaltonSampler2D();
+    case SEQUENCE_BLUE_NOISE: return new BlueNoiseSampler2D();
+    default: return NULL;
+  }
 }
 
 // Uniform Hemisphere Sampler3D Implementation //
@@ -16,9 +302,10 @@ Vector2D UniformGridSampler2D::get_sample() const {
 // (with uniform probability)
 Vector3D UniformHemisphereSampler3D::get_sample() const {
 
-  double cosTheta = random_uniform();
+  Vector2D u = sample_2d();
+  double cosTheta = u.x;
   double sinTheta = sqrt(1 - cosTheta * cosTheta);
-  double phi = 2.0 * PI * random_uniform();
+  double phi = 2.0 * PI * u.y;
 
   double xs = sinTheta * cosf(phi);
   double ys = sinTheta * sinf(phi);
@@ -34,8 +321,9 @@ Vector3D CosineWeightedHemisphereSampler3D::get_sample() const {
 
 // Samples on a disk and projects up to the hemisphere
 Vector3D CosineWeightedHemisphereSampler3D::get_sample(float *pdf) const {
-  double r = sqrt(random_uniform());
-  double phi = 2 * PI * random_uniform();
+  Vector2D u = sample_2d();
+  double r = sqrt(u.x);
+  double phi = 2 * PI * u.y;
 
   double x = r * cosf(phi);
   double y = r * sinf(phi);
@@ -5,6 +5,8 @@
 #include "CMU462/vector3D.h"
 #include "CMU462/misc.h"
 
+#include <stdint.h>
+
 namespace CMU462 {
 
 /**
@@ -45,7 +47,50 @@ class Sampler3D {
 
 
 /**
- * A Sampler2D implementation with uniform distribution on unit square
+ * Which samples the current camera sample is drawing. Set once per camera
+ * sample on the thread taking it; every draw advances the dimension, so the
+ * pixel, light, BSDF and russian roulette decisions along a path each get
+ * their own dimensions of the sequence.
+ */
+struct SampleContext {
+  size_t x, y;                ///< pixel being sampled
+  size_t index;               ///< index of the sample in the pixel
+  uint64_t seed;              ///< render seed
+  uint64_t scramble;          ///< scrambling seed of the pixel
+  uint32_t dimension;         ///< next dimension to draw
+  const Sampler2D* sequence;  ///< sequence to draw from, NULL for random
+};
+
+/**
+ * The sample context of the calling thread.
+ */
+SampleContext& sample_context();
+
+/**
+ * Start a camera sample on the calling thread. Draws made through
+ * sample_1d, sample_2d and the samplers below come from dimensions of the
+ * given sequence for this pixel and sample index. Also seeds the thread's
+ * random number generator for the sample, which backs all draws when there
+ * is no sequence.
+ * \param sequence low discrepancy sequence to use, or NULL for random
+ * \param seed render seed
+ */
+void start_sample(const Sampler2D* sequence, size_t x, size_t y,
+                  size_t index, uint64_t seed);
+
+/**
+ * Take the next point of the current camera sample in the unit square.
+ */
+Vector2D sample_2d();
+
+/**
+ * Take the next number of the current camera sample in [0, 1).
+ */
+double sample_1d();
+
+/**
+ * A Sampler2D implementation with uniform distribution on unit square.
+ * Draws from the thread's sample sequence if one was started.
  */
 class UniformGridSampler2D : public Sampler2D {
  public:
@@ -54,6 +99,65 @@ class UniformGridSampler2D : public Sampler2D {
 
 }; // class UniformSampler2D
 
+/**
+ * Owen scrambled Sobol sequence (Burley, "Practical Hash-based Owen
+ * Scrambling", 2020). Dimensions are padded pairs of the first two Sobol
+ * dimensions; each pair has its own index shuffle and scramble, so any
+ * number of dimensions can be drawn. Draws from the current sample context.
+ */
+class SobolSampler2D : public Sampler2D {
+ public:
+
+  Vector2D get_sample() const;
+
+}; // class SobolSampler2D
+
+/**
+ * Halton sequence with a prime base per dimension, scrambled with nested
+ * hashed digit permutations per pixel. Dimensions beyond the prime table
+ * fall back to random numbers. Draws from the current sample context.
+ */
+class HaltonSampler2D : public Sampler2D {
+ public:
+
+  Vector2D get_sample() const;
+
+}; // class HaltonSampler2D
+
+/**
+ * Blue noise over the image: the scrambled Sobol points of each dimension,
+ * rotated per pixel by a tiled void-and-cluster rank mask, so neighbour
+ * pixels get well spread values and each pixel's samples stay well spread.
+ * Draws from the current sample context.
+ */
+class BlueNoiseSampler2D : public Sampler2D {
+ public:
+
+  Vector2D get_sample() const;
+
+  /**
+   * Side of the square blue noise mask.
+   */
+  static const size_t mask_size = 64;
+
+}; // class BlueNoiseSampler2D
+
+/**
+ * Sequences the path tracer can draw its samples from.
+ */
+enum SampleSequence {
+  SEQUENCE_RANDOM,
+  SEQUENCE_SOBOL,
+  SEQUENCE_HALTON,
+  SEQUENCE_BLUE_NOISE
+};
+
+/**
+ * Create the sampler for a sequence.
+ * \return the sampler, or NULL for SEQUENCE_RANDOM
+ */
+Sampler2D* new_sequence_sampler(SampleSequence sequence);
+
 /**
  * A Sampler3D implementation with uniform distribution on unit hemisphere
  */
@@ -76,12 +180,6 @@ class CosineWeightedHemisphereSampler3D : public Sampler3D {
 
 }; // class UniformHemisphereSampler3D
 
-
-/**
- * TODO (extra credit) :
- * Jittered sampler implementations
- */
-
 } // namespace CMU462
 
 #endif //CMU462_SAMPLER_H
@@ -38,6 +38,21 @@ class Aggregate : public Primitive {
    */
   BSDF* get_bsdf() const { return NULL; }
 
+  /**
+   * Get the scene object.
+   * Like the BSDF, an aggregate is not part of any scene object, so this
+   * always returns the null pointer.
+   */
+  const SceneObject* get_object() const { return NULL; }
+
+  /**
+   * Deferred hit evaluation.
+   * An aggregate never records itself as the intersected primitive and
+   * finalizes the closest hit of its own intersect, so there is nothing
+   * left to do here.
+   */
+  void finalize_hit(const Ray& r, Intersection* i) const { }
+
 };
 
 
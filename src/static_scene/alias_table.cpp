@@ -4,6 +4,7 @@
 #include <cmath>
 #include <vector>
 #include <utility>
+#include <algorithm>
 
 #include <iostream>
 using std::cout;
@@ -79,10 +80,15 @@ AliasTable::~AliasTable() {
 }
 
 int AliasTable::sample(float *pdf) {
-  double d = random_uniform() * n;
-  int i = (int) d;
+  return sample(random_uniform(), pdf);
+}
+
+int AliasTable::sample(double u, float *pdf) const {
+  double d = u * n;
+  int i = std::min((int) d, n - 1);
   const TableEntry& entry = entries[i];
-  if (d - i <= entry.ratio) {
+  // entries without weight have ratio 0 and must never return themselves
+  if (d - i < entry.ratio) {
     *pdf = entry.firstPmf;
     return i;
   } else {
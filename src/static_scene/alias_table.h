@@ -25,6 +25,17 @@ class AliasTable {
    */
   int sample(float *pdf);
 
+  /**
+   * Same as sample, but draws the number from the given uniform random
+   * number in [0, 1) instead of the global generator.
+   */
+  int sample(double u, float *pdf) const;
+
+  /**
+   * Returns the probability with which sample returns the number i.
+   */
+  float pmf(int i) const { return entries[i].firstPmf; }
+
  private:
   struct TableEntry {
     float firstPmf;
@@ -59,26 +59,58 @@ EnvironmentLight::~EnvironmentLight() {
   delete cellAreas;
 }
 
+// radiance integrated over all directions, crossing the scene's cross
+// section
+Spectrum EnvironmentLight::power(double sceneRadius) const {
+  const size_t w = envMap->w;
+  const size_t h = envMap->h;
+  Spectrum sum;
+  for (size_t y = 0; y < h; y++) {
+    for (size_t x = 0; x < w; x++) {
+      sum += envMap->data[x + y * w] * cellAreas[y];
+    }
+  }
+  return sum * (PI * sceneRadius * sceneRadius);
+}
+
 // We choose samples from among the pixel centers of our environment map; this
 // drastically simplifies sampling and sacrifices little in terms of quality
-// since the environment map is usually quite big.
+// since the environment map is usually quite big. The pdf is the pixel's
+// probability spread over the solid angle of its cell.
 Spectrum EnvironmentLight::sample_L(const Vector3D& p, Vector3D* wi,
                                     float* distToLight,
                                     float* pdf) const {
   size_t w = envMap->w;
   size_t h = envMap->h;
   
-  size_t i = aliasTable->sample(pdf);
+  float pmf;
+  size_t i = aliasTable->sample(&pmf);
   size_t y = i / w;
   size_t x = i % w; 
 
-  float phi = (x + 0.5)/w * (2 * PI);
+  // same longitude as sample_dir looks the pixel up at
+  float phi = ((x + 0.5)/w - 0.5) * (2 * PI);
   float theta = (y + 0.5)/h * PI;
   float sinTheta = sinf(theta);
   Vector3D dir(sinTheta * cosf(phi), cosf(theta), sinTheta * sinf(phi));
   *wi = localToWorld * dir;
   *distToLight = INF_F;
-  return envMap->data[i] * cellAreas[y];
+  *pdf = pmf / cellAreas[y];
+  return envMap->data[i];
+}
+
+// density of the cell the direction falls in
+float EnvironmentLight::pdf_L(const Vector3D& p, const Vector3D& wi,
+                              const Intersection& isect) const {
+  const Vector3D& dir = (worldToLocal * wi).unit();
+  float u = atan2(dir.z, dir.x) / (2 * M_PI) + 0.5f;
+  float v = acos(clamp(dir.y, -1.0, 1.0)) / M_PI;
+
+  const size_t w = envMap->w;
+  const size_t h = envMap->h;
+  size_t x = std::min((size_t) std::max(0.f, u * w), w - 1);
+  size_t y = std::min((size_t) std::max(0.f, v * h), h - 1);
+  return aliasTable->pmf(x + y * w) / cellAreas[y];
 }
 
 // Unlike sample_L, the ray could point at any arbitrary point instead of just
@@ -22,6 +22,9 @@ class EnvironmentLight : public SceneLight {
   }
   bool is_delta_light() const { return false; }
   Spectrum sample_dir(const Ray& r) const;
+  Spectrum power(double sceneRadius) const;
+  float pdf_L(const Vector3D& p, const Vector3D& wi,
+              const Intersection& isect) const;
  
  private:
   const HDRImageBuffer* envMap;
@@ -3,9 +3,21 @@
 #include <iostream>
 
 #include "../sampler.h"
+#include "light_tree.h"
+#include "triangle.h"
 
 namespace CMU462 { namespace StaticScene {
 
+// cosine weighted direction about n, for lights that emit like a diffuse
+// surface
+static Vector3D sample_cosine_dir(const Vector3D& n, float* pdfDir) {
+  CosineWeightedHemisphereSampler3D sampler;
+  Vector3D localD = sampler.get_sample(pdfDir);
+  Matrix3x3 o2w;
+  make_coord_space(o2w, n);
+  return (o2w * localD).unit();
+}
+
 // Directional Light //
 
 DirectionalLight::DirectionalLight(const Spectrum& rad,
@@ -23,6 +35,11 @@ Spectrum DirectionalLight::sample_L(const Vector3D& p, Vector3D* wi,
   return radiance;
 }
 
+// all the light crossing the scene's cross section
+Spectrum DirectionalLight::power(double sceneRadius) const {
+  return radiance * (PI * sceneRadius * sceneRadius);
+}
+
 // Infinite Hemisphere Light //
 
 InfiniteHemisphereLight::InfiniteHemisphereLight(const Spectrum& rad)
@@ -41,6 +58,12 @@ Spectrum InfiniteHemisphereLight::sample_L(const Vector3D& p, Vector3D* wi,
   return radiance;
 }
 
+// radiance integrated over the lit half of the sky, crossing the scene's
+// cross section
+Spectrum InfiniteHemisphereLight::power(double sceneRadius) const {
+  return radiance * (2 * PI * PI * sceneRadius * sceneRadius);
+}
+
 // Point Light //
 
 PointLight::PointLight(const Spectrum& rad, const Vector3D& pos) :
@@ -57,6 +80,21 @@ Spectrum PointLight::sample_L(const Vector3D& p, Vector3D* wi,
   return radiance;
 }
 
+Spectrum PointLight::power(double sceneRadius) const {
+  return radiance * (4 * PI);
+}
+
+// emits in all directions
+bool PointLight::get_bounds(LightBounds* bounds) const {
+  bounds->bounds = BBox(position);
+  bounds->phi = power(0).illum();
+  bounds->w = Vector3D(0, 0, 1);
+  bounds->cosTheta_o = -1;
+  bounds->cosTheta_e = 0;
+  bounds->twoSided = false;
+  return true;
+}
+
 // Spot Light //
 
 SpotLight::SpotLight(const Spectrum& rad, const Vector3D& pos,
@@ -84,11 +122,11 @@ Spectrum AreaLight::sample_L(const Vector3D& p, Vector3D* wi,
                              float* distToLight, float* pdf) const {
   const Vector2D& sample = sampler.get_sample() - Vector2D(0.5f, 0.5f);
   const Vector3D& d = position + sample.x * dim_x + sample.y * dim_y - p;
-  float cosTheta = dot(d, direction);
   float sqDist = d.norm2();
   float dist = sqrt(sqDist);
+  float cosTheta = dot(d, direction) / dist;
   *wi = d / dist;
-  *distToLight = dist;
+  *distToLight = dist - EPS_F;
   *pdf = sqDist / (area * fabs(cosTheta));
   return cosTheta < 0 ? radiance : Spectrum();
 };
@@ -113,12 +151,76 @@ Spectrum AreaLight::sampleLightFromP(const Vector3D& p, Vector3D& onLight, Vecto
  * By Rui.
  * Sample the light. Get the point in the light, and the ray direction.
  **/
+Spectrum AreaLight::sample_point(Vector3D* p, Vector3D* n,
+                                 float* pdfPos) const {
+  const Vector2D& sample = sampler.get_sample() - Vector2D(0.5f, 0.5f);
+  *p = position + sample.x * dim_x + sample.y * dim_y;
+  *n = direction;
+  *pdfPos = 1.0 / area;
+  return radiance;
+}
+
+// cosine weighted about the normal
+Vector3D AreaLight::sample_dir(const Vector3D& n, float* pdfDir) const {
+  return sample_cosine_dir(n, pdfDir);
+}
+
+float AreaLight::pdf_dir(const Vector3D& n, const Vector3D& d) const {
+  return std::max(0.0, dot(n, d)) / PI;
+}
+
+// emits to one side only
+Spectrum AreaLight::power(double sceneRadius) const {
+  return radiance * (PI * area);
+}
+
+// a flat emitter, all normals are the same
+bool AreaLight::get_bounds(LightBounds* bounds) const {
+  bounds->bounds = BBox(position - 0.5 * dim_x - 0.5 * dim_y);
+  bounds->bounds.expand(position + 0.5 * dim_x - 0.5 * dim_y);
+  bounds->bounds.expand(position - 0.5 * dim_x + 0.5 * dim_y);
+  bounds->bounds.expand(position + 0.5 * dim_x + 0.5 * dim_y);
+  bounds->phi = power(0).illum();
+  bounds->w = direction.unit();
+  bounds->cosTheta_o = 1;
+  bounds->cosTheta_e = 0;
+  bounds->twoSided = false;
+  return true;
+}
+
+bool AreaLight::coincides_with(const Mesh* mesh) const {
+  const vector<size_t>& indices = mesh->get_indices();
+  if (indices.empty()) return false;
+
+  double size = dim_x.norm() + dim_y.norm();
+  double eps = 1e-2 * size;
+  Vector3D n = direction.unit();
+
+  // area and area weighted center of the triangles, all in the plane
+  double meshArea = 0;
+  Vector3D center;
+  for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+    const Vector3D& p0 = mesh->positions[indices[i]];
+    const Vector3D& p1 = mesh->positions[indices[i + 1]];
+    const Vector3D& p2 = mesh->positions[indices[i + 2]];
+    if (fabs(dot(p0 - position, n)) > eps ||
+        fabs(dot(p1 - position, n)) > eps ||
+        fabs(dot(p2 - position, n)) > eps) return false;
+    double a = cross(p1 - p0, p2 - p0).norm() / 2;
+    meshArea += a;
+    center += a * (p0 + p1 + p2) / 3;
+  }
+  if (meshArea <= 0) return false;
+  center /= meshArea;
+
+  return fabs(meshArea - area) <= eps * size &&
+         (center - position).norm() <= eps;
+}
+
 Spectrum AreaLight::sampleLight(Ray* lightRay, float* lightPdf) const {
   const Vector2D& sample = sampler.get_sample() - Vector2D(0.5f, 0.5f);
   const Vector3D& d = position + sample.x * dim_x + sample.y * dim_y;
   lightRay->o = d;
-  float theta = ((double) rand() / (RAND_MAX)) * M_PI / 2.0;
-  float phi = ((double) rand() / (RAND_MAX)) * M_PI * 2.0;
 
   UniformHemisphereSampler3D sampler;
   Vector3D localD = sampler.get_sample();
@@ -133,25 +235,254 @@ Spectrum AreaLight::sampleLight(Ray* lightRay, float* lightPdf) const {
 
 // Sphere Light //
 
-SphereLight::SphereLight(const Spectrum& rad, const SphereObject* sphere) {
-
-}
+SphereLight::SphereLight(const Spectrum& rad, const SphereObject* sphere)
+  : sphere(sphere), radiance(rad) { }
 
+/**
+ * Sample the cone of directions the sphere subtends from p uniformly, which
+ * only wastes samples on the part of the sphere hidden behind itself.
+ * From inside the sphere every direction hits it, points are then sampled
+ * uniformly on the surface.
+ **/
 Spectrum SphereLight::sample_L(const Vector3D& p, Vector3D* wi,
                                float* distToLight, float* pdf) const {
+  Vector3D pc = sphere->o - p;
+  double r = sphere->r;
+  double dc2 = pc.norm2();
+
+  if (dc2 <= r * r) {
+    Vector3D q, n;
+    float pdfPos;
+    sample_point(&q, &n, &pdfPos);
+    Vector3D d = q - p;
+    double dist = d.norm();
+    double cosTheta = fabs(dot(n, d)) / dist;
+    if (cosTheta == 0) {
+      *pdf = 0;
+      return Spectrum();
+    }
+    *wi = d / dist;
+    *distToLight = dist - EPS_F;
+    *pdf = dist * dist / (cosTheta * 4 * PI * r * r);
+    return radiance;
+  }
+
+  // cone about the direction to the center, 1 - cos is computed from the
+  // sine so that it does not vanish for small or distant spheres
+  double dc = sqrt(dc2);
+  double sin2ThetaMax = r * r / dc2;
+  double cosThetaMax = sqrt(std::max(0.0, 1 - sin2ThetaMax));
+  double oneMinusCosThetaMax = sin2ThetaMax / (1 + cosThetaMax);
+
+  Vector2D u = sample_2d();
+  double cosTheta = 1 - u.x * oneMinusCosThetaMax;
+  double sin2Theta = std::max(0.0, 1 - cosTheta * cosTheta);
+  double sinTheta = sqrt(sin2Theta);
+  double phi = 2 * PI * u.y;
+
+  Matrix3x3 o2w;
+  make_coord_space(o2w, pc / dc);
+  *wi = (o2w * Vector3D(sinTheta * cos(phi), sinTheta * sin(phi),
+                        cosTheta)).unit();
+
+  // nearer intersection of the sampled direction with the sphere, stopping
+  // short of it so that the shadow ray does not hit the emitter
+  double dist = dc * cosTheta - sqrt(std::max(0.0, r * r - dc2 * sin2Theta));
+  *distToLight = dist - EPS_F;
+  *pdf = 1 / (2 * PI * oneMinusCosThetaMax);
+  return radiance;
+}
 
-  return Spectrum();
+// uniform on the surface, emitting outwards
+Spectrum SphereLight::sample_point(Vector3D* p, Vector3D* n,
+                                   float* pdfPos) const {
+  Vector2D u = sample_2d();
+  double z = 1 - 2 * u.x;
+  double rxy = sqrt(std::max(0.0, 1 - z * z));
+  double phi = 2 * PI * u.y;
+  *n = Vector3D(rxy * cos(phi), rxy * sin(phi), z);
+  *p = sphere->o + sphere->r * *n;
+  *pdfPos = 1 / (4 * PI * sphere->r * sphere->r);
+  return radiance;
+}
+
+Vector3D SphereLight::sample_dir(const Vector3D& n, float* pdfDir) const {
+  return sample_cosine_dir(n, pdfDir);
+}
+
+// the density of the cone sample_L samples from outside, of a uniform point
+// on the surface from inside
+float SphereLight::pdf_L(const Vector3D& p, const Vector3D& wi,
+                         const Intersection& isect) const {
+  double r = sphere->r;
+  double dc2 = (sphere->o - p).norm2();
+  if (dc2 <= r * r) {
+    Vector3D n = (p + wi * isect.t - sphere->o) / r;
+    double cosTheta = fabs(dot(n, wi));
+    if (cosTheta == 0) return 0;
+    return isect.t * isect.t / (cosTheta * 4 * PI * r * r);
+  }
+  double sin2ThetaMax = r * r / dc2;
+  double cosThetaMax = sqrt(std::max(0.0, 1 - sin2ThetaMax));
+  return 1 / (2 * PI * sin2ThetaMax / (1 + cosThetaMax));
+}
+
+float SphereLight::pdf_dir(const Vector3D& n, const Vector3D& d) const {
+  return std::max(0.0, dot(n, d)) / PI;
+}
+
+Spectrum SphereLight::power(double sceneRadius) const {
+  return radiance * (PI * 4 * PI * sphere->r * sphere->r);
+}
+
+// normals in every direction
+bool SphereLight::get_bounds(LightBounds* bounds) const {
+  Vector3D r(sphere->r, sphere->r, sphere->r);
+  bounds->bounds = BBox(sphere->o - r, sphere->o + r);
+  bounds->phi = power(0).illum();
+  bounds->w = Vector3D(0, 0, 1);
+  bounds->cosTheta_o = -1;
+  bounds->cosTheta_e = 0;
+  bounds->twoSided = false;
+  return true;
 }
 
 // Mesh Light
 
-MeshLight::MeshLight(const Spectrum& rad, const Mesh* mesh) {
+MeshLight::MeshLight(const Spectrum& rad, const Mesh* mesh)
+  : mesh(mesh), radiance(rad), area(0) {
+  const vector<size_t>& indices = mesh->get_indices();
+  size_t n = indices.size() / 3;
+  double *areas = new double[n];
+  for (size_t i = 0; i < n; i++) {
+    const Vector3D& p0 = mesh->positions[indices[3 * i]];
+    const Vector3D& p1 = mesh->positions[indices[3 * i + 1]];
+    const Vector3D& p2 = mesh->positions[indices[3 * i + 2]];
+    areas[i] = cross(p1 - p0, p2 - p0).norm() / 2;
+    area += areas[i];
+  }
+  triangles = n ? new AliasTable(areas, n) : NULL;
+  if (!n) delete[] areas;
+}
+
+MeshLight::~MeshLight() {
+  delete triangles;
+}
 
+Vector3D MeshLight::sample_surface(Vector3D* p) const {
+  float pmf;
+  int i = triangles->sample(sample_1d(), &pmf);
+  const vector<size_t>& indices = mesh->get_indices();
+  const Vector3D& p0 = mesh->positions[indices[3 * i]];
+  const Vector3D& p1 = mesh->positions[indices[3 * i + 1]];
+  const Vector3D& p2 = mesh->positions[indices[3 * i + 2]];
+
+  // uniform barycentrics from the square
+  Vector2D u = sample_2d();
+  double su = sqrt(u.x);
+  *p = (1 - su) * p0 + su * (1 - u.y) * p1 + su * u.y * p2;
+  return cross(p1 - p0, p2 - p0).unit();
 }
 
+/**
+ * Picking triangles by area and points uniformly on them samples the whole
+ * surface uniformly. Emissive surfaces emit from both sides, like they are
+ * seen from the camera.
+ **/
 Spectrum MeshLight::sample_L(const Vector3D& p, Vector3D* wi,
                              float* distToLight, float* pdf) const {
-  return Spectrum();
+  if (!triangles || area == 0) {
+    *pdf = 0;
+    return Spectrum();
+  }
+  Vector3D q;
+  Vector3D n = sample_surface(&q);
+  Vector3D d = q - p;
+  double dist = d.norm();
+  double cosTheta = fabs(dot(n, d)) / dist;
+  if (cosTheta == 0) {
+    *pdf = 0;
+    return Spectrum();
+  }
+  *wi = d / dist;
+  *distToLight = dist - EPS_F;
+  *pdf = dist * dist / (cosTheta * area);
+  return radiance;
+}
+
+// uniform density over the surface, seen from p
+float MeshLight::pdf_L(const Vector3D& p, const Vector3D& wi,
+                       const Intersection& isect) const {
+  Vector3D p0, p1, p2;
+  static_cast<const Triangle*>(isect.primitive)->get_vertices(&p0, &p1, &p2);
+  double cosTheta = fabs(dot(cross(p1 - p0, p2 - p0).unit(), wi));
+  if (cosTheta == 0 || area == 0) return 0;
+  return isect.t * isect.t / (cosTheta * area);
+}
+
+// the side to emit to is picked with the point, so that light subpaths
+// leave from both sides
+Spectrum MeshLight::sample_point(Vector3D* p, Vector3D* n,
+                                 float* pdfPos) const {
+  if (!triangles || area == 0) {
+    *pdfPos = 0;
+    return Spectrum();
+  }
+  *n = sample_surface(p);
+  if (sample_1d() < 0.5) *n = -*n;
+  *pdfPos = 1 / (2 * area);
+  return radiance;
+}
+
+Vector3D MeshLight::sample_dir(const Vector3D& n, float* pdfDir) const {
+  return sample_cosine_dir(n, pdfDir);
+}
+
+float MeshLight::pdf_dir(const Vector3D& n, const Vector3D& d) const {
+  return std::max(0.0, dot(n, d)) / PI;
+}
+
+// emits to both sides
+Spectrum MeshLight::power(double sceneRadius) const {
+  return radiance * (2 * PI * area);
+}
+
+// the normals are bounded about their area weighted mean, each turned to
+// the side of the first one since both sides emit
+bool MeshLight::get_bounds(LightBounds* bounds) const {
+  const vector<size_t>& indices = mesh->get_indices();
+  size_t n = indices.size() / 3;
+  if (n == 0) return false;
+
+  vector<Vector3D> normals(n);
+  BBox bbox;
+  Vector3D w;
+  for (size_t i = 0; i < n; i++) {
+    const Vector3D& p0 = mesh->positions[indices[3 * i]];
+    const Vector3D& p1 = mesh->positions[indices[3 * i + 1]];
+    const Vector3D& p2 = mesh->positions[indices[3 * i + 2]];
+    bbox.expand(p0);
+    bbox.expand(p1);
+    bbox.expand(p2);
+    normals[i] = cross(p1 - p0, p2 - p0);
+    w += dot(normals[i], normals[0]) < 0 ? -normals[i] : normals[i];
+  }
+  if (w.norm2() == 0) w = Vector3D(0, 0, 1);
+  w.normalize();
+
+  double cosTheta_o = 1;
+  for (size_t i = 0; i < n; i++) {
+    if (normals[i].norm2() > 0)
+      cosTheta_o = std::min(cosTheta_o, fabs(dot(w, normals[i].unit())));
+  }
+
+  bounds->bounds = bbox;
+  bounds->phi = power(0).illum();
+  bounds->w = w;
+  bounds->cosTheta_o = cosTheta_o;
+  bounds->cosTheta_e = 0;
+  bounds->twoSided = true;
+  return true;
 }
 
 } // namespace StaticScene
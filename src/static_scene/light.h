@@ -9,6 +9,7 @@
 
 #include "scene.h"  // SceneLight
 #include "object.h" // Mesh, SphereObject
+#include "alias_table.h"
 
 namespace CMU462 { namespace StaticScene {
 
@@ -19,6 +20,7 @@ class DirectionalLight : public SceneLight {
   DirectionalLight(const Spectrum& rad, const Vector3D& lightDir);
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
                     float* pdf) const;
+  Spectrum power(double sceneRadius) const;
   Spectrum sampleLight(Ray* lightRay, float* lightPdf) const {
     return Spectrum();
   }
@@ -40,6 +42,7 @@ class InfiniteHemisphereLight : public SceneLight {
   InfiniteHemisphereLight(const Spectrum& rad);
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
                     float* pdf) const;
+  Spectrum power(double sceneRadius) const;
   Spectrum sampleLight(Ray* lightRay, float* lightPdf) const {
     return Spectrum();
   }
@@ -63,6 +66,8 @@ class PointLight : public SceneLight {
   PointLight(const Spectrum& rad, const Vector3D& pos);
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
                     float* pdf) const;
+  Spectrum power(double sceneRadius) const;
+  bool get_bounds(LightBounds* bounds) const;
   Spectrum sampleLight(Ray* lightRay, float* lightPdf) const {
     return Spectrum();
   }
@@ -113,6 +118,19 @@ class AreaLight : public SceneLight {
   Spectrum sampleLight(Ray* lightRay, float* lightPdf) const;
   Spectrum sampleLightFromP(const Vector3D& p, Vector3D& onLight, Vector3D& wi) const;
   bool is_delta_light() const { return false; }
+  Spectrum sample_point(Vector3D* p, Vector3D* n, float* pdfPos) const;
+  Vector3D sample_dir(const Vector3D& n, float* pdfDir) const;
+  float pdf_dir(const Vector3D& n, const Vector3D& d) const;
+  Spectrum power(double sceneRadius) const;
+  bool get_bounds(LightBounds* bounds) const;
+
+  /**
+   * Whether the mesh lies in the light's plane and covers as much of it
+   * about the same center, like the quads scenes put where the light is to
+   * make it visible. Their sides need not follow the light's, the Cornell
+   * boxes' quads are turned by 90 degrees.
+   */
+  bool coincides_with(const Mesh* mesh) const;
     Vector3D direction;
 
  private:
@@ -139,11 +157,18 @@ class SphereLight : public SceneLight {
     return Spectrum();
   }
   bool is_delta_light() const { return false; }
+  Spectrum sample_point(Vector3D* p, Vector3D* n, float* pdfPos) const;
+  Vector3D sample_dir(const Vector3D& n, float* pdfDir) const;
+  float pdf_dir(const Vector3D& n, const Vector3D& d) const;
+  Spectrum power(double sceneRadius) const;
+  bool get_bounds(LightBounds* bounds) const;
+  const SceneObject* get_object() const { return sphere; }
+  float pdf_L(const Vector3D& p, const Vector3D& wi,
+              const Intersection& isect) const;
 
  private:
   const SphereObject* sphere;
   Spectrum radiance;
-  UniformHemisphereSampler3D sampler;
 
 }; // class SphereLight
 
@@ -152,6 +177,7 @@ class SphereLight : public SceneLight {
 class MeshLight : public SceneLight {
  public:
   MeshLight(const Spectrum& rad, const Mesh* mesh);
+  ~MeshLight();
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
                     float* pdf) const;
   Spectrum sampleLight(Ray* lightRay, float* lightPdf) const {
@@ -161,10 +187,28 @@ class MeshLight : public SceneLight {
     return Spectrum();
   }
   bool is_delta_light() const { return false; }
+  Spectrum sample_point(Vector3D* p, Vector3D* n, float* pdfPos) const;
+  Vector3D sample_dir(const Vector3D& n, float* pdfDir) const;
+  float pdf_dir(const Vector3D& n, const Vector3D& d) const;
+  Spectrum power(double sceneRadius) const;
+  bool get_bounds(LightBounds* bounds) const;
+  const SceneObject* get_object() const { return mesh; }
+  float pdf_L(const Vector3D& p, const Vector3D& wi,
+              const Intersection& isect) const;
 
  private:
+
+  /**
+   * Pick a triangle by area and a uniform point on it.
+   * \param p the point
+   * \return geometric normal of the picked triangle
+   */
+  Vector3D sample_surface(Vector3D* p) const;
+
   const Mesh* mesh;
   Spectrum radiance;
+  AliasTable* triangles;  ///< picks triangles in proportion to their area
+  double area;            ///< total area of the triangles
 
 }; // class MeshLight
 
@@ -0,0 +1,335 @@
+#include "light_tree.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include "CMU462/CMU462.h"
+
+using std::vector;
+using std::pair;
+
+namespace CMU462 { namespace StaticScene {
+
+// number of candidate splits along each axis when building the tree
+static const size_t kNumBuckets = 12;
+
+// below this depth nodes are split in the middle, so that the path to
+// every leaf fits in its 64 bit trail
+static const int kMaxCostDepth = 32;
+
+// largest double below 1, random numbers are rescaled at every level
+static const double kOneMinusEpsilon = 0x1.fffffffffffffp-1;
+
+static double safe_sqrt(double x) {
+  return sqrt(std::max(0.0, x));
+}
+
+static double safe_acos(double x) {
+  return acos(clamp(x, -1.0, 1.0));
+}
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines
+static double cos_sub_clamped(double sin_a, double cos_a,
+                              double sin_b, double cos_b) {
+  if (cos_a > cos_b) return 1;
+  return cos_a * cos_b + sin_a * sin_b;
+}
+
+static double sin_sub_clamped(double sin_a, double cos_a,
+                              double sin_b, double cos_b) {
+  if (cos_a > cos_b) return 0;
+  return sin_a * cos_b - cos_a * sin_b;
+}
+
+double LightBounds::importance(const Vector3D& p, const Vector3D& n) const {
+
+  // distance to the center, clamped so that points inside the bounds are
+  // not favoured without limit
+  Vector3D pc = p - bounds.centroid();
+  double dc2 = pc.norm2();
+  double r2 = bounds.extent.norm2() / 4;
+  double d2 = std::max(dc2, sqrt(r2));
+
+  // at the center there is no direction to p, it is inside the bounds and
+  // any of them may light it; a point light at p cannot
+  if (dc2 == 0) return d2 > 0 ? phi / d2 : 0;
+
+  // angle between the axis and the direction to p
+  Vector3D wi = pc / sqrt(dc2);
+  double cosTheta_w = dot(w, wi);
+  if (twoSided) cosTheta_w = fabs(cosTheta_w);
+  double sinTheta_w = safe_sqrt(1 - cosTheta_w * cosTheta_w);
+
+  // angle the bounds subtend seen from p, everything if p is inside
+  double cosTheta_b = dc2 < r2 ? -1 : safe_sqrt(1 - r2 / dc2);
+  double sinTheta_b = safe_sqrt(1 - cosTheta_b * cosTheta_b);
+
+  // smallest angle between p and any emission normal, less the subtended
+  // angle, has to be within the angle of emission
+  double sinTheta_o = safe_sqrt(1 - cosTheta_o * cosTheta_o);
+  double cosTheta_x = cos_sub_clamped(sinTheta_w, cosTheta_w,
+                                      sinTheta_o, cosTheta_o);
+  double sinTheta_x = sin_sub_clamped(sinTheta_w, cosTheta_w,
+                                      sinTheta_o, cosTheta_o);
+  double cosThetap = cos_sub_clamped(sinTheta_x, cosTheta_x,
+                                     sinTheta_b, cosTheta_b);
+  if (cosThetap <= cosTheta_e) return 0;
+
+  double result = phi * cosThetap / d2;
+
+  // the light arrives at most at the incidence angle of the closest point
+  if (n.norm2() > 0) {
+    double cosTheta_i = fabs(dot(wi, n));
+    double sinTheta_i = safe_sqrt(1 - cosTheta_i * cosTheta_i);
+    result *= cos_sub_clamped(sinTheta_i, cosTheta_i,
+                              sinTheta_b, cosTheta_b);
+  }
+  return std::max(result, 0.0);
+}
+
+LightBounds LightBounds::merge(const LightBounds& a, const LightBounds& b) {
+  if (a.phi == 0) return b;
+  if (b.phi == 0) return a;
+
+  LightBounds m;
+  m.bounds = a.bounds;
+  m.bounds.expand(b.bounds);
+  m.phi = a.phi + b.phi;
+  m.cosTheta_e = std::min(a.cosTheta_e, b.cosTheta_e);
+  m.twoSided = a.twoSided || b.twoSided;
+
+  // smallest cone around both cones of normals
+  double theta_a = safe_acos(a.cosTheta_o);
+  double theta_b = safe_acos(b.cosTheta_o);
+  double theta_d = safe_acos(dot(a.w, b.w));
+  if (std::min(theta_d + theta_b, PI) <= theta_a) {
+    m.w = a.w;
+    m.cosTheta_o = a.cosTheta_o;
+  } else if (std::min(theta_d + theta_a, PI) <= theta_b) {
+    m.w = b.w;
+    m.cosTheta_o = b.cosTheta_o;
+  } else {
+    double theta_o = (theta_a + theta_d + theta_b) / 2;
+    Vector3D wr = cross(a.w, b.w);
+    if (theta_o >= PI || wr.norm2() == 0) {
+      m.w = a.w;
+      m.cosTheta_o = -1;
+    } else {
+      // rotate a's axis toward b's about their common normal
+      double theta_r = theta_o - theta_a;
+      Vector3D k = wr.unit();
+      m.w = (a.w * cos(theta_r) + cross(k, a.w) * sin(theta_r)).unit();
+      m.cosTheta_o = cos(theta_o);
+    }
+  }
+  return m;
+}
+
+/**
+ * Cost of a node in the split heuristic: its power times the solid angle
+ * measure of its emission times its surface area, stretched for nodes
+ * that are thin along the split axis.
+ */
+static double split_cost(const LightBounds& b, const BBox& node, int dim) {
+  double theta_o = safe_acos(b.cosTheta_o);
+  double theta_e = safe_acos(b.cosTheta_e);
+  double theta_w = std::min(theta_o + theta_e, PI);
+  double sinTheta_o = safe_sqrt(1 - b.cosTheta_o * b.cosTheta_o);
+  double m_omega = 2 * PI * (1 - b.cosTheta_o) +
+                   PI / 2 * (2 * theta_w * sinTheta_o -
+                             cos(theta_o - 2 * theta_w) -
+                             2 * theta_o * sinTheta_o + b.cosTheta_o);
+  const Vector3D& e = node.extent;
+  double kr = std::max(e.x, std::max(e.y, e.z)) / e[dim];
+  return b.phi * m_omega * kr * b.bounds.surface_area();
+}
+
+LightTree::LightTree(const vector<SceneLight*>& lights, const double* power) {
+
+  vector<pair<int, LightBounds> > bounded;
+  for (size_t i = 0; i < lights.size(); i++) {
+    SceneLight* light = lights[i];
+    if (power[i] <= 0) continue;
+    LightBounds b;
+    if (!light->get_bounds(&b)) {
+      infiniteLights.push_back(light);
+      continue;
+    }
+    b.phi = power[i];
+    bounded.push_back(std::make_pair((int) boundedLights.size(), b));
+    boundedLights.push_back(light);
+  }
+
+  if (!bounded.empty()) build(bounded, 0, bounded.size(), 0, 0);
+}
+
+void LightTree::build(vector<pair<int, LightBounds> >& lights,
+                      size_t start, size_t end, int depth, uint64_t trail) {
+
+  if (end - start == 1) {
+    Node leaf;
+    leaf.bounds = lights[start].second;
+    leaf.light = lights[start].first;
+    leaf.second = 0;
+    nodes.push_back(leaf);
+    trails[boundedLights[leaf.light]] = trail;
+    return;
+  }
+
+  BBox bounds, centroids;
+  for (size_t i = start; i < end; i++) {
+    bounds.expand(lights[i].second.bounds);
+    centroids.expand(lights[i].second.bounds.centroid());
+  }
+
+  // find the cheapest split between buckets along any axis
+  double minCost = INF_D;
+  int minDim = -1;
+  size_t minBucket = 0;
+  for (int dim = 0; dim < 3 && depth < kMaxCostDepth; dim++) {
+    if (centroids.extent[dim] <= 0) continue;
+
+    LightBounds buckets[kNumBuckets];
+    for (size_t b = 0; b < kNumBuckets; b++) buckets[b].phi = 0;
+    for (size_t i = start; i < end; i++) {
+      const LightBounds& lb = lights[i].second;
+      double d = (lb.bounds.centroid()[dim] - centroids.min[dim]) /
+                 centroids.extent[dim];
+      size_t b = std::min((size_t) (d * kNumBuckets), kNumBuckets - 1);
+      buckets[b] = LightBounds::merge(buckets[b], lb);
+    }
+
+    for (size_t split = 1; split < kNumBuckets; split++) {
+      LightBounds below, above;
+      below.phi = above.phi = 0;
+      for (size_t b = 0; b < split; b++) {
+        below = LightBounds::merge(below, buckets[b]);
+      }
+      for (size_t b = split; b < kNumBuckets; b++) {
+        above = LightBounds::merge(above, buckets[b]);
+      }
+      if (below.phi == 0 || above.phi == 0) continue;
+      double cost = split_cost(below, bounds, dim) +
+                    split_cost(above, bounds, dim);
+      if (cost < minCost) {
+        minCost = cost;
+        minDim = dim;
+        minBucket = split;
+      }
+    }
+  }
+
+  // partition at the split, or in the middle if there is none
+  size_t mid = start + (end - start) / 2;
+  if (minDim >= 0) {
+    int dim = minDim;
+    pair<int, LightBounds>* m = std::partition(
+        &lights[start], &lights[end - 1] + 1,
+        [&](const pair<int, LightBounds>& l) {
+          double d = (l.second.bounds.centroid()[dim] - centroids.min[dim]) /
+                     centroids.extent[dim];
+          return std::min((size_t) (d * kNumBuckets), kNumBuckets - 1) <
+                 minBucket;
+        });
+    mid = m - &lights[0];
+    if (mid == start || mid == end) mid = start + (end - start) / 2;
+  }
+
+  size_t index = nodes.size();
+  nodes.push_back(Node());
+  build(lights, start, mid, depth + 1, trail);
+  nodes[index].second = nodes.size();
+  build(lights, mid, end, depth + 1, trail | ((uint64_t) 1 << depth));
+
+  nodes[index].bounds = LightBounds::merge(nodes[index + 1].bounds,
+                                           nodes[nodes[index].second].bounds);
+  nodes[index].light = -1;
+}
+
+double LightTree::bounded_probability() const {
+  if (nodes.empty()) return 0;
+  return 1.0 / (infiniteLights.size() + 1);
+}
+
+SceneLight* LightTree::sample(const Vector3D& p, const Vector3D& n, double u,
+                              float* pmf) const {
+
+  // lights without bounds get an equal share with the whole tree
+  double pBounded = bounded_probability();
+  if (u >= pBounded) {
+    size_t count = infiniteLights.size();
+    if (count == 0) {
+      *pmf = 0;
+      return NULL;
+    }
+    u = (u - pBounded) / (1 - pBounded);
+    *pmf = (1 - pBounded) / count;
+    return infiniteLights[std::min((size_t) (u * count), count - 1)];
+  }
+  u = std::min(u / pBounded, kOneMinusEpsilon);
+
+  // walk down choosing children by importance, reusing the random number
+  double prob = pBounded;
+  size_t i = 0;
+  while (nodes[i].light < 0) {
+    double c0 = nodes[i + 1].bounds.importance(p, n);
+    double c1 = nodes[nodes[i].second].bounds.importance(p, n);
+    if (c0 == 0 && c1 == 0) {
+      *pmf = 0;
+      return NULL;
+    }
+    double p0 = c0 / (c0 + c1);
+    if (u < p0) {
+      u = std::min(u / p0, kOneMinusEpsilon);
+      prob *= p0;
+      i = i + 1;
+    } else {
+      u = std::min((u - p0) / (1 - p0), kOneMinusEpsilon);
+      prob *= 1 - p0;
+      i = nodes[i].second;
+    }
+  }
+
+  // a single light in the tree has not been checked yet
+  if (i == 0 && nodes[0].bounds.importance(p, n) == 0) {
+    *pmf = 0;
+    return NULL;
+  }
+  *pmf = prob;
+  return boundedLights[nodes[i].light];
+}
+
+float LightTree::pmf(const Vector3D& p, const Vector3D& n,
+                     const SceneLight* light) const {
+
+  double pBounded = bounded_probability();
+  auto it = trails.find(light);
+  if (it == trails.end()) {
+    if (std::find(infiniteLights.begin(), infiniteLights.end(), light) ==
+        infiniteLights.end()) return 0;
+    return (1 - pBounded) / infiniteLights.size();
+  }
+
+  // follow the light's trail down from the root
+  uint64_t trail = it->second;
+  double prob = pBounded;
+  size_t i = 0;
+  while (nodes[i].light < 0) {
+    double c0 = nodes[i + 1].bounds.importance(p, n);
+    double c1 = nodes[nodes[i].second].bounds.importance(p, n);
+    if (c0 == 0 && c1 == 0) return 0;
+    if (trail & 1) {
+      prob *= c1 / (c0 + c1);
+      i = nodes[i].second;
+    } else {
+      prob *= c0 / (c0 + c1);
+      i = i + 1;
+    }
+    trail >>= 1;
+  }
+  if (i == 0 && nodes[0].bounds.importance(p, n) == 0) return 0;
+  return prob;
+}
+
+} // namespace StaticScene
+} // namespace CMU462
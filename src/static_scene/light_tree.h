@@ -0,0 +1,108 @@
+#ifndef CMU462_STATICSCENE_LIGHTTREE_H
+#define CMU462_STATICSCENE_LIGHTTREE_H
+
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+
+#include "CMU462/vector3D.h"
+#include "../bbox.h"
+#include "scene.h"
+
+namespace CMU462 { namespace StaticScene {
+
+/**
+ * Bounds of the emission of a light or a group of lights: where the
+ * emitting points are, how much power they emit and in which directions.
+ * Each point emits within cosTheta_e of its normal, and the normals lie
+ * within cosTheta_o of the axis w.
+ */
+struct LightBounds {
+  BBox bounds;       ///< bounds of the emitting points
+  double phi;        ///< emitted power
+  Vector3D w;        ///< axis of the cone of emission normals
+  double cosTheta_o; ///< cosine of the spread of the normals about w
+  double cosTheta_e; ///< cosine of the angle of emission about a normal
+  bool twoSided;     ///< emits to both sides of the normals
+
+  /**
+   * Upper bound of how much the lights contribute to a point, up to a
+   * common factor. Zero only if they cannot light the point at all.
+   * \param p the point
+   * \param n unit normal at p, or the zero vector for a point in a medium
+   */
+  double importance(const Vector3D& p, const Vector3D& n) const;
+
+  /**
+   * Bounds of the emission of both groups of lights.
+   */
+  static LightBounds merge(const LightBounds& a, const LightBounds& b);
+};
+
+/**
+ * Picks lights in proportion to an estimate of their contribution to a
+ * shading point, after Conty and Kulla, "Importance Sampling of Many
+ * Lights with Adaptive Tree Splitting" (2018). Lights with bounds are kept
+ * in a binary tree whose nodes bound their lights' emission; a pick walks
+ * down the tree choosing children by their importance to the point.
+ * Lights without bounds, like those at infinity, are picked uniformly.
+ */
+class LightTree {
+ public:
+
+  /**
+   * Build a tree of the lights that emit anything.
+   * \param power power of each light, the same weights other light
+   *        pickers use, so that all of them agree on which lights emit
+   */
+  LightTree(const std::vector<SceneLight*>& lights, const double* power);
+
+  /**
+   * Pick a light for a shading point.
+   * \param p the shading point
+   * \param n normal at p
+   * \param u uniform random number in [0, 1)
+   * \param pmf probability of picking the returned light
+   * \return the picked light, NULL if no light can reach p
+   */
+  SceneLight* sample(const Vector3D& p, const Vector3D& n, double u,
+                     float* pmf) const;
+
+  /**
+   * Probability with which sample picks the given light for a point.
+   */
+  float pmf(const Vector3D& p, const Vector3D& n,
+            const SceneLight* light) const;
+
+ private:
+
+  struct Node {
+    LightBounds bounds; ///< bounds of the lights below the node
+    int light;          ///< light of a leaf, -1 for interior nodes
+    size_t second;      ///< second child, the first one follows the node
+  };
+
+  /**
+   * Build the subtree of lights [start, end) into nodes.
+   * \param trail branches taken from the root, one bit per level
+   */
+  void build(std::vector<std::pair<int, LightBounds> >& lights,
+             size_t start, size_t end, int depth, uint64_t trail);
+
+  /**
+   * Probability of picking one of the bounded lights rather than a light
+   * without bounds.
+   */
+  double bounded_probability() const;
+
+  std::vector<Node> nodes;                  ///< depth first, root first
+  std::vector<SceneLight*> boundedLights;   ///< lights in the tree
+  std::vector<SceneLight*> infiniteLights;  ///< lights without bounds
+  std::unordered_map<const SceneLight*, uint64_t> trails; ///< leaf of a light
+
+};
+
+} // namespace StaticScene
+} // namespace CMU462
+
+#endif // CMU462_STATICSCENE_LIGHTTREE_H
@@ -33,6 +33,12 @@ class Mesh : public SceneObject {
    */
   BSDF* get_bsdf() const;
 
+  /**
+   * Get the vertex indices of the triangles, three per triangle.
+   * \return indices into the mesh's attribute arrays
+   */
+  const vector<size_t>& get_indices() const { return indices; }
+
   Vector3D *positions;  ///< position array
   Vector3D *normals;    ///< normal array
 
@@ -6,6 +6,8 @@
 
 namespace CMU462 { namespace StaticScene {
 
+class SceneObject;
+
 /**
  * The abstract base class primitive is the bridge between geometry processing
  * and the shading subsystem. As such, its interface contains methods related
@@ -42,6 +44,16 @@ class Primitive {
    */
   virtual bool intersect(const Ray& r, Intersection* i) const = 0;
 
+  /**
+   * Deferred hit evaluation.
+   * intersect only records the time of intersection, the primitive and the
+   * barycentric coordinates of the hit. Once the closest hit along the ray
+   * is known, this computes the shading data (normal and BSDF) for it.
+   * \param r ray that produced the intersection
+   * \param i intersection recorded by this primitive's intersect
+   */
+  virtual void finalize_hit(const Ray& r, Intersection* i) const = 0;
+
   /**
    * Get BSDF.
    * Return the BSDF of the surface material of the primitive.
@@ -50,6 +62,11 @@ class Primitive {
    */
   virtual BSDF* get_bsdf() const = 0;
 
+  /**
+   * Get the scene object the primitive is a part of.
+   */
+  virtual const SceneObject* get_object() const = 0;
+
   /**
    * Draw with OpenGL (for visualization)
    * \param c desired highlight color
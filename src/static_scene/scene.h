@@ -8,6 +8,8 @@
 
 namespace CMU462 { namespace StaticScene {
 
+struct LightBounds;
+
 /**
  * Interface for objects in the scene.
  */
@@ -34,12 +36,86 @@ class SceneObject {
  */
 class SceneLight {
  public:
+  virtual ~SceneLight() { }
+
   virtual Spectrum sample_L(const Vector3D& p, Vector3D* wi,
                             float* distToLight, float* pdf) const = 0;
   virtual Spectrum sampleLight(Ray* lightRay, float* lightPdf) const  = 0;
   virtual Spectrum sampleLightFromP(const Vector3D& p, Vector3D& onLight, Vector3D& wi) const  = 0;
   virtual bool is_delta_light() const = 0;
 
+  /**
+   * Sample a point on the light by area, for the light end of BDPT paths.
+   * Lights without area return black with a zero pdf.
+   * \param p sampled point
+   * \param n normal of the light at p, the side it emits to
+   * \param pdfPos area density of p
+   * \return radiance emitted from p to the side of n
+   */
+  virtual Spectrum sample_point(Vector3D* p, Vector3D* n, float* pdfPos) const {
+    *pdfPos = 0;
+    return Spectrum();
+  }
+
+  /**
+   * Sample a direction of emission from a point of the light.
+   * \param n normal of the light at the point
+   * \param pdfDir solid angle density of the direction
+   */
+  virtual Vector3D sample_dir(const Vector3D& n, float* pdfDir) const {
+    *pdfDir = 0;
+    return n;
+  }
+
+  /**
+   * Solid angle density with which sample_dir emits in direction d.
+   */
+  virtual float pdf_dir(const Vector3D& n, const Vector3D& d) const {
+    return 0;
+  }
+
+  /**
+   * Estimate of the total power the light emits into the scene, used to
+   * pick lights in proportion to their contribution. Lights that emit
+   * nothing keep the default and are never picked.
+   * \param sceneRadius radius of a sphere bounding the scene, for lights
+   *        at infinity
+   */
+  virtual Spectrum power(double sceneRadius) const {
+    return Spectrum();
+  }
+
+  /**
+   * Bounds of where the light emits from and in which directions, for the
+   * light tree. Lights at infinity keep the default and have none.
+   * \param bounds the bounds, if the light has any
+   * \return false if the light cannot be bounded
+   */
+  virtual bool get_bounds(LightBounds* bounds) const {
+    return false;
+  }
+
+  /**
+   * The object whose surface emits the light, for lights of emissive
+   * objects. Rays that hit the object have found the light.
+   */
+  virtual const SceneObject* get_object() const {
+    return NULL;
+  }
+
+  /**
+   * Solid angle density with which sample_L picks the direction of a ray
+   * that found the light, to weight it against light samples.
+   * \param p origin of the ray
+   * \param wi unit direction of the ray
+   * \param isect the hit on the light's object, unused for lights at
+   *        infinity
+   */
+  virtual float pdf_L(const Vector3D& p, const Vector3D& wi,
+                      const Intersection& isect) const {
+    return 0;
+  }
+
 };
 
 
@@ -56,26 +132,10 @@ struct Scene {
   //  primitives depend on them (e.g. Mesh Triangles).
   std::vector<SceneObject*> objects;
 
-  // for sake of consistency of the scene object Interface
+  // for sake of consistency of the scene object Interface, objects with
+  //  emission BSDFs have their lights in here too.
   std::vector<SceneLight*> lights;
 
-  // TODO (sky) :
-  // Adding object with emission BSDFs as mesh lights and sphere lights so 
-  // that light sampling configurations also applies to mesh lights. 
-//  for (SceneObject *obj : objects) {
-//    if (obj->get_material().emit != Spectrum()) {
-//      
-//      // mesh light
-//      if (dynamic_cast<Mesh*>(obj)) {
-//        staticLights.push_back()
-//      }
-//      
-//      // sphere light
-//      if (dynamic_cast<Sphere*>(obj)) {
-//
-//      }
-//  }
-
 };
 
 } // namespace StaticScene
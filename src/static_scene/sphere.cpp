@@ -3,7 +3,9 @@
 #include <cmath>
 
 #include "../bsdf.h"
+#ifndef DISABLE_GL
 #include "../misc/sphere_drawing.h"
+#endif
 
 namespace CMU462 { namespace StaticScene {
 
@@ -30,14 +32,17 @@ bool Sphere::intersect(const Ray& r, Intersection *isect) const {
 
     r.max_t = t;
     isect->t = t;
-    isect->n = normal(r.o + r.d * t);
     isect->primitive = this;
-    isect->bsdf = object->get_bsdf();
     return true;
   }
   return false;
 }
 
+void Sphere::finalize_hit(const Ray& r, Intersection *isect) const {
+  isect->n = normal(r.o + r.d * isect->t);
+  isect->bsdf = object->get_bsdf();
+}
+
 bool Sphere::test(const Ray& r, double& t1, double& t2) const {
 
   Vector3D s = o - r.o;
@@ -59,7 +64,9 @@ bool Sphere::test(const Ray& r, double& t1, double& t2) const {
 }
 
 void Sphere::draw(const Color& c) const {
+#ifndef DISABLE_GL
   Misc::draw_sphere_opengl(o, r, c);
+#endif
 }
 
 void Sphere::drawOutline(const Color& c) const {
@@ -44,8 +44,8 @@ class Sphere : public Primitive {
   /**
    * Ray - Sphere intersection 2.
    * Check if the given ray intersects with the sphere, if so, the input
-   * intersection data is updated to contain intersection information for the
-   * point of intersection.
+   * intersection data is updated with the time of intersection and the
+   * primitive. Shading data is left to finalize_hit.
    * \param r ray to test intersection with
    * \param i address to store intersection info
    * \return true if the given ray intersects with the sphere,
@@ -53,6 +53,13 @@ class Sphere : public Primitive {
    */
   bool intersect(const Ray& r, Intersection* i) const;
 
+  /**
+   * Compute the shading normal and BSDF for a hit on this sphere.
+   * \param r ray that produced the intersection
+   * \param i intersection recorded by intersect
+   */
+  void finalize_hit(const Ray& r, Intersection* i) const;
+
   /**
    * Get BSDF.
    * In the case of a sphere, the surface material BSDF is stored in 
@@ -60,6 +67,11 @@ class Sphere : public Primitive {
    */
   BSDF* get_bsdf() const { return object->get_bsdf(); }
 
+  /**
+   * Get the scene object, the sphere object wrapper.
+   */
+  const SceneObject* get_object() const { return object; }
+
   /**
    * Compute the normal at a point of intersection.
    * NOTE (sky): This is required for all scene objects but we only need it
@@ -1,7 +1,9 @@
 #include "triangle.h"
 
 #include "CMU462/CMU462.h"
+#ifndef DISABLE_GL
 #include "GL/glew.h"
+#endif
 
 namespace CMU462 { namespace StaticScene {
 
@@ -63,36 +65,43 @@ bool Triangle::intersect(const Ray& r) const {
 bool Triangle::intersect(const Ray& r, Intersection *isect) const {
 
   double alpha, beta, gamma, t;
-  Vector3D a = mesh->positions[v1];
-  Vector3D b = mesh->positions[v2];
-  Vector3D c = mesh->positions[v3];
+  const Vector3D& a = mesh->positions[v1];
+  const Vector3D& b = mesh->positions[v2];
+  const Vector3D& c = mesh->positions[v3];
 
   if (intersect_triangle(r, a, b, c, alpha, beta, gamma, t)) {
 
-    // interpolate normal
-    Vector3D n = alpha * mesh->normals[v1] +
-        beta  * mesh->normals[v2] +
-        gamma * mesh->normals[v3];
-
     r.max_t = t;
     isect->t = t;
-
-    // if we hixt the back of a triangle, we want to flip the normal so
-    // the shading normal is pointing toward the incoming ray
-    if (dot(n, r.d) > 0)
-        isect->n = -n;
-    else
-        isect->n = n;
-
     isect->primitive = this;
-    isect->bsdf = mesh->get_bsdf();
+    isect->b1 = beta;
+    isect->b2 = gamma;
 
     return true;
   }
   return false;
 }
 
+void Triangle::finalize_hit(const Ray& r, Intersection *isect) const {
+
+  // interpolate normal
+  double alpha = 1.0 - isect->b1 - isect->b2;
+  Vector3D n = alpha * mesh->normals[v1] +
+      isect->b1 * mesh->normals[v2] +
+      isect->b2 * mesh->normals[v3];
+
+  // if we hixt the back of a triangle, we want to flip the normal so
+  // the shading normal is pointing toward the incoming ray
+  if (dot(n, r.d) > 0)
+      isect->n = -n;
+  else
+      isect->n = n;
+
+  isect->bsdf = mesh->get_bsdf();
+}
+
 void Triangle::draw(const Color& c) const {
+#ifndef DISABLE_GL
   glColor4f(c.r, c.g, c.b, c.a);
   glBegin(GL_TRIANGLES);
   glVertex3d(mesh->positions[v1].x,
@@ -105,9 +114,11 @@ void Triangle::draw(const Color& c) const {
              mesh->positions[v3].y,
              mesh->positions[v3].z);
   glEnd();
+#endif
 }
 
 void Triangle::drawOutline(const Color& c) const {
+#ifndef DISABLE_GL
   glColor4f(c.r, c.g, c.b, c.a);
   glBegin(GL_LINE_LOOP);
   glVertex3d(mesh->positions[v1].x,
@@ -120,6 +131,7 @@ void Triangle::drawOutline(const Color& c) const {
              mesh->positions[v3].y,
              mesh->positions[v3].z);
   glEnd();
+#endif
 }
 
 
@@ -45,8 +45,9 @@ namespace CMU462 { namespace StaticScene {
    /**
     * Ray - Triangle intersection 2.
     * Check if the given ray intersects with the triangle, if so, the input
-    * intersection data is updated to contain intersection information for the
-    * point of intersection.
+    * intersection data is updated with the time of intersection, the
+    * primitive and its barycentric coordinates. Shading data is left to
+    * finalize_hit.
     * \param r ray to test intersection with
     * \param i address to store intersection info
     * \return true if the given ray intersects with the triangle,
@@ -54,6 +55,13 @@ namespace CMU462 { namespace StaticScene {
     */
   bool intersect(const Ray& r, Intersection* i) const;
 
+  /**
+   * Compute the shading normal and BSDF for a hit on this triangle.
+   * \param r ray that produced the intersection
+   * \param i intersection recorded by intersect
+   */
+  void finalize_hit(const Ray& r, Intersection* i) const;
+
   /**
    * Get BSDF.
    * In the case of a triangle, the surface material BSDF is stored in 
@@ -61,6 +69,20 @@ namespace CMU462 { namespace StaticScene {
    */
   BSDF* get_bsdf() const { return mesh->get_bsdf(); }
 
+  /**
+   * Get the scene object, the mesh the triangle is a part of.
+   */
+  const SceneObject* get_object() const { return mesh; }
+
+  /**
+   * Get the world space positions of the triangle's vertices.
+   */
+  void get_vertices(Vector3D* a, Vector3D* b, Vector3D* c) const {
+    *a = mesh->positions[v1];
+    *b = mesh->positions[v2];
+    *c = mesh->positions[v3];
+  }
+
   /**
    * Draw with OpenGL (for visualizer)
    */
@@ -0,0 +1,65 @@
+#include "thread_pool.h"
+
+namespace CMU462 {
+
+ThreadPool::ThreadPool(size_t num_threads) : active(0), quit(false) {
+
+  if (num_threads == 0) num_threads = 1;
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads.push_back(std::thread(&ThreadPool::worker_loop, this));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+
+  wait();
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    quit = true;
+  }
+  has_work.notify_all();
+
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i].join();
+  }
+}
+
+void ThreadPool::submit(const std::function<void()>& task) {
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    tasks.push_back(task);
+  }
+  has_work.notify_one();
+}
+
+void ThreadPool::wait() {
+
+  std::unique_lock<std::mutex> guard(lock);
+  all_done.wait(guard, [this] { return tasks.empty() && active == 0; });
+}
+
+void ThreadPool::worker_loop() {
+
+  std::unique_lock<std::mutex> guard(lock);
+  while (true) {
+
+    // park until there is work to do
+    has_work.wait(guard, [this] { return quit || !tasks.empty(); });
+    if (tasks.empty()) return;
+
+    std::function<void()> task = tasks.front();
+    tasks.pop_front();
+    active++;
+
+    guard.unlock();
+    task();
+    guard.lock();
+
+    active--;
+    if (tasks.empty() && active == 0) all_done.notify_all();
+  }
+}
+
+}  // namespace CMU462
@@ -0,0 +1,71 @@
+#ifndef CMU462_THREAD_POOL_H
+#define CMU462_THREAD_POOL_H
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+namespace CMU462 {
+
+/**
+ * A fixed set of persistent worker threads executing submitted tasks.
+ * Idle workers sleep on a condition variable, so an idle pool costs nothing.
+ * The pool is shared by the renderer and the BVH builders, which must not be
+ * running at the same time since wait() waits for all outstanding tasks.
+ */
+class ThreadPool {
+ public:
+
+  /**
+   * Constructor.
+   * Starts the worker threads.
+   * \param num_threads number of worker threads (at least one is created)
+   */
+  ThreadPool(size_t num_threads);
+
+  /**
+   * Destructor.
+   * Finishes all outstanding tasks and joins the worker threads.
+   */
+  ~ThreadPool();
+
+  /**
+   * Number of worker threads in the pool.
+   */
+  size_t size() const { return threads.size(); }
+
+  /**
+   * Queue a task to be run on one of the worker threads.
+   * \param task the task to run
+   */
+  void submit(const std::function<void()>& task);
+
+  /**
+   * Block until all submitted tasks have completed.
+   * Must not be called from a task.
+   */
+  void wait();
+
+ private:
+
+  /**
+   * Implementation of a pool worker thread.
+   */
+  void worker_loop();
+
+  std::vector<std::thread> threads;         ///< worker threads
+  std::deque<std::function<void()> > tasks; ///< tasks waiting to be run
+  std::mutex lock;                          ///< guards tasks, active and quit
+  std::condition_variable has_work;         ///< signaled on new work or quit
+  std::condition_variable all_done;         ///< signaled when the pool idles
+  size_t active;                            ///< number of running tasks
+  bool quit;                                ///< workers should exit
+
+};
+
+}  // namespace CMU462
+
+#endif  // CMU462_THREAD_POOL_H
@@ -1,53 +1,212 @@
 #ifndef __WORK_QUEUE_H__
 #define __WORK_QUEUE_H__
 
-#include <mutex>
+#include <atomic>
 #include <vector>
 
 /**
- * Note that this queue has no wait-until-more-work-is-added capability; it's
- * intended for more isolated or batch-processing-like situations.
+ * Fixed capacity Chase-Lev work stealing deque (see Le et al. 2013, "Correct
+ * and Efficient Work-Stealing for Weak Memory Models").
+ * The owner pushes and pops at the bottom, thieves steal from the top. There
+ * are no locks; only the last item is contended between the owner and thieves.
+ * The ring buffer does not grow, so no more than capacity items may be in the
+ * deque at any time. T should be a small, trivially copyable type.
  */
 template <class T>
-class WorkQueue {
+class WorkDeque {
+ public:
+
+  WorkDeque(size_t capacity) : storage(capacity > 0 ? capacity : 1) {
+    top = 0;
+    bottom = 0;
+  }
+
+  /**
+   * Push an item at the bottom. Owner only.
+   */
+  void push(const T& item) {
+    long b = bottom.load(std::memory_order_relaxed);
+    storage[b % storage.size()] = item;
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+  }
+
+  /**
+   * Pop the most recently pushed item. Owner only.
+   */
+  bool pop(T *outPtr) {
+    long b = bottom.load(std::memory_order_relaxed) - 1;
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long t = top.load(std::memory_order_relaxed);
+
+    if (t > b) {
+      // empty
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return false;
+    }
+
+    *outPtr = storage[b % storage.size()];
+    if (t == b) {
+      // last item, race against thieves
+      bool won = top.compare_exchange_strong(t, t + 1,
+                                             std::memory_order_seq_cst,
+                                             std::memory_order_relaxed);
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  /**
+   * Steal the least recently pushed item. May be called from any thread.
+   * Fails if the deque is empty or another thread won the race for the item.
+   */
+  bool steal(T *outPtr) {
+    long t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long b = bottom.load(std::memory_order_acquire);
+    if (t >= b) return false;
+
+    T item = storage[t % storage.size()];
+    if (!top.compare_exchange_strong(t, t + 1,
+                                     std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+      return false;
+    }
+    *outPtr = item;
+    return true;
+  }
+
+  bool is_empty() const {
+    return top.load(std::memory_order_acquire) >=
+           bottom.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Drop all items. Not thread safe, only call while no thread uses the deque.
+   */
+  void clear() {
+    top = 0;
+    bottom = 0;
+  }
+
  private:
   std::vector<T> storage;
-  std::mutex lock;
+  std::atomic<long> top;
+  char pad[64];  // keep top and bottom on separate cache lines
+  std::atomic<long> bottom;
+};
 
+/**
+ * A set of per-worker work stealing deques. Each worker takes work from its
+ * own deque and, once that runs dry, steals from randomly chosen victims.
+ * Note that there is no wait-until-more-work-is-added capability; work is
+ * seeded up front and the workers run until all deques are empty.
+ */
+template <class T>
+class WorkQueue {
  public:
 
   WorkQueue() {}
 
-  bool is_empty() {
-    lock.lock();
-    bool result = storage.empty();
-    lock.unlock();
-    return result;
+  ~WorkQueue() {
+    for (size_t i = 0; i < deques.size(); ++i) delete deques[i];
   }
 
-  bool try_get_work(T *outPtr) {
-    lock.lock();
-    if (storage.empty()) {
-      lock.unlock();
-      return false;
+  /**
+   * Set up one deque per worker, each able to hold capacity items.
+   * Not thread safe, only call while no worker is running.
+   */
+  void reset(size_t num_workers, size_t capacity) {
+    for (size_t i = 0; i < deques.size(); ++i) delete deques[i];
+    deques.resize(num_workers);
+    victim_seeds.resize(num_workers);
+    for (size_t i = 0; i < num_workers; ++i) {
+      deques[i] = new WorkDeque<T>(capacity);
+      victim_seeds[i] = 2654435761u * (i + 1);
+    }
+  }
+
+  size_t num_workers() const { return deques.size(); }
+
+  bool is_empty() {
+    for (size_t i = 0; i < deques.size(); ++i) {
+      if (!deques[i]->is_empty()) return false;
     }
-    *outPtr = storage.front();
-    storage.erase(storage.begin());
-    lock.unlock();
     return true;
   }
 
-  void put_work(const T& item) {
-    lock.lock();
-    storage.push_back(item);
-    lock.unlock();
+  /**
+   * Get work for the given worker, stealing from other workers once its own
+   * deque is empty. Returns false only when every deque is empty.
+   */
+  bool try_get_work(size_t worker, T *outPtr) {
+    if (deques[worker]->pop(outPtr)) return true;
+
+    size_t n = deques.size();
+    while (true) {
+
+      // randomized stealing
+      for (size_t attempt = 0; attempt < 2 * n; ++attempt) {
+        size_t victim = next_victim(worker);
+        if (victim != worker && deques[victim]->steal(outPtr)) return true;
+      }
+
+      // sweep all deques before giving up, retrying lost races
+      bool any = false;
+      for (size_t i = 0; i < n; ++i) {
+        if (deques[i]->steal(outPtr)) return true;
+        any = any || !deques[i]->is_empty();
+      }
+      if (!any) return false;
+    }
+  }
+
+  /**
+   * Add work to the given worker's deque. Only call from that worker, or
+   * while no worker is running.
+   */
+  void put_work(size_t worker, const T& item) {
+    deques[worker]->push(item);
   }
 
+  /**
+   * Distribute items over the workers in contiguous chunks, so neighboring
+   * items stay on the same worker. Each worker processes its chunk in order
+   * while thieves take from the far end. Only call while no worker is running.
+   */
+  void put_work(const std::vector<T>& items) {
+    size_t n = deques.size();
+    for (size_t worker = 0; worker < n; ++worker) {
+      size_t begin = items.size() * worker / n;
+      size_t end = items.size() * (worker + 1) / n;
+      for (size_t i = end; i > begin; --i) {
+        deques[worker]->push(items[i - 1]);
+      }
+    }
+  }
+
+  /**
+   * Drop all work. Only call while no worker is running.
+   */
   void clear() {
-    lock.lock();
-    storage.clear();
-    lock.unlock();
+    for (size_t i = 0; i < deques.size(); ++i) deques[i]->clear();
+  }
+
+ private:
+
+  size_t next_victim(size_t worker) {
+    // xorshift, only ever touched by its own worker
+    unsigned int& x = victim_seeds[worker];
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x % deques.size();
   }
+
+  std::vector<WorkDeque<T>*> deques;
+  std::vector<unsigned int> victim_seeds;
 };
 
 #endif  // WORK_QUEUE_H_